@@ -0,0 +1,575 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "output_file.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_DIGEST
+#include <immintrin.h>
+#endif
+
+inline uint64_t readLE64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+inline uint32_t readLE32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotr32(uint32_t v, int n)
+{
+	return (v >> n) | (v << (32 - n));
+}
+
+inline void sha256CompressGeneric(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+	for(;blocks;blocks--,data+=64)
+	{
+		uint32_t w[64];
+		for(int i=0;i<16;i++)
+			w[i] = (uint32_t(data[i * 4]) << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+		for(int i=16;i<64;i++)
+		{
+			uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for(int i=0;i<64;i++)
+		{
+			uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+			uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#ifdef HAVE_X86_DIGEST
+// The SHA extensions work on the state as the (ABEF, CDGH) pair, 4 rounds at a time
+__attribute__((target("sha,sse4.1"))) inline void sha256CompressShaNi(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xb1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1b);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+	for(;blocks;blocks--,data+=64)
+	{
+		__m128i savedState0 = state0;
+		__m128i savedState1 = state1;
+		__m128i msg[4];
+#pragma GCC unroll 16
+		for(int i=0;i<16;i++)
+		{
+			if(i < 4)
+				msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), byteSwap);
+			else
+			{
+				// The schedule for the next 4 words only needs the previous 16
+				__m128i w = _mm_sha256msg1_epu32(msg[i % 4], msg[(i + 1) % 4]);
+				w = _mm_add_epi32(w, _mm_alignr_epi8(msg[(i + 3) % 4], msg[(i + 2) % 4], 4));
+				msg[i % 4] = _mm_sha256msg2_epu32(w, msg[(i + 3) % 4]);
+			}
+			__m128i m = _mm_add_epi32(msg[i % 4], _mm_loadu_si128((const __m128i*)(sha256K + i * 4)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0e));
+		}
+		state0 = _mm_add_epi32(state0, savedState0);
+		state1 = _mm_add_epi32(state1, savedState1);
+	}
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i*)state, state0);
+	_mm_storeu_si128((__m128i*)(state + 4), state1);
+}
+#endif
+
+// Streaming SHA-256, the SHA extensions are used when the CPU has them
+class Sha256
+{
+private:
+	typedef void (*CompressFunc)(uint32_t state[8], const uint8_t* data, size_t blocks);
+	uint32_t state[8];
+	uint8_t buffer[64];
+	uint64_t totalLen;
+	uint32_t bufferedLen;
+	static CompressFunc getCompress()
+	{
+#ifdef HAVE_X86_DIGEST
+		static const CompressFunc f = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1") ?
+			sha256CompressShaNi : sha256CompressGeneric;
+		return f;
+#else
+		return sha256CompressGeneric;
+#endif
+	}
+public:
+	Sha256()
+	{
+		reset();
+	}
+	void reset()
+	{
+		static const uint32_t initialState[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+		memcpy(state, initialState, sizeof(state));
+		totalLen = 0;
+		bufferedLen = 0;
+	}
+	void update(const void* data, size_t len)
+	{
+		const uint8_t* p = (const uint8_t*)data;
+		totalLen += len;
+		if(bufferedLen)
+		{
+			size_t n = std::min<size_t>(64 - bufferedLen, len);
+			memcpy(buffer + bufferedLen, p, n);
+			bufferedLen += n;
+			p += n;
+			len -= n;
+			if(bufferedLen < 64)
+				return;
+			getCompress()(state, buffer, 1);
+			bufferedLen = 0;
+		}
+		if(len >= 64)
+		{
+			getCompress()(state, p, len / 64);
+			p += len & ~size_t(63);
+			len &= 63;
+		}
+		memcpy(buffer, p, len);
+		bufferedLen = len;
+	}
+	void finish(uint8_t out[32])
+	{
+		uint64_t bitLen = totalLen * 8;
+		uint8_t pad[72] = { 0x80 };
+		// Pad to 56 mod 64, then the length
+		size_t padLen = (bufferedLen < 56 ? 56 : 120) - bufferedLen;
+		for(int i=0;i<8;i++)
+			pad[padLen + i] = bitLen >> (56 - i * 8);
+		update(pad, padLen + 8);
+		for(int i=0;i<8;i++)
+		{
+			out[i * 4] = state[i] >> 24;
+			out[i * 4 + 1] = state[i] >> 16;
+			out[i * 4 + 2] = state[i] >> 8;
+			out[i * 4 + 3] = state[i];
+		}
+	}
+};
+
+static const uint8_t xxh3Secret[192] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static const uint32_t xxhPrime32_1 = 0x9e3779b1u;
+static const uint32_t xxhPrime32_2 = 0x85ebca77u;
+static const uint32_t xxhPrime32_3 = 0xc2b2ae3du;
+static const uint64_t xxhPrime64_1 = 0x9e3779b185ebca87ull;
+static const uint64_t xxhPrime64_2 = 0xc2b2ae3d27d4eb4full;
+static const uint64_t xxhPrime64_3 = 0x165667b19e3779f9ull;
+static const uint64_t xxhPrime64_4 = 0x85ebca77c2b2ae63ull;
+static const uint64_t xxhPrime64_5 = 0x27d4eb2f165667c5ull;
+
+// Accumulate one 64-byte stripe into the 8 lanes
+inline void xxh3AccumulateGeneric(uint64_t acc[8], const uint8_t* in, const uint8_t* secret)
+{
+	for(int i=0;i<8;i++)
+	{
+		uint64_t v = readLE64(in + i * 8);
+		uint64_t key = v ^ readLE64(secret + i * 8);
+		acc[i ^ 1] += v;
+		acc[i] += (key & 0xffffffff) * (key >> 32);
+	}
+}
+
+inline void xxh3ScrambleGeneric(uint64_t acc[8], const uint8_t* secret)
+{
+	for(int i=0;i<8;i++)
+	{
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= readLE64(secret + i * 8);
+		acc[i] = a * xxhPrime32_1;
+	}
+}
+
+#ifdef HAVE_X86_DIGEST
+__attribute__((target("avx2"))) inline void xxh3AccumulateAvx2(uint64_t acc[8], const uint8_t* in, const uint8_t* secret)
+{
+	for(int i=0;i<2;i++)
+	{
+		__m256i* a = (__m256i*)acc + i;
+		__m256i v = _mm256_loadu_si256((const __m256i*)in + i);
+		__m256i key = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)secret + i));
+		__m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+		// Each lane also gets the input of its neighbour
+		__m256i swapped = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+		_mm256_storeu_si256(a, _mm256_add_epi64(_mm256_add_epi64(_mm256_loadu_si256(a), swapped), product));
+	}
+}
+
+__attribute__((target("avx2"))) inline void xxh3ScrambleAvx2(uint64_t acc[8], const uint8_t* secret)
+{
+	const __m256i prime = _mm256_set1_epi32(xxhPrime32_1);
+	for(int i=0;i<2;i++)
+	{
+		__m256i* a = (__m256i*)acc + i;
+		__m256i v = _mm256_loadu_si256(a);
+		v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 47));
+		v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)secret + i));
+		// 64x32 bit multiply from two 32x32 ones
+		__m256i low = _mm256_mul_epu32(v, prime);
+		__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+		_mm256_storeu_si256(a, _mm256_add_epi64(low, _mm256_slli_epi64(high, 32)));
+	}
+}
+#endif
+
+// Streaming 64-bit XXH3 with the default secret and seed, AVX2 is used for long inputs
+// when available
+class Xxh3
+{
+private:
+	typedef void (*AccumulateFunc)(uint64_t acc[8], const uint8_t* in, const uint8_t* secret);
+	typedef void (*ScrambleFunc)(uint64_t acc[8], const uint8_t* secret);
+	static const uint32_t stripeLen = 64;
+	static const uint32_t stripesPerBlock = (sizeof(xxh3Secret) - stripeLen) / 8;
+	// Inputs up to 240 bytes are hashed in one go, the buffer is big enough for them
+	static const uint32_t bufferSize = 256;
+	uint64_t acc[8];
+	uint8_t buffer[bufferSize];
+	// The last stripe consumed, needed if less than a stripe is buffered at the end
+	uint8_t lastStripe[stripeLen];
+	uint64_t totalLen;
+	uint32_t bufferedLen;
+	uint32_t stripesInBlock;
+	static AccumulateFunc getAccumulate()
+	{
+#ifdef HAVE_X86_DIGEST
+		static const AccumulateFunc f = __builtin_cpu_supports("avx2") ? xxh3AccumulateAvx2 : xxh3AccumulateGeneric;
+		return f;
+#else
+		return xxh3AccumulateGeneric;
+#endif
+	}
+	static ScrambleFunc getScramble()
+	{
+#ifdef HAVE_X86_DIGEST
+		static const ScrambleFunc f = __builtin_cpu_supports("avx2") ? xxh3ScrambleAvx2 : xxh3ScrambleGeneric;
+		return f;
+#else
+		return xxh3ScrambleGeneric;
+#endif
+	}
+	static uint64_t mulFold64(uint64_t a, uint64_t b)
+	{
+		unsigned __int128 p = (unsigned __int128)a * b;
+		return uint64_t(p) ^ uint64_t(p >> 64);
+	}
+	static uint64_t rotl64(uint64_t v, int n)
+	{
+		return (v << n) | (v >> (64 - n));
+	}
+	static uint64_t avalanche(uint64_t h)
+	{
+		h ^= h >> 37;
+		h *= 0x165667919e3779f9ull;
+		return h ^ (h >> 32);
+	}
+	static uint64_t mix16(const uint8_t* in, const uint8_t* secret)
+	{
+		return mulFold64(readLE64(in) ^ readLE64(secret), readLE64(in + 8) ^ readLE64(secret + 8));
+	}
+	static uint64_t hashShort(const uint8_t* in, size_t len)
+	{
+		const uint8_t* s = xxh3Secret;
+		if(len == 0)
+		{
+			uint64_t h = readLE64(s + 56) ^ readLE64(s + 64);
+			h ^= h >> 33;
+			h *= xxhPrime64_2;
+			h ^= h >> 29;
+			h *= xxhPrime64_3;
+			return h ^ (h >> 32);
+		}
+		if(len <= 3)
+		{
+			uint32_t combined = (uint32_t(in[0]) << 16) | (uint32_t(in[len >> 1]) << 24) | in[len - 1] | (uint32_t(len) << 8);
+			uint64_t h = uint64_t(combined) ^ (readLE32(s) ^ readLE32(s + 4));
+			h ^= h >> 33;
+			h *= xxhPrime64_2;
+			h ^= h >> 29;
+			h *= xxhPrime64_3;
+			return h ^ (h >> 32);
+		}
+		if(len <= 8)
+		{
+			uint64_t v = readLE32(in + len - 4) + (uint64_t(readLE32(in)) << 32);
+			uint64_t h = v ^ (readLE64(s + 8) ^ readLE64(s + 16));
+			h ^= rotl64(h, 49) ^ rotl64(h, 24);
+			h *= 0x9fb21c651e98df25ull;
+			h ^= (h >> 35) + len;
+			h *= 0x9fb21c651e98df25ull;
+			return h ^ (h >> 28);
+		}
+		if(len <= 16)
+		{
+			uint64_t low = readLE64(in) ^ (readLE64(s + 24) ^ readLE64(s + 32));
+			uint64_t high = readLE64(in + len - 8) ^ (readLE64(s + 40) ^ readLE64(s + 48));
+			return avalanche(len + __builtin_bswap64(low) + high + mulFold64(low, high));
+		}
+		uint64_t h = len * xxhPrime64_1;
+		if(len <= 128)
+		{
+			if(len > 32)
+			{
+				if(len > 64)
+				{
+					if(len > 96)
+					{
+						h += mix16(in + 48, s + 96);
+						h += mix16(in + len - 64, s + 112);
+					}
+					h += mix16(in + 32, s + 64);
+					h += mix16(in + len - 48, s + 80);
+				}
+				h += mix16(in + 16, s + 32);
+				h += mix16(in + len - 32, s + 48);
+			}
+			h += mix16(in, s);
+			h += mix16(in + len - 16, s + 16);
+			return avalanche(h);
+		}
+		for(int i=0;i<8;i++)
+			h += mix16(in + i * 16, s + i * 16);
+		h = avalanche(h);
+		uint64_t end = mix16(in + len - 16, s + 136 - 17);
+		for(size_t i=8;i<len/16;i++)
+			end += mix16(in + i * 16, s + (i - 8) * 16 + 3);
+		return avalanche(h + end);
+	}
+	void consumeStripes(const uint8_t* in, uint32_t count)
+	{
+		AccumulateFunc accumulate = getAccumulate();
+		ScrambleFunc scramble = getScramble();
+		for(uint32_t i=0;i<count;i++,in+=stripeLen)
+		{
+			accumulate(acc, in, xxh3Secret + stripesInBlock * 8);
+			if(++stripesInBlock == stripesPerBlock)
+			{
+				scramble(acc, xxh3Secret + sizeof(xxh3Secret) - stripeLen);
+				stripesInBlock = 0;
+			}
+		}
+	}
+	// Process all the complete stripes but the last one, the input does not fit the buffer
+	__attribute__((noinline)) void consume(const uint8_t* p, size_t len)
+	{
+		if(bufferedLen)
+		{
+			size_t n = bufferSize - bufferedLen;
+			memcpy(buffer + bufferedLen, p, n);
+			p += n;
+			len -= n;
+			consumeStripes(buffer, bufferSize / stripeLen);
+			memcpy(lastStripe, buffer + bufferSize - stripeLen, stripeLen);
+			bufferedLen = 0;
+		}
+		if(len > bufferSize)
+		{
+			size_t count = (len - 1) / stripeLen;
+			consumeStripes(p, count);
+			memcpy(lastStripe, p + (count - 1) * stripeLen, stripeLen);
+			p += count * stripeLen;
+			len -= count * stripeLen;
+		}
+		memcpy(buffer, p, len);
+		bufferedLen = len;
+	}
+public:
+	Xxh3()
+	{
+		reset();
+	}
+	void reset()
+	{
+		static const uint64_t initialAcc[8] = {
+			xxhPrime32_3, xxhPrime64_1, xxhPrime64_2, xxhPrime64_3, xxhPrime64_4, xxhPrime32_2, xxhPrime64_5, xxhPrime32_1
+		};
+		memcpy(acc, initialAcc, sizeof(acc));
+		totalLen = 0;
+		bufferedLen = 0;
+		stripesInBlock = 0;
+	}
+	void update(const void* data, size_t len)
+	{
+		totalLen += len;
+		// Something is always left buffered, the last stripe is special
+		if(bufferedLen + len <= bufferSize)
+		{
+			memcpy(buffer + bufferedLen, data, len);
+			bufferedLen += len;
+		}
+		else
+			consume((const uint8_t*)data, len);
+	}
+	uint64_t finish()
+	{
+		if(totalLen <= 240)
+			return hashShort(buffer, totalLen);
+		// Work on a copy, so that more data could still be added
+		Xxh3 s = *this;
+		uint32_t count = (bufferedLen - 1) / stripeLen;
+		s.consumeStripes(buffer, count);
+		uint8_t last[stripeLen];
+		if(bufferedLen >= stripeLen)
+			memcpy(last, buffer + bufferedLen - stripeLen, stripeLen);
+		else
+		{
+			memcpy(last, lastStripe + bufferedLen, stripeLen - bufferedLen);
+			memcpy(last + stripeLen - bufferedLen, buffer, bufferedLen);
+		}
+		// The last stripe uses a secret offset which is not aligned to 8
+		getAccumulate()(s.acc, last, xxh3Secret + sizeof(xxh3Secret) - stripeLen - 7);
+		// Merge the lanes, again with an unaligned secret
+		uint64_t h = totalLen * xxhPrime64_1;
+		for(int i=0;i<4;i++)
+			h += mulFold64(s.acc[i * 2] ^ readLE64(xxh3Secret + 11 + i * 16), s.acc[i * 2 + 1] ^ readLE64(xxh3Secret + 11 + i * 16 + 8));
+		return avalanche(h);
+	}
+};
+
+struct DigestResult
+{
+	uint8_t sha256[32];
+	uint64_t xxh3;
+};
+
+// The digests of an output, computed while its bytes are written
+class OutputDigest
+{
+private:
+	Sha256 sha256;
+	Xxh3 xxh3;
+public:
+	void reset()
+	{
+		sha256.reset();
+		xxh3.reset();
+	}
+	void update(const void* data, size_t len)
+	{
+		sha256.update(data, len);
+		xxh3.update(data, len);
+	}
+	DigestResult finish()
+	{
+		DigestResult r;
+		sha256.finish(r.sha256);
+		r.xxh3 = xxh3.finish();
+		return r;
+	}
+};
+
+// A list of digests in the BSD tagged format, which 'sha256sum -c' can check
+class DigestManifest
+{
+private:
+	std::string text;
+public:
+	void add(const std::string& path, const DigestResult& r)
+	{
+		char hex[65];
+		for(int i=0;i<32;i++)
+			snprintf(hex + i * 2, 3, "%02x", r.sha256[i]);
+		text += "SHA256 (" + path + ") = " + hex + "\n";
+		snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)r.xxh3);
+		text += "XXH3 (" + path + ") = " + hex + "\n";
+	}
+	// The manifest is renamed in place together with the outputs
+	bool write(OutputBatch& batch, const char* path)
+	{
+		return batch.addBuffer(path, text.data(), text.size());
+	}
+};
+
+#endif
@@ -0,0 +1,630 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DS_STORE_READER_H
+#define DS_STORE_READER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+constexpr uint16_t readInt16(const uint8_t* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+constexpr uint32_t readInt32(const uint8_t* p)
+{
+	return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Also usable for compile time constants
+constexpr uint32_t fourCC(const char* s)
+{
+	return (uint32_t(uint8_t(s[0])) << 24) | (uint8_t(s[1]) << 16) | (uint8_t(s[2]) << 8) | uint8_t(s[3]);
+}
+
+// A single record, all the pointers are views into the mapped file
+struct DSRecord
+{
+	// UTF-16 big endian, nameLen is in code units
+	const uint8_t* name;
+	uint32_t nameLen;
+	uint32_t type;
+	uint32_t dataType;
+	// For 'blob' and 'ustr' the length prefix is skipped
+	const uint8_t* payload;
+	uint32_t payloadLen;
+};
+
+// Parse the record at p, returns the number of bytes it uses or 0 if it is malformed
+inline uint32_t parseRecord(const uint8_t* p, const uint8_t* end, DSRecord& r)
+{
+	const uint8_t* start = p;
+	if(end - p < 4)
+		return 0;
+	r.nameLen = readInt32(p);
+	p += 4;
+	if(uint64_t(end - p) < uint64_t(r.nameLen) * 2 + 8)
+		return 0;
+	r.name = p;
+	p += r.nameLen * 2;
+	r.type = readInt32(p);
+	r.dataType = readInt32(p + 4);
+	p += 8;
+	uint64_t len = 0;
+	switch(r.dataType)
+	{
+		case 0x626f6f6c: // bool
+			len = 1;
+			break;
+		case 0x6c6f6e67: // long
+		case 0x73686f72: // shor
+		case 0x74797065: // type
+			len = 4;
+			break;
+		case 0x636f6d70: // comp
+		case 0x64757463: // dutc
+			len = 8;
+			break;
+		case 0x626c6f62: // blob
+		case 0x75737472: // ustr
+			if(end - p < 4)
+				return 0;
+			len = readInt32(p);
+			if(r.dataType == 0x75737472)
+				len *= 2;
+			p += 4;
+			break;
+		default:
+			return 0;
+	}
+	if(uint64_t(end - p) < len)
+		return 0;
+	r.payload = p;
+	r.payloadLen = len;
+	p += len;
+	return p - start;
+}
+
+// Finder sorts records by case insensitive file name, then by type
+inline int compareNames(const DSRecord& a, const DSRecord& b)
+{
+	uint32_t len = a.nameLen < b.nameLen ? a.nameLen : b.nameLen;
+	for(uint32_t i=0;i<len;i++)
+	{
+		uint16_t ca = readInt16(a.name + i * 2);
+		uint16_t cb = readInt16(b.name + i * 2);
+		if(ca >= 'A' && ca <= 'Z')
+			ca += 'a' - 'A';
+		if(cb >= 'A' && cb <= 'Z')
+			cb += 'a' - 'A';
+		if(ca != cb)
+			return ca < cb ? -1 : 1;
+	}
+	if(a.nameLen != b.nameLen)
+		return a.nameLen < b.nameLen ? -1 : 1;
+	return 0;
+}
+
+inline int compareRecords(const DSRecord& a, const DSRecord& b)
+{
+	int ret = compareNames(a, b);
+	if(ret != 0)
+		return ret;
+	if(a.type != b.type)
+		return a.type < b.type ? -1 : 1;
+	return 0;
+}
+
+// Convert the UTF-16 file name to UTF-8 for display
+inline std::string recordName(const DSRecord& r)
+{
+	std::string ret;
+	for(uint32_t i=0;i<r.nameLen;i++)
+	{
+		uint32_t c = readInt16(r.name + i * 2);
+		if(c >= 0xd800 && c < 0xdc00 && i + 1 < r.nameLen)
+		{
+			uint32_t low = readInt16(r.name + i * 2 + 2);
+			if(low >= 0xdc00 && low < 0xe000)
+			{
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				i++;
+			}
+		}
+		if(c < 0x80)
+			ret += char(c);
+		else if(c < 0x800)
+		{
+			ret += char(0xc0 | (c >> 6));
+			ret += char(0x80 | (c & 0x3f));
+		}
+		else if(c < 0x10000)
+		{
+			ret += char(0xe0 | (c >> 12));
+			ret += char(0x80 | ((c >> 6) & 0x3f));
+			ret += char(0x80 | (c & 0x3f));
+		}
+		else
+		{
+			ret += char(0xf0 | (c >> 18));
+			ret += char(0x80 | ((c >> 12) & 0x3f));
+			ret += char(0x80 | ((c >> 6) & 0x3f));
+			ret += char(0x80 | (c & 0x3f));
+		}
+	}
+	return ret;
+}
+
+// Append the UTF-16 big endian form used in records of a UTF-8 file name
+inline void appendName(const char* s, std::vector<uint8_t>& ret)
+{
+	const uint8_t* p = (const uint8_t*)s;
+	while(*p)
+	{
+		uint32_t c = *p++;
+		uint32_t extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+		if(extra)
+			c &= 0x3f >> extra;
+		for(uint32_t i=0;i<extra && (*p & 0xc0) == 0x80;i++)
+			c = (c << 6) | (*p++ & 0x3f);
+		if(c >= 0x10000)
+		{
+			c -= 0x10000;
+			uint32_t high = 0xd800 + (c >> 10);
+			ret.push_back(high >> 8);
+			ret.push_back(high);
+			c = 0xdc00 + (c & 0x3ff);
+		}
+		ret.push_back(c >> 8);
+		ret.push_back(c);
+	}
+}
+
+inline std::vector<uint8_t> encodeName(const char* s)
+{
+	std::vector<uint8_t> ret;
+	appendName(s, ret);
+	return ret;
+}
+
+// Read-only view of a .DS_Store file, nothing is decoded up front apart from the
+// header and the B-tree master block
+class DSStore
+{
+private:
+	const uint8_t* fileData;
+	size_t fileSize;
+	// Offset of the allocator metadata, relative to the start of the file
+	uint32_t metaDataOffset;
+	uint32_t metaDataSize;
+	uint32_t blockCount;
+	uint32_t rootNode;
+	uint32_t treeLevels;
+	uint32_t recordCount;
+	uint32_t nodeCount;
+	uint32_t pageSize;
+	bool fail(const char* path, const char* msg)
+	{
+		printf("%s: %s\n", path, msg);
+		return false;
+	}
+	bool findBTree(const char* path)
+	{
+		const uint8_t* p = fileData + metaDataOffset;
+		const uint8_t* end = p + metaDataSize;
+		// The block address list is padded to a multiple of 256 entries
+		uint64_t paddedCount = (uint64_t(blockCount) + 255) & ~uint64_t(255);
+		if(uint64_t(end - p) < 8 + paddedCount * 4 + 4)
+			return fail(path, "Truncated allocator metadata");
+		p += 8 + paddedCount * 4;
+		uint32_t dirCount = readInt32(p);
+		p += 4;
+		for(uint32_t i=0;i<dirCount;i++)
+		{
+			if(end - p < 1 || end - p < 1 + p[0] + 4)
+				return fail(path, "Truncated allocator directory");
+			uint32_t nameLen = p[0];
+			uint32_t blockId = readInt32(p + 1 + nameLen);
+			if(nameLen == 4 && memcmp(p + 1, "DSDB", 4) == 0)
+			{
+				const uint8_t* master;
+				uint32_t masterSize;
+				if(!getBlock(blockId, master, masterSize) || masterSize < 20)
+					return fail(path, "Invalid B-tree master block");
+				rootNode = readInt32(master);
+				treeLevels = readInt32(master + 4);
+				recordCount = readInt32(master + 8);
+				nodeCount = readInt32(master + 12);
+				pageSize = readInt32(master + 16);
+				return true;
+			}
+			p += 1 + nameLen + 4;
+		}
+		return fail(path, "No DSDB entry in the allocator directory");
+	}
+public:
+	DSStore():fileData(nullptr),fileSize(0),metaDataOffset(0),metaDataSize(0),blockCount(0),
+		rootNode(0),treeLevels(0),recordCount(0),nodeCount(0),pageSize(0)
+	{
+	}
+	DSStore(const DSStore&) = delete;
+	DSStore& operator=(const DSStore&) = delete;
+	~DSStore()
+	{
+		if(fileData)
+			munmap((void*)fileData, fileSize);
+	}
+	// Map the file, "-" maps stdin if it is redirected from a file
+	// Errors are reported on stdout
+	bool open(const char* path)
+	{
+		int fd = strcmp(path, "-") == 0 ? dup(0) : ::open(path, O_RDONLY);
+		if(fd < 0)
+			return fail(path, "File not found");
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size < 36)
+		{
+			close(fd);
+			return fail(path, "Not a .DS_Store file");
+		}
+		fileSize = st.st_size;
+		void* m = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(m == MAP_FAILED)
+			return fail(path, "Cannot map file");
+		fileData = (const uint8_t*)m;
+		// All the addresses are relative to the end of the 4-byte pre-header
+		if(readInt32(fileData) != 1 || memcmp(fileData + 4, "Bud1", 4) != 0)
+			return fail(path, "Not a .DS_Store file");
+		metaDataOffset = readInt32(fileData + 8) + 4;
+		metaDataSize = readInt32(fileData + 12);
+		if(readInt32(fileData + 16) + 4 != metaDataOffset ||
+			uint64_t(metaDataOffset) + metaDataSize > fileSize || metaDataSize < 8)
+			return fail(path, "Invalid allocator header");
+		blockCount = readInt32(fileData + metaDataOffset);
+		return findBTree(path);
+	}
+	// Blocks are encoded as addr | log2(size)
+	bool getBlock(uint32_t blockId, const uint8_t*& data, uint32_t& size) const
+	{
+		if(blockId >= blockCount || 8 + uint64_t(blockId) * 4 + 4 > metaDataSize)
+			return false;
+		uint32_t v = readInt32(fileData + metaDataOffset + 8 + blockId * 4);
+		uint64_t offset = uint64_t(v & ~0x1fu) + 4;
+		uint32_t log2Size = v & 0x1f;
+		// Some blocks, such as the B-tree master, may extend beyond the end of the file
+		uint64_t blockSize = uint64_t(1) << log2Size;
+		if(offset >= fileSize)
+			return false;
+		if(offset + blockSize > fileSize)
+			blockSize = fileSize - offset;
+		data = fileData + offset;
+		size = blockSize;
+		return true;
+	}
+	uint32_t getRootNode() const
+	{
+		return rootNode;
+	}
+	uint32_t getTreeLevels() const
+	{
+		return treeLevels;
+	}
+	uint32_t getRecordCount() const
+	{
+		return recordCount;
+	}
+	uint32_t getNodeCount() const
+	{
+		return nodeCount;
+	}
+	uint32_t getPageSize() const
+	{
+		return pageSize;
+	}
+	size_t getFileSize() const
+	{
+		return fileSize;
+	}
+};
+
+// Pull parser over the records of a store, in B-tree order. Records are views into the
+// mapped file and only the path from the root to the current node is kept, in a fixed
+// size array, so scanning never allocates whatever the size of the store.
+class DSRecordCursor
+{
+private:
+	enum State { CHILD, RECORD, RIGHT, DONE };
+	struct Frame
+	{
+		const uint8_t* pos;
+		const uint8_t* end;
+		uint32_t remaining;
+		// Zero for leaves
+		uint32_t rightChild;
+		State state;
+	};
+	// Corrupted stores could contain cycles, a sane tree is never this deep
+	static const uint32_t maxDepth = 32;
+	const DSStore& store;
+	Frame path[maxDepth];
+	uint32_t depth;
+	uint32_t maxDepthSeen;
+	bool error;
+	bool pushNode(uint32_t blockId)
+	{
+		const uint8_t* data;
+		uint32_t size;
+		if(depth >= maxDepth || !store.getBlock(blockId, data, size) || size < 8)
+		{
+			error = true;
+			return false;
+		}
+		Frame& f = path[depth++];
+		f.pos = data + 8;
+		f.end = data + size;
+		f.rightChild = readInt32(data);
+		f.remaining = readInt32(data + 4);
+		f.state = CHILD;
+		if(depth > maxDepthSeen)
+			maxDepthSeen = depth;
+		return true;
+	}
+public:
+	DSRecordCursor(const DSStore& s):store(s),depth(0),maxDepthSeen(0),error(false)
+	{
+		pushNode(store.getRootNode());
+	}
+	// Returns false at the end of the tree or on errors, use failed() to tell them apart
+	bool next(DSRecord& r)
+	{
+		while(depth)
+		{
+			Frame& f = path[depth - 1];
+			if(f.rightChild == 0)
+			{
+				// Leaf node, emit the records in order
+				if(f.remaining == 0)
+				{
+					depth--;
+					continue;
+				}
+				uint32_t len = parseRecord(f.pos, f.end, r);
+				if(len == 0)
+					break;
+				f.pos += len;
+				f.remaining--;
+				return true;
+			}
+			// Internal nodes are a sequence of (child, record) pairs followed by the right child
+			switch(f.state)
+			{
+				case CHILD:
+				{
+					if(f.remaining == 0)
+					{
+						f.state = RIGHT;
+						continue;
+					}
+					if(f.end - f.pos < 4)
+					{
+						error = true;
+						break;
+					}
+					uint32_t child = readInt32(f.pos);
+					f.pos += 4;
+					f.state = RECORD;
+					if(!pushNode(child))
+						break;
+					continue;
+				}
+				case RECORD:
+				{
+					uint32_t len = parseRecord(f.pos, f.end, r);
+					if(len == 0)
+						break;
+					f.pos += len;
+					f.remaining--;
+					f.state = CHILD;
+					return true;
+				}
+				case RIGHT:
+				{
+					f.state = DONE;
+					if(!pushNode(f.rightChild))
+						break;
+					continue;
+				}
+				case DONE:
+					depth--;
+					continue;
+			}
+			break;
+		}
+		if(depth)
+		{
+			error = true;
+			depth = 0;
+		}
+		return false;
+	}
+	bool failed() const
+	{
+		return error;
+	}
+	// Number of nodes on the deepest path visited so far, the root counts as 1
+	uint32_t getMaxDepth() const
+	{
+		return maxDepthSeen;
+	}
+};
+
+// The scanning state does not depend on the store size
+static_assert(sizeof(DSRecordCursor) <= 2048, "DSRecordCursor must have a small, fixed size");
+
+// A B-tree node with the offsets of its records decoded
+struct DSNode
+{
+	const uint8_t* data;
+	uint32_t size;
+	// Zero for leaves
+	uint32_t rightChild;
+	std::vector<uint32_t> recordOffsets;
+	// For internal nodes, the child preceding each record
+	std::vector<uint32_t> children;
+};
+
+// Decodes nodes on demand and keeps the most recently used ones, keyed by block id
+class DSNodeCache
+{
+private:
+	typedef std::list<std::pair<uint32_t, DSNode>> NodeList;
+	const DSStore& store;
+	const uint32_t capacity;
+	NodeList nodes;
+	std::unordered_map<uint32_t, NodeList::iterator> index;
+	uint32_t decodedCount;
+	bool decodeNode(uint32_t blockId, DSNode& node)
+	{
+		if(!store.getBlock(blockId, node.data, node.size) || node.size < 8)
+			return false;
+		node.rightChild = readInt32(node.data);
+		uint32_t count = readInt32(node.data + 4);
+		node.recordOffsets.clear();
+		node.children.clear();
+		const uint8_t* p = node.data + 8;
+		const uint8_t* end = node.data + node.size;
+		for(uint32_t i=0;i<count;i++)
+		{
+			if(node.rightChild)
+			{
+				if(end - p < 4)
+					return false;
+				node.children.push_back(readInt32(p));
+				p += 4;
+			}
+			DSRecord r;
+			uint32_t len = parseRecord(p, end, r);
+			if(len == 0)
+				return false;
+			node.recordOffsets.push_back(p - node.data);
+			p += len;
+		}
+		decodedCount++;
+		return true;
+	}
+public:
+	DSNodeCache(const DSStore& s, uint32_t c = 64):store(s),capacity(c ? c : 1),decodedCount(0)
+	{
+	}
+	// The returned node is valid until the next call
+	const DSNode* getNode(uint32_t blockId)
+	{
+		auto it = index.find(blockId);
+		if(it != index.end())
+		{
+			nodes.splice(nodes.begin(), nodes, it->second);
+			return &it->second->second;
+		}
+		// Recycle the least recently used entry, this also keeps the vectors capacity
+		if(nodes.size() >= capacity)
+		{
+			index.erase(nodes.back().first);
+			nodes.splice(nodes.begin(), nodes, std::prev(nodes.end()));
+		}
+		else
+			nodes.emplace_front();
+		nodes.front().first = blockId;
+		if(!decodeNode(blockId, nodes.front().second))
+		{
+			nodes.pop_front();
+			return nullptr;
+		}
+		index[blockId] = nodes.begin();
+		return &nodes.front().second;
+	}
+	uint32_t getDecodedCount() const
+	{
+		return decodedCount;
+	}
+	// Find the first record which is not less than key, descending from the root
+	// Returns false if there is no such record or the tree is malformed
+	bool lowerBound(const DSRecord& key, DSRecord& out)
+	{
+		bool found = false;
+		uint32_t blockId = store.getRootNode();
+		for(uint32_t depth=0;depth<64;depth++)
+		{
+			const DSNode* node = getNode(blockId);
+			if(node == nullptr)
+				return false;
+			// Binary search inside the node
+			uint32_t lo = 0;
+			uint32_t hi = node->recordOffsets.size();
+			while(lo < hi)
+			{
+				uint32_t mid = (lo + hi) / 2;
+				DSRecord r;
+				parseRecord(node->data + node->recordOffsets[mid], node->data + node->size, r);
+				if(compareRecords(r, key) < 0)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if(lo < node->recordOffsets.size())
+			{
+				parseRecord(node->data + node->recordOffsets[lo], node->data + node->size, out);
+				found = true;
+				if(compareRecords(out, key) == 0)
+					return true;
+			}
+			if(node->rightChild == 0)
+				return found;
+			blockId = lo < node->children.size() ? node->children[lo] : node->rightChild;
+		}
+		return false;
+	}
+	// Find the record with the given name and type
+	bool find(const std::vector<uint8_t>& name, uint32_t type, DSRecord& out)
+	{
+		DSRecord key;
+		key.name = name.data();
+		key.nameLen = name.size() / 2;
+		key.type = type;
+		return lowerBound(key, out) && compareRecords(out, key) == 0;
+	}
+};
+
+#endif
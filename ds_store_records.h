@@ -0,0 +1,347 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DS_STORE_RECORDS_H
+#define DS_STORE_RECORDS_H
+
+#include <stdint.h>
+#include <array>
+#include <string_view>
+#include "ds_store_reader.h"
+
+// The layouts of the fixed size records, shared by the writer and the reader. Each field
+// knows its offset, so encoding and decoding are a sequence of big endian loads and stores
+// that the compiler can fully inline.
+
+constexpr void writeInt16(uint8_t* p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+constexpr void writeInt32(uint8_t* p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// A big endian 16-bit member of the record
+template<auto Member, uint32_t Offset>
+struct Int16Field
+{
+	static constexpr uint32_t offset = Offset;
+	static constexpr uint32_t size = 2;
+	template<typename R>
+	static constexpr void encode(const R& r, uint8_t* out)
+	{
+		writeInt16(out + Offset, r.*Member);
+	}
+	template<typename R>
+	static constexpr bool decode(const uint8_t* in, R& r)
+	{
+		r.*Member = readInt16(in + Offset);
+		return true;
+	}
+};
+
+// A big endian 32-bit member of the record, also used for FourCC codes
+template<auto Member, uint32_t Offset>
+struct Int32Field
+{
+	static constexpr uint32_t offset = Offset;
+	static constexpr uint32_t size = 4;
+	template<typename R>
+	static constexpr void encode(const R& r, uint8_t* out)
+	{
+		writeInt32(out + Offset, r.*Member);
+	}
+	template<typename R>
+	static constexpr bool decode(const uint8_t* in, R& r)
+	{
+		r.*Member = readInt32(in + Offset);
+		return true;
+	}
+};
+
+// A 16 or 32-bit value that identifies the record, decoding fails if it does not match
+template<uint32_t Value, uint32_t Offset, uint32_t Size = 4>
+struct TagField
+{
+	static_assert(Size == 2 || Size == 4);
+	static constexpr uint32_t offset = Offset;
+	static constexpr uint32_t size = Size;
+	template<typename R>
+	static constexpr void encode(const R&, uint8_t* out)
+	{
+		if constexpr(Size == 2)
+			writeInt16(out + Offset, Value);
+		else
+			writeInt32(out + Offset, Value);
+	}
+	template<typename R>
+	static constexpr bool decode(const uint8_t* in, R&)
+	{
+		if constexpr(Size == 2)
+			return readInt16(in + Offset) == Value;
+		else
+			return readInt32(in + Offset) == Value;
+	}
+};
+
+// Padding filled with Value, it is ignored when decoding
+template<uint8_t Value, uint32_t Offset, uint32_t Size>
+struct FillField
+{
+	static constexpr uint32_t offset = Offset;
+	static constexpr uint32_t size = Size;
+	template<typename R>
+	static constexpr void encode(const R&, uint8_t* out)
+	{
+		for(uint32_t i=0;i<Size;i++)
+			out[Offset + i] = Value;
+	}
+	template<typename R>
+	static constexpr bool decode(const uint8_t*, R&)
+	{
+		return true;
+	}
+};
+
+template<uint32_t Offset, uint32_t Size>
+using ZeroField = FillField<0, Offset, Size>;
+
+// A length byte followed by the characters, in a fixed size area. Longer strings are truncated,
+// decoded strings are views into the input.
+template<auto Member, uint32_t Offset, uint32_t Size>
+struct PascalStringField
+{
+	static constexpr uint32_t offset = Offset;
+	static constexpr uint32_t size = Size;
+	template<typename R>
+	static constexpr void encode(const R& r, uint8_t* out)
+	{
+		std::string_view s = r.*Member;
+		uint32_t len = s.size() < Size - 1 ? s.size() : Size - 1;
+		out[Offset] = len;
+		for(uint32_t i=0;i<Size - 1;i++)
+			out[Offset + 1 + i] = i < len ? s[i] : 0;
+	}
+	template<typename R>
+	static bool decode(const uint8_t* in, R& r)
+	{
+		uint32_t len = in[Offset];
+		r.*Member = std::string_view((const char*)in + Offset + 1, len < Size - 1 ? len : Size - 1);
+		return len < Size;
+	}
+};
+
+// The fields must cover the record from offset 0 without gaps or overlaps
+template<typename... Fields>
+constexpr uint32_t schemaSize()
+{
+	uint32_t offsets[] = { Fields::offset... };
+	uint32_t sizes[] = { Fields::size... };
+	uint32_t end = 0;
+	for(uint32_t i=0;i<sizeof...(Fields);i++)
+	{
+		if(offsets[i] != end)
+			return 0;
+		end += sizes[i];
+	}
+	return end;
+}
+
+template<typename R, typename... Fields>
+struct RecordSchema
+{
+	typedef R Record;
+	static constexpr uint32_t size = schemaSize<Fields...>();
+	static_assert(size != 0, "Record fields must be contiguous");
+	static constexpr void encode(const R& r, uint8_t* out)
+	{
+		(Fields::encode(r, out), ...);
+	}
+	static constexpr std::array<uint8_t, size> encode(const R& r)
+	{
+		std::array<uint8_t, size> ret{};
+		encode(r, ret.data());
+		return ret;
+	}
+	// Returns false if the payload is too short or the tags do not match, the record might be
+	// partially filled in that case
+	static bool decode(const uint8_t* in, uint32_t len, R& r)
+	{
+		if(len < size)
+			return false;
+		// Decode all the fields without branching on each one
+		return (Fields::decode(in, r) & ...);
+	}
+};
+
+// 'Iloc': the position of the icon center in the window
+struct IconLocation
+{
+	uint32_t x;
+	uint32_t y;
+};
+
+typedef RecordSchema<IconLocation,
+	Int32Field<&IconLocation::x, 0>,
+	Int32Field<&IconLocation::y, 4>,
+	FillField<0xff, 8, 6>,
+	ZeroField<14, 2>> IconLocationSchema;
+static_assert(IconLocationSchema::size == 16);
+
+// 'BKGD': the background, a picture described by the alias in the 'pict' record
+struct BackgroundPicture
+{
+	uint32_t aliasLen;
+};
+
+typedef RecordSchema<BackgroundPicture,
+	TagField<fourCC("PctB"), 0>,
+	Int32Field<&BackgroundPicture::aliasLen, 4>,
+	ZeroField<8, 4>> BackgroundPictureSchema;
+static_assert(BackgroundPictureSchema::size == 12);
+
+// 'fwi0': the bounds of the Finder window and its view
+struct FinderWindow
+{
+	uint16_t top;
+	uint16_t left;
+	uint16_t bottom;
+	uint16_t right;
+	uint32_t viewType;
+};
+
+typedef RecordSchema<FinderWindow,
+	Int16Field<&FinderWindow::top, 0>,
+	Int16Field<&FinderWindow::left, 2>,
+	Int16Field<&FinderWindow::bottom, 4>,
+	Int16Field<&FinderWindow::right, 6>,
+	Int32Field<&FinderWindow::viewType, 8>,
+	ZeroField<12, 4>> FinderWindowSchema;
+static_assert(FinderWindowSchema::size == 16);
+
+// 'icvo': the icon view options
+struct IconViewOptions
+{
+	uint16_t iconSize;
+	uint32_t arrangedBy;
+	uint32_t labelPosition;
+};
+
+typedef RecordSchema<IconViewOptions,
+	TagField<fourCC("icv4"), 0>,
+	Int16Field<&IconViewOptions::iconSize, 4>,
+	Int32Field<&IconViewOptions::arrangedBy, 6>,
+	Int32Field<&IconViewOptions::labelPosition, 10>,
+	ZeroField<14, 12>> IconViewOptionsSchema;
+static_assert(IconViewOptionsSchema::size == 26);
+
+// The fixed part of an alias record (the 'pict' record), the defaults describe a file on the
+// root of an HFS+ volume
+struct AliasHeader
+{
+	uint32_t creatorCode = 0;
+	uint16_t recordSize = 0;
+	uint16_t aliasKind = 0;
+	std::string_view volumeName;
+	uint32_t volumeCreateDate = 0;
+	uint16_t volumeSig = 0x482b; // H+
+	uint16_t driveType = 0;
+	uint32_t parentInode = 2;
+	std::string_view fileName;
+	uint32_t fileInode = 0;
+	uint32_t fileCreateDate = 0;
+	uint32_t fileType = 0;
+	uint32_t fileCreator = 0;
+	uint16_t fileFrom = 0xffff;
+	uint16_t fileTo = 0xffff;
+	uint32_t volumeAttributes = 0;
+	uint16_t volumeFs = 0;
+};
+
+// Only version 2 aliases are supported
+typedef RecordSchema<AliasHeader,
+	Int32Field<&AliasHeader::creatorCode, 0>,
+	Int16Field<&AliasHeader::recordSize, 4>,
+	TagField<2, 6, 2>,
+	Int16Field<&AliasHeader::aliasKind, 8>,
+	PascalStringField<&AliasHeader::volumeName, 10, 28>,
+	Int32Field<&AliasHeader::volumeCreateDate, 38>,
+	Int16Field<&AliasHeader::volumeSig, 42>,
+	Int16Field<&AliasHeader::driveType, 44>,
+	Int32Field<&AliasHeader::parentInode, 46>,
+	PascalStringField<&AliasHeader::fileName, 50, 64>,
+	Int32Field<&AliasHeader::fileInode, 114>,
+	Int32Field<&AliasHeader::fileCreateDate, 118>,
+	Int32Field<&AliasHeader::fileType, 122>,
+	Int32Field<&AliasHeader::fileCreator, 126>,
+	Int16Field<&AliasHeader::fileFrom, 130>,
+	Int16Field<&AliasHeader::fileTo, 132>,
+	Int32Field<&AliasHeader::volumeAttributes, 134>,
+	Int16Field<&AliasHeader::volumeFs, 138>,
+	ZeroField<140, 10>> AliasHeaderSchema;
+static_assert(AliasHeaderSchema::size == 150);
+
+// The header of each extra data item after the fixed part, the data is padded to 2 bytes
+struct AliasExtra
+{
+	uint16_t tag;
+	uint16_t length;
+};
+
+enum AliasExtraTag
+{
+	ALIAS_ABSOLUTE_PATH = 2,
+	ALIAS_END = 0xffff
+};
+
+typedef RecordSchema<AliasExtra,
+	Int16Field<&AliasExtra::tag, 0>,
+	Int16Field<&AliasExtra::length, 2>> AliasExtraSchema;
+static_assert(AliasExtraSchema::size == 4);
+
+// Call f(extra, data) for each extra data item of an alias of len bytes, up to the end tag. An item
+// which does not fit in the alias ends the walk, its data is never read.
+template<typename F>
+inline void forEachAliasExtra(const uint8_t* p, uint32_t len, F f)
+{
+	AliasExtra extra;
+	for(uint32_t offset = AliasHeaderSchema::size;offset + AliasExtraSchema::size <= len;offset += (extra.length + 1) & ~1)
+	{
+		if(!AliasExtraSchema::decode(p + offset, len - offset, extra) || extra.tag == ALIAS_END)
+			return;
+		offset += AliasExtraSchema::size;
+		if(extra.length > len - offset)
+			return;
+		f(extra, p + offset);
+	}
+}
+
+#endif
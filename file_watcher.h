@@ -0,0 +1,161 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <chrono>
+#include <errno.h>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "output_file.h"
+
+// Changes are coalesced until the inputs are quiet for this long, editors and copies often write in several steps
+static const uint32_t watchDebounceMs = 25;
+
+// Wait for changes to a set of files with inotify
+// The parent directories are watched instead of the files, so that files replaced by a rename are seen as well
+class FileWatcher
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+private:
+	int fd;
+	// The error of inotify_init1, reported when files are added
+	int initError;
+	// The watch of each directory
+	std::map<std::string, int> dirs;
+	// The watched files of each directory watch, from the name in the directory to the path as given
+	std::map<int, std::map<std::string, std::string>> files;
+	alignas(struct inotify_event) char eventBuf[16384];
+	// Add the files with pending events to the set
+	bool readEvents(std::set<std::string>& changed)
+	{
+		ssize_t r = read(fd, eventBuf, sizeof(eventBuf));
+		if(r < 0)
+		{
+			if(errno == EINTR || errno == EAGAIN)
+				return true;
+			printf("Cannot read file events: %s\n", strerror(errno));
+			return false;
+		}
+		for(ssize_t i=0;i<r;)
+		{
+			const struct inotify_event* e = (const struct inotify_event*)(eventBuf + i);
+			i += sizeof(struct inotify_event) + e->len;
+			if(e->mask & IN_Q_OVERFLOW)
+			{
+				// Some events are lost, consider everything changed
+				for(const auto& dir: files)
+				{
+					for(const auto& file: dir.second)
+						changed.insert(file.second);
+				}
+				continue;
+			}
+			if(e->len == 0)
+				continue;
+			auto dir = files.find(e->wd);
+			if(dir == files.end())
+				continue;
+			auto file = dir->second.find(e->name);
+			if(file != dir->second.end())
+				changed.insert(file->second);
+		}
+		return true;
+	}
+public:
+	FileWatcher():fd(inotify_init1(IN_CLOEXEC | IN_NONBLOCK)),initError(fd < 0 ? errno : 0)
+	{
+	}
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+	~FileWatcher()
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+	bool addFile(const std::string& path)
+	{
+		if(fd < 0)
+		{
+			printf("Cannot watch files: %s\n", strerror(initError));
+			return false;
+		}
+		std::string dir = parentDirectory(path);
+		auto it = dirs.find(dir);
+		if(it == dirs.end())
+		{
+			// Written files and the ones renamed in place are both complete
+			int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+			if(wd < 0)
+			{
+				printf("Cannot watch %s: %s\n", dir.c_str(), strerror(errno));
+				return false;
+			}
+			it = dirs.emplace(dir, wd).first;
+		}
+		size_t slash = path.rfind('/');
+		files[it->second][slash == std::string::npos ? path : path.substr(slash + 1)] = path;
+		return true;
+	}
+	// Forget the files, the directory watches are kept for the next ones
+	void clearFiles()
+	{
+		files.clear();
+	}
+	// Block until some files changed and then no more events came for watchDebounceMs
+	// firstChange is the time the first change has been seen, to measure the latency of the updates
+	bool wait(std::set<std::string>& changed, Clock::time_point& firstChange)
+	{
+		changed.clear();
+		while(true)
+		{
+			struct pollfd p = { fd, POLLIN, 0 };
+			int r = poll(&p, 1, changed.empty() ? -1 : int(watchDebounceMs));
+			if(r < 0 && errno != EINTR)
+			{
+				printf("Cannot wait for file events: %s\n", strerror(errno));
+				return false;
+			}
+			if(r == 0)
+				return true;
+			bool first = changed.empty();
+			if(r > 0 && !readEvents(changed))
+				return false;
+			if(first && !changed.empty())
+				firstChange = Clock::now();
+		}
+	}
+};
+
+#endif
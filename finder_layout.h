@@ -0,0 +1,486 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FINDER_LAYOUT_H
+#define FINDER_LAYOUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "ds_store_reader.h"
+#include "ds_store_records.h"
+#include "manifest_reader.h"
+
+// An icon of the window, x and y are its center in window coordinates
+struct LayoutItem
+{
+	std::string name;
+	int32_t x;
+	int32_t y;
+};
+
+// What an icon view window shows, read back from a store or from the forge arguments
+struct FinderLayout
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t iconSize = 64;
+	uint32_t textSize = 12;
+	bool labelsRight = false;
+	// The path of the background picture from the root of the volume, empty if there is none
+	std::string background;
+	std::vector<LayoutItem> items;
+};
+
+struct Rect
+{
+	int32_t left;
+	int32_t top;
+	int32_t right;
+	int32_t bottom;
+	bool intersects(const Rect& o) const
+	{
+		return left < o.right && o.left < right && top < o.bottom && o.top < bottom;
+	}
+	bool contains(const Rect& o) const
+	{
+		return left <= o.left && top <= o.top && o.right <= right && o.bottom <= bottom;
+	}
+};
+
+// The absolute path of an alias is volume:path
+inline bool readAliasPath(const uint8_t* p, uint32_t len, std::string& path)
+{
+	AliasHeader alias;
+	if(!AliasHeaderSchema::decode(p, len, alias) || alias.recordSize != len)
+		return false;
+	path = alias.fileName;
+	forEachAliasExtra(p, len, [&path](const AliasExtra& extra, const uint8_t* data)
+	{
+		if(extra.tag == ALIAS_ABSOLUTE_PATH)
+		{
+			const char* s = (const char*)data;
+			std::string_view full(s, strnlen(s, extra.length));
+			size_t colon = full.find(':');
+			if(colon != std::string_view::npos)
+				path = full.substr(colon + 1);
+		}
+	});
+	return true;
+}
+
+// Read the window of a store, the records Finder would use for an icon view
+inline bool loadLayout(const DSStore& store, const char* fileName, FinderLayout& layout)
+{
+	layout = FinderLayout();
+	bool haveWindow = false;
+	DSRecordCursor cursor(store);
+	DSRecord r;
+	while(cursor.next(r))
+	{
+		if(r.nameLen == 1 && readInt16(r.name) == '.')
+		{
+			FinderWindow fw;
+			IconViewOptions iv;
+			if(r.type == fourCC("fwi0") && FinderWindowSchema::decode(r.payload, r.payloadLen, fw))
+			{
+				layout.width = std::max(fw.left, fw.right) - fw.left;
+				layout.height = std::max(fw.top, fw.bottom) - fw.top;
+				haveWindow = true;
+			}
+			else if(r.type == fourCC("icvo") && IconViewOptionsSchema::decode(r.payload, r.payloadLen, iv))
+			{
+				layout.iconSize = iv.iconSize;
+				layout.labelsRight = iv.labelPosition == fourCC("rght");
+			}
+			else if(r.type == fourCC("icvt") && r.payloadLen == 4)
+				layout.textSize = readInt32(r.payload);
+			else if(r.type == fourCC("pict"))
+				readAliasPath(r.payload, r.payloadLen, layout.background);
+			continue;
+		}
+		IconLocation iloc;
+		if(r.type == fourCC("Iloc") && IconLocationSchema::decode(r.payload, r.payloadLen, iloc))
+			layout.items.push_back(LayoutItem{ recordName(r), int32_t(iloc.x), int32_t(iloc.y) });
+	}
+	if(cursor.failed())
+	{
+		printf("Malformed B-tree in %s\n", fileName);
+		return false;
+	}
+	if(!haveWindow)
+	{
+		printf("No window bounds in %s\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+// The layout described by the arguments of forge_ds_store after the output file:
+// bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+
+inline bool parseLayoutArgs(const std::vector<std::string_view>& args, FinderLayout& layout)
+{
+	layout = FinderLayout();
+	if(args.size() < 6 || (args.size() - 6) % 3 != 0)
+	{
+		printf("Expected bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n");
+		return false;
+	}
+	layout.background = args[0];
+	const std::string_view ints[] = { args[1], args[2], args[4], args[5] };
+	uint32_t* values[] = { &layout.width, &layout.height, &layout.iconSize, &layout.textSize };
+	for(uint32_t i=0;i<4;i++)
+	{
+		if(!parseInt(ints[i], *values[i]))
+		{
+			printf("Expected int: %.*s\n", int(ints[i].size()), ints[i].data());
+			return false;
+		}
+	}
+	for(size_t i=6;i<args.size();i+=3)
+	{
+		uint32_t x, y;
+		if(!parseInt(args[i + 1], x) || !parseInt(args[i + 2], y))
+		{
+			printf("Expected the location of %.*s\n", int(args[i].size()), args[i].data());
+			return false;
+		}
+		layout.items.push_back(LayoutItem{ std::string(args[i]), int32_t(x), int32_t(y) });
+	}
+	return true;
+}
+
+inline Rect iconRect(const FinderLayout& layout, const LayoutItem& item)
+{
+	int32_t half = layout.iconSize / 2;
+	return Rect{ item.x - half, item.y - half, item.x - half + int32_t(layout.iconSize), item.y - half + int32_t(layout.iconSize) };
+}
+
+// Finder does not expose its text metrics, the width is estimated per character in 1/100 em
+// for the system font, which is close enough to place the label boxes
+inline uint32_t estimateTextWidth(std::string_view text, uint32_t textSize)
+{
+	uint32_t width = 0;
+	for(uint8_t c: text)
+	{
+		if((c & 0xc0) == 0x80)
+			continue;
+		// Localized names: CJK and most symbols above U+3000 are full width
+		if(c >= 0xe3)
+			width += 100;
+		else if(c >= 0x80)
+			width += 60;
+		else if(strchr("iIjl.,:;'|!", c))
+			width += 28;
+		else if(strchr("mwMW", c))
+			width += 85;
+		else if(c >= 'A' && c <= 'Z')
+			width += 68;
+		else
+			width += 55;
+	}
+	return (width * textSize + 99) / 100;
+}
+
+// The box of the label, below the icon or on its right. Long names wrap on two lines at most.
+inline Rect labelRect(const FinderLayout& layout, const LayoutItem& item)
+{
+	const int32_t pad = 3;
+	int32_t wrap = std::max(layout.iconSize, layout.textSize * 8);
+	int32_t textWidth = estimateTextWidth(item.name, layout.textSize);
+	int32_t lines = textWidth > wrap ? 2 : 1;
+	int32_t width = std::min(textWidth, wrap) + pad * 2;
+	int32_t height = lines * int32_t(layout.textSize * 5 / 4) + 2;
+	int32_t half = layout.iconSize / 2;
+	if(layout.labelsRight)
+	{
+		int32_t left = item.x + half + pad;
+		return Rect{ left, item.y - height / 2, left + width, item.y - height / 2 + height };
+	}
+	int32_t top = item.y + half + pad;
+	return Rect{ item.x - width / 2, top, item.x - width / 2 + width, top + height };
+}
+
+// The area covered by an item, its icon and its label
+inline Rect itemBounds(const FinderLayout& layout, const LayoutItem& item)
+{
+	Rect icon = iconRect(layout, item);
+	Rect label = labelRect(layout, item);
+	return Rect{ std::min(icon.left, label.left), std::min(icon.top, label.top),
+		std::max(icon.right, label.right), std::max(icon.bottom, label.bottom) };
+}
+
+inline bool itemsOverlap(const FinderLayout& layout, const LayoutItem& a, const LayoutItem& b)
+{
+	Rect rects[2][2] = { { iconRect(layout, a), labelRect(layout, a) }, { iconRect(layout, b), labelRect(layout, b) } };
+	for(const Rect& ra: rects[0])
+	{
+		for(const Rect& rb: rects[1])
+		{
+			if(ra.intersects(rb))
+				return true;
+		}
+	}
+	return false;
+}
+
+struct LayoutIssue
+{
+	enum Kind { OUTSIDE, OVERLAP };
+	Kind kind;
+	uint32_t item;
+	// The earlier item, for overlaps
+	uint32_t other;
+};
+
+// Finds the items which fall outside of the window or overlap each other. The items are kept
+// in a uniform grid of cells about as big as an item, so that only the neighbours are compared
+// and big layouts are checked in near linear time.
+class LayoutChecker
+{
+private:
+	// Items are linked in the cells they touch, moving an item bumps its generation and the
+	// stale entries are skipped
+	struct Entry
+	{
+		uint32_t item;
+		uint32_t generation;
+		uint32_t next;
+	};
+	static constexpr uint32_t none = 0xffffffff;
+	int32_t cellSize;
+	uint32_t cols;
+	uint32_t rows;
+	std::vector<uint32_t> heads;
+	std::vector<Entry> entries;
+	std::vector<uint32_t> generations;
+	std::vector<Rect> bounds;
+	// The last query each item was seen by, to visit it once per query
+	std::vector<uint32_t> seen;
+	uint32_t queryId;
+	// Coordinates outside of the window go to the border cells, which keeps the test exact
+	void cellRange(const Rect& r, uint32_t& x0, uint32_t& y0, uint32_t& x1, uint32_t& y1) const
+	{
+		auto cell = [this](int32_t v, uint32_t count)
+		{
+			return v < 0 ? 0u : std::min<uint32_t>(v / cellSize, count - 1);
+		};
+		x0 = cell(r.left, cols);
+		y0 = cell(r.top, rows);
+		x1 = cell(r.right - 1, cols);
+		y1 = cell(r.bottom - 1, rows);
+	}
+	void reset(const FinderLayout& layout)
+	{
+		uint32_t count = layout.items.size();
+		bounds.resize(count);
+		int32_t biggest = 1;
+		for(uint32_t i=0;i<count;i++)
+		{
+			bounds[i] = itemBounds(layout, layout.items[i]);
+			biggest = std::max({ biggest, bounds[i].right - bounds[i].left, bounds[i].bottom - bounds[i].top });
+		}
+		// Cells the size of the biggest item, but not many more cells than items
+		cellSize = biggest;
+		uint64_t area = uint64_t(std::max(layout.width, 1u)) * std::max(layout.height, 1u);
+		while(area / (uint64_t(cellSize) * cellSize) > count * 4 + 64)
+			cellSize *= 2;
+		cols = (std::max(layout.width, 1u) + cellSize - 1) / cellSize;
+		rows = (std::max(layout.height, 1u) + cellSize - 1) / cellSize;
+		heads.assign(size_t(cols) * rows, none);
+		entries.clear();
+		generations.assign(count, 0);
+		seen.assign(count, none);
+		queryId = 0;
+		for(uint32_t i=0;i<count;i++)
+			insert(i);
+	}
+	void insert(uint32_t item)
+	{
+		uint32_t x0, y0, x1, y1;
+		cellRange(bounds[item], x0, y0, x1, y1);
+		for(uint32_t y=y0;y<=y1;y++)
+		{
+			for(uint32_t x=x0;x<=x1;x++)
+			{
+				uint32_t& head = heads[size_t(y) * cols + x];
+				entries.push_back(Entry{ item, generations[item], head });
+				head = entries.size() - 1;
+			}
+		}
+	}
+	// Call f for each item whose bounds may intersect r, once per item
+	template<typename F>
+	void query(const Rect& r, F f)
+	{
+		queryId++;
+		uint32_t x0, y0, x1, y1;
+		cellRange(r, x0, y0, x1, y1);
+		for(uint32_t y=y0;y<=y1;y++)
+		{
+			for(uint32_t x=x0;x<=x1;x++)
+			{
+				for(uint32_t e=heads[size_t(y) * cols + x];e != none;e = entries[e].next)
+				{
+					const Entry& entry = entries[e];
+					if(entry.generation != generations[entry.item] || seen[entry.item] == queryId)
+						continue;
+					seen[entry.item] = queryId;
+					if(bounds[entry.item].intersects(r))
+						f(entry.item);
+				}
+			}
+		}
+	}
+	static bool isInside(const FinderLayout& layout, const Rect& r)
+	{
+		return Rect{ 0, 0, int32_t(layout.width), int32_t(layout.height) }.contains(r);
+	}
+	// Whether the item would fit at x, y without leaving the window or touching another one
+	bool isFree(const FinderLayout& layout, uint32_t item, int32_t x, int32_t y)
+	{
+		LayoutItem moved{ layout.items[item].name, x, y };
+		Rect r = itemBounds(layout, moved);
+		if(!isInside(layout, r))
+			return false;
+		bool free = true;
+		query(r, [&](uint32_t other)
+		{
+			if(other != item && free && itemsOverlap(layout, moved, layout.items[other]))
+				free = false;
+		});
+		return free;
+	}
+public:
+	LayoutChecker():cellSize(1),cols(1),rows(1),queryId(0)
+	{
+	}
+	void check(const FinderLayout& layout, std::vector<LayoutIssue>& issues)
+	{
+		issues.clear();
+		reset(layout);
+		for(uint32_t i=0;i<layout.items.size();i++)
+		{
+			if(!isInside(layout, bounds[i]))
+				issues.push_back(LayoutIssue{ LayoutIssue::OUTSIDE, i, i });
+			// Each pair is reported once, by its later item
+			query(bounds[i], [&](uint32_t other)
+			{
+				if(other < i && itemsOverlap(layout, layout.items[other], layout.items[i]))
+					issues.push_back(LayoutIssue{ LayoutIssue::OVERLAP, i, other });
+			});
+		}
+	}
+	// Move the items with issues to the closest free place, searching in growing squares around
+	// their location, brought back in the window first. Of two overlapping items the later one moves.
+	// Returns the number of items which could not be placed.
+	uint32_t nudge(FinderLayout& layout, const std::vector<LayoutIssue>& issues)
+	{
+		// Crowded windows may have no free place, which would be a search of the whole window
+		// for each item
+		const int32_t maxRing = 64;
+		reset(layout);
+		std::vector<uint32_t> moving;
+		for(const LayoutIssue& issue: issues)
+			moving.push_back(issue.item);
+		std::sort(moving.begin(), moving.end());
+		moving.erase(std::unique(moving.begin(), moving.end()), moving.end());
+		const int32_t step = std::max(4u, layout.iconSize / 8);
+		uint32_t unplaced = 0;
+		for(uint32_t item: moving)
+		{
+			LayoutItem& it = layout.items[item];
+			Rect r = bounds[item];
+			int32_t dx = std::max(0, -r.left) - std::max(0, r.right - int32_t(layout.width));
+			int32_t dy = std::max(0, -r.top) - std::max(0, r.bottom - int32_t(layout.height));
+			it.x += dx;
+			it.y += dy;
+			if((dx || dy) && isFree(layout, item, it.x, it.y))
+			{
+				generations[item]++;
+				bounds[item] = itemBounds(layout, it);
+				insert(item);
+				continue;
+			}
+			bool placed = false;
+			for(int32_t ring=1;ring<=maxRing && !placed;ring++)
+			{
+				// The closest free candidate of the ring
+				int64_t bestDistance = INT64_MAX;
+				int32_t bestX = 0, bestY = 0;
+				for(int32_t dy=-ring;dy<=ring;dy++)
+				{
+					// Only the border of the square is new
+					int32_t dxStep = (dy == -ring || dy == ring) ? 1 : ring * 2;
+					for(int32_t dx=-ring;dx<=ring;dx+=dxStep)
+					{
+						int64_t distance = int64_t(dx) * dx + int64_t(dy) * dy;
+						if(distance >= bestDistance)
+							continue;
+						if(isFree(layout, item, it.x + dx * step, it.y + dy * step))
+						{
+							bestDistance = distance;
+							bestX = it.x + dx * step;
+							bestY = it.y + dy * step;
+						}
+					}
+				}
+				if(bestDistance != INT64_MAX)
+				{
+					it.x = bestX;
+					it.y = bestY;
+					generations[item]++;
+					bounds[item] = itemBounds(layout, it);
+					insert(item);
+					placed = true;
+				}
+			}
+			if(!placed)
+				unplaced++;
+		}
+		return unplaced;
+	}
+};
+
+// Print the issues of a layout, in a form meant for humans
+inline void printLayoutIssues(const char* source, const FinderLayout& layout, const std::vector<LayoutIssue>& issues)
+{
+	for(const LayoutIssue& issue: issues)
+	{
+		const LayoutItem& item = layout.items[issue.item];
+		if(issue.kind == LayoutIssue::OUTSIDE)
+			printf("%s: %s at %d,%d is outside of the %ux%u window\n", source, item.name.c_str(), item.x, item.y,
+				layout.width, layout.height);
+		else
+			printf("%s: %s at %d,%d overlaps %s\n", source, item.name.c_str(), item.x, item.y,
+				layout.items[issue.other].name.c_str());
+	}
+}
+
+#endif
@@ -23,123 +23,144 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <span>
 #include <utility>
 #include <vector>
-#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "digest.h"
+#include "ds_store_reader.h"
+#include "ds_store_records.h"
+#include "file_watcher.h"
+#include "finder_layout.h"
+#include "manifest_reader.h"
+#include "output_file.h"
+#include "thread_pool.h"
 
-struct __attribute__((packed)) AliasFile
-{
-	uint32_t creatorCode;
-	uint16_t recordSize;
-	uint16_t recordVersion;
-	uint16_t aliasKind;
-	uint8_t volumeLenAndName[28];
-	uint32_t volumeCreateDate;
-	uint16_t volumeSig;
-	uint16_t driveType;
-	uint32_t parentInode;
-	uint8_t fileLenAndName[64];
-	uint32_t fileInode;
-	uint32_t fileCreateDate;
-	uint32_t fileType;
-	uint32_t fileCreator;
-	uint16_t fileFrom;
-	uint16_t fileTo;
-	uint32_t volumeAttributes;
-	uint16_t volumeFs;
-	uint8_t reserved[10];
-	uint8_t extraData[0];
-};
-
-struct __attribute__((packed)) PctBRecord
-{
-	uint8_t type[4];
-	uint32_t aliasLen;
-	// Pad to 12 bytes
-	uint32_t pad;
-};
-
-struct __attribute__((packed)) FinderWindowRecord
-{
-	uint16_t top;
-	uint16_t left;
-	uint16_t bottom;
-	uint16_t right;
-	uint8_t viewType[4];
-	uint32_t pad;
-};
-
-struct __attribute__((packed)) Icv4Record
-{
-	uint8_t type[4];
-	uint16_t iconSize;
-	uint8_t arrangedBy[4];
-	uint8_t labelPosition[4];
-	uint8_t pad[12];
-};
-
-class Record: public std::vector<uint8_t>
+// Big endian writer over a fixed size range of memory
+class ByteWriter
 {
 protected:
+	uint8_t* buf;
+	uint32_t bufSize;
 	uint32_t curOffset;
 public:
-	Record(uint32_t size):std::vector<uint8_t>(size, 0),curOffset(0)
+	ByteWriter(uint8_t* b, uint32_t s):buf(b),bufSize(s),curOffset(0)
 	{
 	}
 	void writeInt8(uint8_t v)
 	{
-		std::vector<uint8_t>& d = *this;
-		d[curOffset] = v;
+		assert(curOffset + 1 <= bufSize);
+		buf[curOffset] = v;
 		curOffset++;
 	}
 	void writeInt16(uint16_t v)
 	{
-		std::vector<uint8_t>& d = *this;
-		d[curOffset + 1] = v;
-		d[curOffset + 0] = v >> 8;
+		assert(curOffset + 2 <= bufSize);
+		buf[curOffset + 1] = v;
+		buf[curOffset + 0] = v >> 8;
 		curOffset += 2;
 	}
 	void writeInt32(uint32_t v)
 	{
-		std::vector<uint8_t>& d = *this;
-		d[curOffset + 3] = v;
-		d[curOffset + 2] = v >> 8;
-		d[curOffset + 1] = v >> 16;
-		d[curOffset + 0] = v >> 24;
+		assert(curOffset + 4 <= bufSize);
+		buf[curOffset + 3] = v;
+		buf[curOffset + 2] = v >> 8;
+		buf[curOffset + 1] = v >> 16;
+		buf[curOffset + 0] = v >> 24;
 		curOffset += 4;
 	}
 	void writeStr(const char* s)
 	{
-		std::vector<uint8_t>& d = *this;
 		uint32_t len = strlen(s);
-		for(uint32_t i=0;i<len;i++)
-			d[curOffset + i] = s[i];
+		assert(curOffset + len <= bufSize);
+		memcpy(buf + curOffset, s, len);
 		curOffset += len;
 	}
-	void writeData(const std::vector<uint8_t>& data)
+	void writeData(const uint8_t* data, uint32_t len)
 	{
-		std::vector<uint8_t>& d = *this;
-		for(uint32_t i=0;i<data.size();i++)
-			d[curOffset + i] = data[i];
-		curOffset += data.size();
+		assert(curOffset + len <= bufSize);
+		memcpy(buf + curOffset, data, len);
+		curOffset += len;
 	}
 	void seek(uint32_t o)
 	{
 		curOffset = o;
 	}
+	uint8_t* data()
+	{
+		return buf;
+	}
+	const uint8_t* data() const
+	{
+		return buf;
+	}
+	uint32_t size() const
+	{
+		return bufSize;
+	}
+	operator std::span<const uint8_t>() const
+	{
+		return std::span<const uint8_t>(buf, bufSize);
+	}
 };
 
-class Block: public Record
+// Small records are stored in place, only bigger ones are allocated on the heap
+class Record: public ByteWriter
 {
 private:
-	const uint32_t addr;
+	static const uint32_t inlineCapacity = 64;
+	uint8_t inlineStorage[inlineCapacity];
+	std::vector<uint8_t> heapStorage;
+	void allocate()
+	{
+		if(bufSize <= inlineCapacity)
+		{
+			memset(inlineStorage, 0, bufSize);
+			buf = inlineStorage;
+		}
+		else
+		{
+			heapStorage.assign(bufSize, 0);
+			buf = heapStorage.data();
+		}
+	}
 public:
-	Block(uint32_t addr, uint32_t size):Record(size),addr(addr)
+	Record(uint32_t size):ByteWriter(nullptr, size)
+	{
+		allocate();
+	}
+	Record(const Record& r):ByteWriter(r)
+	{
+		allocate();
+		memcpy(buf, r.buf, bufSize);
+	}
+	Record& operator=(const Record&) = delete;
+};
+
+// A block is a view into the backing memory of the allocator
+class Block: public ByteWriter
+{
+private:
+	uint32_t addr;
+	// Mapped files only flush the blocks marked as written
+	bool dirty;
+	friend class BuddyAllocator;
+public:
+	Block(uint32_t addr, uint32_t size):ByteWriter(nullptr, size),addr(addr),dirty(true)
 	{
 	}
 	inline uint32_t getAddr() const
@@ -153,6 +174,15 @@ class BuddyAllocator
 private:
 	std::vector<Block> blocks;
 	uint32_t curAddr;
+	// Backing memory for new stores, this is the whole file including the 4-byte pre-header
+	std::vector<uint8_t> image;
+	// Backing for existing files opened with openFile
+	int fd;
+	uint8_t* mapping;
+	size_t mappingSize;
+	// New stores use a bump allocator, these only track space released by moved blocks
+	std::vector<uint32_t> freeLists[32];
+	std::vector<std::pair<std::string, uint32_t>> directory;
 	uint32_t powerOf2Ceil(uint32_t v)
 	{
 		v = v - 1;
@@ -167,37 +197,349 @@ private:
 	{
 		return 31 - __builtin_clz(blockSize);
 	}
+	// The backing memory may move while growing, update the views
+	void rebase(uint8_t* base)
+	{
+		for(Block& b: blocks)
+			b.buf = b.bufSize ? base + 4 + b.addr : nullptr;
+	}
+	bool growMapping(size_t newSize)
+	{
+		if(ftruncate(fd, newSize) != 0)
+			return false;
+		void* m = mremap(mapping, mappingSize, newSize, MREMAP_MAYMOVE);
+		if(m == MAP_FAILED)
+			return false;
+		mapping = (uint8_t*)m;
+		mappingSize = newSize;
+		rebase(mapping);
+		return true;
+	}
+	// Take a block of 2^log2Size bytes from the free lists, splitting bigger ones as needed
+	bool takeFreeRange(uint32_t log2Size, uint32_t& addr)
+	{
+		uint32_t i = log2Size;
+		while(i < 32 && freeLists[i].empty())
+			i++;
+		if(i == 32)
+			return false;
+		addr = freeLists[i].back();
+		freeLists[i].pop_back();
+		// Return the upper halves to the free lists
+		while(i > log2Size)
+		{
+			i--;
+			freeLists[i].push_back(addr + (1u << i));
+		}
+		return true;
+	}
+	void releaseRange(uint32_t addr, uint32_t log2Size)
+	{
+		// Merge with the buddy as long as it is free
+		while(log2Size < 31)
+		{
+			std::vector<uint32_t>& list = freeLists[log2Size];
+			uint32_t buddyAddr = addr ^ (1u << log2Size);
+			auto it = std::find(list.begin(), list.end(), buddyAddr);
+			if(it == list.end())
+				break;
+			list.erase(it);
+			addr &= ~(1u << log2Size);
+			log2Size++;
+		}
+		freeLists[log2Size].push_back(addr);
+	}
+	uint32_t allocateMappedBlock(uint32_t size)
+	{
+		// Blocks are at least 32 bytes, the low 5 bits of the address encode the size
+		uint32_t log2Size = getLog2(powerOf2Ceil(size < 32 ? 32 : size));
+		uint32_t addr;
+		if(!takeFreeRange(log2Size, addr))
+			return 0xffffffff;
+		size_t end = size_t(addr) + 4 + (size_t(1) << log2Size);
+		if(end > mappingSize && !growMapping(end))
+		{
+			releaseRange(addr, log2Size);
+			return 0xffffffff;
+		}
+		// Reuse an empty slot in the block list if possible
+		uint32_t i = 2;
+		while(i < blocks.size() && blocks[i].bufSize != 0)
+			i++;
+		Block b(addr, 1u << log2Size);
+		b.buf = mapping + 4 + addr;
+		memset(b.buf, 0, b.bufSize);
+		if(i == blocks.size())
+			blocks.push_back(b);
+		else
+			blocks[i] = b;
+		return i - 1;
+	}
 public:
-	BuddyAllocator():curAddr(0)
+	BuddyAllocator():curAddr(0),fd(-1),mapping(nullptr),mappingSize(0)
+	{
+		reset();
+	}
+	// Start over with an empty store, the memory used by the previous one is kept for reuse
+	void reset()
 	{
+		assert(!mapping);
+		blocks.clear();
+		for(std::vector<uint32_t>& list: freeLists)
+			list.clear();
+		curAddr = 0;
+		// The pre-header, growing the image again zero-fills it
+		image.clear();
+		image.resize(4);
 		// Allocate the buddy header
 		allocateBlock(32);
 		// Allocate the metaData block, we need this to be block 0
 		allocateBlock(2048);
 	}
+	BuddyAllocator(const BuddyAllocator&) = delete;
+	BuddyAllocator& operator=(const BuddyAllocator&) = delete;
+	~BuddyAllocator()
+	{
+		if(mapping)
+			munmap(mapping, mappingSize);
+		if(fd >= 0)
+			close(fd);
+	}
+	// Map an existing store for in-place edits, blocks become views into the file
+	// Returns false if the file is not a valid store
+	bool openFile(const char* path)
+	{
+		assert(mapping == nullptr);
+		fd = open(path, O_RDWR);
+		if(fd < 0)
+			return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size < 36)
+			return false;
+		mappingSize = st.st_size;
+		void* m = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(m == MAP_FAILED)
+			return false;
+		mapping = (uint8_t*)m;
+		if(readInt32(mapping) != 1 || memcmp(mapping + 4, "Bud1", 4) != 0)
+			return false;
+		uint32_t metaDataAddr = readInt32(mapping + 8);
+		uint32_t metaDataSize = readInt32(mapping + 12);
+		if(size_t(metaDataAddr) + 4 + metaDataSize > mappingSize || metaDataSize < 8)
+			return false;
+		const uint8_t* p = mapping + 4 + metaDataAddr;
+		const uint8_t* end = p + metaDataSize;
+		uint32_t blockCount = readInt32(p);
+		uint32_t paddedCount = (blockCount + 255) & ~255u;
+		if(uint64_t(paddedCount) * 4 + 12 > metaDataSize)
+			return false;
+		image.clear();
+		blocks.clear();
+		// The header is not part of the block list
+		blocks.emplace_back(0, 32);
+		for(uint32_t i=0;i<blockCount;i++)
+		{
+			uint32_t v = readInt32(p + 8 + i * 4);
+			// Unused slots are kept as empty blocks
+			if(v == 0)
+			{
+				blocks.emplace_back(0, 0);
+				continue;
+			}
+			uint32_t addr = v & ~0x1fu;
+			uint32_t size = 1u << (v & 0x1f);
+			if(size_t(addr) + 4 + size > mappingSize)
+				return false;
+			blocks.emplace_back(addr, size);
+		}
+		if(blocks.size() < 2 || blocks[1].addr != metaDataAddr)
+			return false;
+		p += 8 + paddedCount * 4;
+		uint32_t dirCount = readInt32(p);
+		p += 4;
+		for(uint32_t i=0;i<dirCount;i++)
+		{
+			if(end - p < 1 || end - p < 5 + p[0])
+				return false;
+			directory.emplace_back(std::string((const char*)p + 1, p[0]), readInt32(p + 1 + p[0]));
+			p += 5 + p[0];
+		}
+		for(uint32_t i=0;i<32;i++)
+		{
+			if(end - p < 4)
+				return false;
+			uint32_t count = readInt32(p);
+			p += 4;
+			if(uint64_t(end - p) < uint64_t(count) * 4)
+				return false;
+			for(uint32_t j=0;j<count;j++)
+				freeLists[i].push_back(readInt32(p + j * 4));
+			p += count * 4;
+		}
+		rebase(mapping);
+		// Only what is touched from now on needs to be flushed
+		for(Block& b: blocks)
+			b.dirty = false;
+		return true;
+	}
 	// Allocate a block of the given size and return the block id
 	uint32_t allocateBlock(uint32_t size)
 	{
+		if(mapping)
+			return allocateMappedBlock(size);
 		uint32_t blockSize = powerOf2Ceil(size);
 		blocks.emplace_back(curAddr, blockSize);
 		curAddr += blockSize;
+		uint8_t* oldBase = image.data();
+		image.resize(4 + curAddr);
+		if(image.data() != oldBase)
+			rebase(image.data());
+		else
+			blocks.back().buf = image.data() + 4 + blocks.back().addr;
 		// The first 2 blocks are (header, metadata), valid indexes are > 0
 		return blocks.size() - 2;
 	}
+	// Allocate consecutive blocks for all the sizes, returns the id of the first one
+	// The addresses are assigned up front, so the blocks can be filled from multiple threads
+	uint32_t allocateBlocks(std::span<const uint32_t> sizes)
+	{
+		assert(!mapping);
+		uint32_t firstId = blocks.size() - 1;
+		for(uint32_t size: sizes)
+		{
+			uint32_t blockSize = powerOf2Ceil(size);
+			blocks.emplace_back(curAddr, blockSize);
+			curAddr += blockSize;
+		}
+		image.resize(4 + curAddr);
+		rebase(image.data());
+		return firstId;
+	}
+	// Move the block to a new location of at least the given size, the contents are preserved
+	// Only supported for mapped files
+	bool resizeBlock(uint32_t blockId, uint32_t size)
+	{
+		assert(mapping);
+		Block old = getBlock(blockId);
+		uint32_t newId = allocateMappedBlock(size);
+		if(newId == 0xffffffff)
+			return false;
+		Block& b = blocks[newId + 1];
+		memcpy(b.buf, blocks[blockId + 1].buf, old.bufSize < b.bufSize ? old.bufSize : b.bufSize);
+		// Keep the old id, which is referenced by the tree
+		blocks[blockId + 1] = b;
+		blocks[newId + 1] = Block(0, 0);
+		releaseRange(old.addr, getLog2(old.bufSize));
+		return true;
+	}
+	// Returns true if the block id is allocated, ids read from a mapped file must be checked first
+	bool isValidBlock(uint32_t blockId) const
+	{
+		return blockId < blocks.size() - 1 && blocks[blockId + 1].bufSize != 0;
+	}
 	Block& getBlock(uint32_t blockId)
 	{
-		assert(blockId != 0xffffffff);
-		return blocks.at(blockId + 1);
+		assert(isValidBlock(blockId));
+		return blocks[blockId + 1];
+	}
+	// Flush the block of a mapped file, new blocks are always written
+	void markDirty(uint32_t blockId)
+	{
+		getBlock(blockId).dirty = true;
+	}
+	// Returns the block id for the given name, or 0xffffffff if it does not exist
+	uint32_t getDirectoryEntry(const char* name) const
+	{
+		for(const auto& e: directory)
+		{
+			if(e.first == name)
+				return e.second;
+		}
+		return 0xffffffff;
+	}
+	// Write the allocator state back to a mapped file and flush the touched blocks
+	bool flush()
+	{
+		assert(mapping);
+		uint32_t blockCount = blocks.size() - 1;
+		uint32_t metaDataSize = 8 + ((blockCount + 255) & ~255u) * 4 + 4;
+		for(const auto& e: directory)
+			metaDataSize += 5 + e.first.size();
+		metaDataSize += 32 * 4;
+		for(uint32_t i=0;i<32;i++)
+			metaDataSize += freeLists[i].size() * 4;
+		// Allocating a bigger block changes the free lists, leave some room for that
+		if(metaDataSize + 32 * 4 > blocks[1].bufSize && !resizeBlock(0, metaDataSize + 32 * 4))
+			return false;
+		markDirty(0);
+		Block& metaData = getBlock(0);
+		memset(metaData.buf, 0, metaData.bufSize);
+		metaData.seek(0);
+		metaData.writeInt32(blockCount);
+		metaData.writeInt32(0);
+		for(uint32_t i=0;i<((blockCount + 255) & ~255u);i++)
+		{
+			if(i < blockCount && blocks[i + 1].bufSize)
+				metaData.writeInt32(blocks[i + 1].addr | getLog2(blocks[i + 1].bufSize));
+			else
+				metaData.writeInt32(0);
+		}
+		metaData.writeInt32(directory.size());
+		for(const auto& e: directory)
+		{
+			metaData.writeInt8(e.first.size());
+			metaData.writeStr(e.first.c_str());
+			metaData.writeInt32(e.second);
+		}
+		for(uint32_t i=0;i<32;i++)
+		{
+			std::sort(freeLists[i].begin(), freeLists[i].end());
+			metaData.writeInt32(freeLists[i].size());
+			for(uint32_t addr: freeLists[i])
+				metaData.writeInt32(addr);
+		}
+		// The meta data block might have moved
+		Block& header = blocks.at(0);
+		header.dirty = true;
+		header.seek(4);
+		header.writeInt32(metaData.addr);
+		header.writeInt32(metaData.bufSize);
+		header.writeInt32(metaData.addr);
+		// Flush the dirty pages only
+		uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+		for(Block& b: blocks)
+		{
+			if(!b.dirty || b.bufSize == 0)
+				continue;
+			uintptr_t start = uintptr_t(b.buf) & ~pageMask;
+			uintptr_t end = uintptr_t(b.buf) + b.bufSize;
+			if(msync((void*)start, end - start, MS_SYNC) != 0)
+				return false;
+			b.dirty = false;
+		}
+		return true;
 	}
 	void createMetaDataBlock(uint32_t bTreeBlockId)
 	{
 		// Serialize allocator data into a new block
-		// NOTE: The allocated list is 1024 bytes big, allocate 2048 bytes
+		// NOTE: The allocated list is padded to multiples of 256 entries
+		uint32_t blockCount = blocks.size() - 1;
+		uint32_t tableSize = (blockCount + 255) & ~255u;
+		// The free lists have at most 1 entry per bucket, plus the old metadata block
+		uint32_t metaDataSize = 8 + tableSize * 4 + 13 + 32 * 4 + 33 * 4;
+		if(metaDataSize > blocks[1].size())
+		{
+			// Big trees do not fit the 2048 bytes reserved up front, move the metadata at the end
+			Block old = blocks[1];
+			allocateBlock(metaDataSize);
+			blocks[1] = blocks.back();
+			blocks.pop_back();
+			freeLists[getLog2(old.size())].push_back(old.getAddr());
+		}
 		Block& metaData = blocks.at(1);
-		metaData.writeInt32(blocks.size() - 1);
+		metaData.writeInt32(blockCount);
 		metaData.writeInt32(0);
-		// We need to populate 256 entries unconditionally
-		for(uint32_t i=0;i<256;i++)
+		for(uint32_t i=0;i<tableSize;i++)
 		{
 			if(i < (blocks.size() - 1))
 			{
@@ -216,22 +558,22 @@ public:
 		metaData.writeInt8(4);
 		metaData.writeStr("DSDB");
 		metaData.writeInt32(bTreeBlockId);
-		// Since we use a bump allocator each bucket in the free-list can only have 1 or 0 entries
+		// Since we use a bump allocator each bucket gets at most 1 entry for the space after the
+		// last block, only a moved metadata block adds more
 		// Buckets are for 2^0 .. 2^31
 		for(uint32_t i=0;i<32;i++)
 		{
 			uint32_t mask = 1<<i;
-			if(curAddr & mask)
+			uint32_t tailCount = (curAddr & mask) ? 1 : 0;
+			metaData.writeInt32(freeLists[i].size() + tailCount);
+			for(uint32_t addr: freeLists[i])
+				metaData.writeInt32(addr);
+			if(tailCount)
 			{
 				// Add an entry and bump the address
-				metaData.writeInt32(1);
 				metaData.writeInt32(curAddr);
 				curAddr += mask;
 			}
-			else
-			{
-				metaData.writeInt32(0);
-			}
 		}
 		assert(curAddr == 0);
 		// Finalize the header block
@@ -241,18 +583,25 @@ public:
 		header.writeInt32(metaData.size());
 		header.writeInt32(metaData.getAddr());
 	}
-	void writeFile(FILE* f)
+	// The digests of the file are added to the manifest, if any
+	bool writeFile(OutputBatch& batch, const char* fileName, DigestManifest* manifest = nullptr)
 	{
+		assert(!mapping);
 		// All the data is preceeded by an unaccounted 4-byte value (1)
-		uint32_t preHeader = htonl(1);
-		fwrite(&preHeader, 1, 4, f);
-		// We can blindly output all the blocks, they are fully sequential
-		for(Block& b: blocks)
-			fwrite(b.data(), 1, b.size(), f);
+		image[3] = 1;
+		if(manifest)
+		{
+			OutputDigest digest;
+			digest.update(image.data(), image.size());
+			manifest->add(fileName, digest.finish());
+		}
+		// The blocks are fully sequential in the image
+		return batch.addBuffer(fileName, image.data(), image.size());
 	}
 };
 
-std::vector<uint8_t> createAliasFile(const char* volumeName, const char* fileName)
+// The alias is built into ret, to reuse its memory across stores
+void createAliasFile(const char* volumeName, const char* fileName, std::vector<uint8_t>& ret)
 {
 	// We need to include the full path, in the form volumeName:fileName 
 	uint32_t volumeNameLen = strlen(volumeName);
@@ -261,135 +610,769 @@ std::vector<uint8_t> createAliasFile(const char* volumeName, const char* fileNam
 	// We need to align the size to 2 (for the extra data)
 	if(fullPathSize & 1)
 		fullPathSize++;
-	uint32_t recordSize = sizeof(AliasFile) + 8 + fullPathSize;
-	std::vector<uint8_t> ret(recordSize, 0);
-	AliasFile* aliasFile = (AliasFile*)ret.data();
-	aliasFile->recordSize = htons(recordSize);
-	aliasFile->recordVersion = htons(2);
-	aliasFile->volumeLenAndName[0] = volumeNameLen;
-	memcpy(aliasFile->volumeLenAndName + 1, volumeName, volumeNameLen);
-	aliasFile->volumeSig = htons(0x482b); // H+
-	// NOTE: Assuming root here
-	aliasFile->parentInode = htonl(0x2);
-	aliasFile->fileLenAndName[0] = fileNameLen;
-	memcpy(aliasFile->fileLenAndName + 1, fileName, fileNameLen);
-	aliasFile->fileInode = 0;
-	aliasFile->fileFrom = htons(0xffff);
-	aliasFile->fileTo = htons(0xffff);
-	uint8_t* extraData = aliasFile->extraData;
-	// '2' for absolute path
-	uint16_t* extraData16 = (uint16_t*)extraData;
-	// 16-bit '2' (big endian) for for absolute path
-	extraData16[0] = htons(2);
-	extraData16[1] = htons(fullPathSize);
-	memcpy(extraData + 4, volumeName, volumeNameLen);
-	extraData[4 + volumeNameLen] = ':';
-	memcpy(extraData + 5 + volumeNameLen, fileName, fileNameLen);
-	// End of extra data
-	extraData[4 + fullPathSize] = 0xff;
-	extraData[5 + fullPathSize] = 0xff;
-	return ret;
+	uint32_t recordSize = AliasHeaderSchema::size + 2 * AliasExtraSchema::size + fullPathSize;
+	ret.assign(recordSize, 0);
+	AliasHeader header;
+	header.recordSize = recordSize;
+	header.volumeName = volumeName;
+	// NOTE: Assuming root here, see the defaults of AliasHeader
+	header.fileName = fileName;
+	AliasHeaderSchema::encode(header, ret.data());
+	uint8_t* extraData = ret.data() + AliasHeaderSchema::size;
+	AliasExtraSchema::encode(AliasExtra{ ALIAS_ABSOLUTE_PATH, uint16_t(fullPathSize) }, extraData);
+	extraData += AliasExtraSchema::size;
+	memcpy(extraData, volumeName, volumeNameLen);
+	extraData[volumeNameLen] = ':';
+	memcpy(extraData + 1 + volumeNameLen, fileName, fileNameLen);
+	AliasExtraSchema::encode(AliasExtra{ ALIAS_END, 0 }, extraData + fullPathSize);
 }
 
-uint32_t getInt(const char* f)
+bool getInt(const char* f, uint32_t& ret)
 {
-	char* endPtr;
-	uint32_t ret = strtol(f, &endPtr, 10);
-	if(*endPtr != '\0')
+	if(!parseInt(f, ret))
 	{
 		printf("Expected int: %s\n", f);
-		exit(1);
+		return false;
 	}
-	// The whole string was parsed
-	return ret;
+	return true;
 }
 
+// The pending records of one producer thread, in insertion order. Names are front coded against the
+// previous record and stored in full every restartInterval records, so any record expands quickly.
+class RecordShard
+{
+private:
+	template<uint32_t PageSize>
+	friend class BTree;
+	static const uint32_t restartInterval = 16;
+	enum DataType { BLOB, BOOL, SHORT, LONG };
+	struct Entry
+	{
+		// In the arena: data type, shared name length, suffix length, suffix, payload. Blobs have
+		// their length before the payload, like the other lengths as a varint.
+		uint32_t offset;
+		uint32_t type;
+	};
+	std::vector<uint8_t> arena;
+	std::vector<Entry> entries;
+	// The sorted order of the entries, filled by the BTree
+	std::vector<uint32_t> order;
+	// UTF-16 big endian names of the last record and of the new one
+	std::vector<uint8_t> lastName;
+	std::vector<uint8_t> name;
+	void appendInt32(uint32_t v)
+	{
+		uint8_t b[4] = { uint8_t(v >> 24), uint8_t(v >> 16), uint8_t(v >> 8), uint8_t(v) };
+		arena.insert(arena.end(), b, b + 4);
+	}
+	void appendVarint(uint32_t v)
+	{
+		for(;v >= 0x80;v >>= 7)
+			arena.push_back(v | 0x80);
+		arena.push_back(v);
+	}
+	static uint32_t readVarint(const uint8_t*& p)
+	{
+		uint32_t v = 0;
+		for(uint32_t shift=0;;shift+=7)
+		{
+			uint8_t b = *p++;
+			v |= uint32_t(b & 0x7f) << shift;
+			if(b < 0x80)
+				return v;
+		}
+	}
+	void beginRecord(const char* fileName, const char* recordType, DataType dataType)
+	{
+		name.clear();
+		appendName(fileName, name);
+		uint32_t shared = 0;
+		if(entries.size() % restartInterval)
+		{
+			uint32_t len = std::min(name.size(), lastName.size());
+			while(shared < len && name[shared] == lastName[shared])
+				shared++;
+			// Whole code units only
+			shared /= 2;
+		}
+		entries.push_back(Entry{ uint32_t(arena.size()), fourCC(recordType) });
+		arena.push_back(dataType);
+		appendVarint(shared);
+		appendVarint(name.size() / 2 - shared);
+		arena.insert(arena.end(), name.begin() + shared * 2, name.end());
+		std::swap(name, lastName);
+	}
+	// Undo the front coding of record i, ret must hold the name of the previous record unless i
+	// is a restart point. Returns the payload.
+	const uint8_t* applyName(uint32_t i, std::vector<uint8_t>& ret) const
+	{
+		const uint8_t* p = arena.data() + entries[i].offset + 1;
+		uint32_t shared = readVarint(p);
+		uint32_t suffix = readVarint(p);
+		ret.resize((shared + suffix) * 2);
+		memcpy(ret.data() + shared * 2, p, suffix * 2);
+		return p + suffix * 2;
+	}
+	// Expand the name of record i, starting from the previous restart point. Returns the payload.
+	const uint8_t* expandName(uint32_t i, std::vector<uint8_t>& ret) const
+	{
+		for(uint32_t j=i & ~(restartInterval - 1);j<i;j++)
+			applyName(j, ret);
+		return applyName(i, ret);
+	}
+	// The length of the payload at p, which is moved past the length of blobs
+	static uint32_t payloadLength(DataType dataType, const uint8_t*& p)
+	{
+		switch(dataType)
+		{
+			case BLOB:
+				return readVarint(p);
+			case BOOL:
+				return 1;
+			default:
+				return 4;
+		}
+	}
+	// The size of record i once serialized
+	uint32_t recordSize(uint32_t i) const
+	{
+		const uint8_t* p = arena.data() + entries[i].offset;
+		DataType dataType = DataType(*p++);
+		uint32_t nameLen = readVarint(p);
+		uint32_t suffix = readVarint(p);
+		nameLen += suffix;
+		p += suffix * 2;
+		uint32_t payloadLen = payloadLength(dataType, p);
+		return 4 + nameLen * 2 + 8 + (dataType == BLOB ? 4 : 0) + payloadLen;
+	}
+	// Serialize record i, name is used to expand its name
+	void writeRecord(uint32_t i, ByteWriter& out, std::vector<uint8_t>& name) const
+	{
+		static const char dataTypes[4][5] = { "blob", "bool", "shor", "long" };
+		DataType dataType = DataType(arena[entries[i].offset]);
+		const uint8_t* payload = expandName(i, name);
+		out.writeInt32(name.size() / 2);
+		out.writeData(name.data(), name.size());
+		out.writeInt32(entries[i].type);
+		out.writeStr(dataTypes[dataType]);
+		uint32_t payloadLen = payloadLength(dataType, payload);
+		if(dataType == BLOB)
+			out.writeInt32(payloadLen);
+		out.writeData(payload, payloadLen);
+	}
+public:
+	void addBlob(const char* fileName, const char* recordType, std::span<const uint8_t> data)
+	{
+		beginRecord(fileName, recordType, BLOB);
+		appendVarint(data.size());
+		arena.insert(arena.end(), data.begin(), data.end());
+	}
+	void addBool(const char* fileName, const char* recordType, uint8_t v)
+	{
+		beginRecord(fileName, recordType, BOOL);
+		arena.push_back(v);
+	}
+	void addShort(const char* fileName, const char* recordType, uint16_t v)
+	{
+		beginRecord(fileName, recordType, SHORT);
+		// Uses 4 bytes anyway
+		appendInt32(v);
+	}
+	void addLong(const char* fileName, const char* recordType, uint32_t v)
+	{
+		beginRecord(fileName, recordType, LONG);
+		appendInt32(v);
+	}
+	uint32_t size() const
+	{
+		return entries.size();
+	}
+	// Drop the records, but keep the memory
+	void clear()
+	{
+		arena.clear();
+		entries.clear();
+		lastName.clear();
+	}
+};
+
+// Builds the whole tree in finish(), records can be added in any order and from one thread per shard.
+// Nodes are filled up to PageSize, bigger pages make shallower trees but slower lookups.
+template<uint32_t PageSize = 4096>
 class BTree
 {
 private:
+	static_assert(PageSize == 4096 || PageSize == 8192 || PageSize == 16384, "Unsupported page size");
+	// NOTE: Finder is happy with nodes smaller than a page, single leaf stores have always used 2048
+	static const uint32_t minNodeSize = 2048;
+	// The part of the leaves kept free when there is more than one
+	static const uint32_t leafSlack = 8;
+	// A record of a shard
+	struct RecordRef
+	{
+		uint32_t shard;
+		uint32_t index;
+	};
+	// While sorting, the key holds 8 code units of the name from the current depth
+	struct SortKey
+	{
+		uint64_t high;
+		uint64_t low;
+		uint32_t index;
+		uint32_t nameLen;
+	};
+	// A sorted run of a shard
+	struct SortRange
+	{
+		uint32_t shard;
+		uint32_t begin;
+		uint32_t end;
+	};
 	BuddyAllocator& buddy;
-	uint32_t entryCount;
-	uint32_t curPageId;
-	void writeFileName(const char* s)
+	ThreadPool* pool;
+	std::vector<RecordShard> shards;
+	std::vector<SortRange> ranges;
+	// A node of the tree, it holds the records [begin, end) of its level
+	struct NodePlan
+	{
+		uint32_t level;
+		uint32_t begin;
+		uint32_t end;
+		uint32_t size;
+	};
+	// The records of each level in tree order, leaves first. The separators of the nodes
+	// of a level are moved up to the next one.
+	std::vector<std::vector<RecordRef>> levels;
+	// All the nodes in block order, and the index of the first node of each level
+	std::vector<NodePlan> nodes;
+	std::vector<uint32_t> levelFirstNode;
+	std::vector<uint32_t> prefix;
+	std::vector<uint32_t> nodeSizes;
+	// Set the key to the case folded code units [depth, depth + 8) of the name. Missing units
+	// are 0, so that shorter names come first like in compareNames.
+	static void nameKey(const std::vector<uint8_t>& name, uint32_t depth, SortKey& key)
 	{
-		Block& b = buddy.getBlock(curPageId);
-		uint32_t nameLen = strlen(s);
-		b.writeInt32(nameLen);
-		for(uint32_t i=0;i<nameLen;i++)
-			b.writeInt16(s[i]);
+		uint64_t units[2] = {};
+		uint32_t nameLen = name.size() / 2;
+		for(uint32_t i=0;i<8;i++)
+		{
+			uint16_t c = depth + i < nameLen ? readInt16(name.data() + (depth + i) * 2) : 0;
+			if(c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			units[i / 4] = (units[i / 4] << 16) | c;
+		}
+		key.high = units[0];
+		key.low = units[1];
+		key.nameLen = nameLen;
+	}
+	// Sort a range of a shard by name, then by type. Names are compared 8 code units at a time,
+	// the records that are still tied get the next 8 units. Each step expands the names of
+	// the range in order, which only has to undo the front coding of one record at a time.
+	// Equal records keep the insertion order.
+	void sortRange(const RecordShard& s, const SortRange& r)
+	{
+		auto less = [](const SortKey& a, const SortKey& b)
+		{
+			if(a.high != b.high)
+				return a.high < b.high;
+			return a.low != b.low ? a.low < b.low : a.index < b.index;
+		};
+		std::vector<SortKey> keys(r.end - r.begin);
+		std::vector<uint8_t> name;
+		// The tied groups as [begin, end) of keys, and where each of their records is
+		std::vector<std::pair<uint32_t, uint32_t>> groups(1, std::make_pair(0u, r.end - r.begin));
+		std::vector<std::pair<uint32_t, uint32_t>> nextGroups;
+		std::vector<uint32_t> slots(r.end - r.begin, UINT32_MAX);
+		for(uint32_t i=0;i<keys.size();i++)
+			slots[i] = i;
+		for(uint32_t depth=0;!groups.empty();depth+=8)
+		{
+			for(uint32_t i=r.begin;i<r.end;i++)
+			{
+				if(i == r.begin)
+					s.expandName(i, name);
+				else
+					s.applyName(i, name);
+				uint32_t& slot = slots[i - r.begin];
+				if(slot == UINT32_MAX)
+					continue;
+				keys[slot].index = i;
+				nameKey(name, depth, keys[slot]);
+				slot = UINT32_MAX;
+			}
+			nextGroups.clear();
+			for(const auto& g: groups)
+			{
+				std::sort(keys.begin() + g.first, keys.begin() + g.second, less);
+				for(uint32_t i=g.first;i<g.second;)
+				{
+					uint32_t j = i + 1;
+					bool longer = keys[i].nameLen > depth + 8;
+					for(;j < g.second && keys[j].high == keys[i].high && keys[j].low == keys[i].low;j++)
+						longer |= keys[j].nameLen > depth + 8;
+					if(j - i > 1 && longer)
+					{
+						nextGroups.emplace_back(i, j);
+						for(uint32_t k=i;k<j;k++)
+							slots[keys[k].index - r.begin] = k;
+					}
+					else if(j - i > 1)
+					{
+						// The names are the same
+						for(uint32_t k=i;k<j;k++)
+						{
+							keys[k].high = keys[k].nameLen;
+							keys[k].low = s.entries[keys[k].index].type;
+						}
+						std::sort(keys.begin() + i, keys.begin() + j, less);
+					}
+					i = j;
+				}
+			}
+			std::swap(groups, nextGroups);
+		}
+		for(uint32_t i=0;i<keys.size();i++)
+			shards[r.shard].order[r.begin + i] = keys[i].index;
+	}
+	// Sort the shards in parallel, then merge the sorted runs in a single sequence
+	void sortRecords()
+	{
+		uint32_t totalCount = 0;
+		for(const RecordShard& s: shards)
+			totalCount += s.size();
+		uint32_t threadCount = pool ? pool->getThreadCount() : 1;
+		// Big shards are split so that all threads have some work
+		uint32_t rangeSize = std::max(totalCount / threadCount, 1024u);
+		ranges.clear();
+		for(uint32_t i=0;i<shards.size();i++)
+		{
+			shards[i].order.resize(shards[i].size());
+			for(uint32_t begin=0;begin<shards[i].size();begin+=rangeSize)
+				ranges.push_back(SortRange{ i, begin, std::min(begin + rangeSize, shards[i].size()) });
+		}
+		auto sortRange = [this](uint32_t index, uint32_t)
+		{
+			this->sortRange(shards[ranges[index].shard], ranges[index]);
+		};
+		if(pool)
+			pool->parallelFor(ranges.size(), sortRange);
+		else
+		{
+			for(uint32_t i=0;i<ranges.size();i++)
+				sortRange(i, 0);
+		}
+		if(levels.empty())
+			levels.emplace_back();
+		std::vector<RecordRef>& level = levels[0];
+		level.clear();
+		level.reserve(totalCount);
+		// k-way merge with a heap of range indexes, ties go to the earlier range to keep
+		// the insertion order of duplicates. The name of the first record of each range is
+		// kept expanded.
+		std::vector<std::vector<uint8_t>> heads(ranges.size());
+		auto expandHead = [this, &heads](uint32_t i)
+		{
+			const RecordShard& s = shards[ranges[i].shard];
+			s.expandName(s.order[ranges[i].begin], heads[i]);
+		};
+		std::vector<uint32_t> heap;
+		for(uint32_t i=0;i<ranges.size();i++)
+		{
+			heap.push_back(i);
+			expandHead(i);
+		}
+		auto greater = [this, &heads](uint32_t a, uint32_t b)
+		{
+			DSRecord ra, rb;
+			ra.name = heads[a].data();
+			ra.nameLen = heads[a].size() / 2;
+			ra.type = shards[ranges[a].shard].entries[shards[ranges[a].shard].order[ranges[a].begin]].type;
+			rb.name = heads[b].data();
+			rb.nameLen = heads[b].size() / 2;
+			rb.type = shards[ranges[b].shard].entries[shards[ranges[b].shard].order[ranges[b].begin]].type;
+			int ret = compareRecords(ra, rb);
+			return ret != 0 ? ret > 0 : a > b;
+		};
+		std::make_heap(heap.begin(), heap.end(), greater);
+		while(!heap.empty())
+		{
+			std::pop_heap(heap.begin(), heap.end(), greater);
+			SortRange& r = ranges[heap.back()];
+			level.push_back(RecordRef{ r.shard, shards[r.shard].order[r.begin++] });
+			if(r.begin == r.end)
+				heap.pop_back();
+			else
+			{
+				expandHead(heap.back());
+				std::push_heap(heap.begin(), heap.end(), greater);
+			}
+		}
+	}
+	uint32_t recordSize(const RecordRef& r) const
+	{
+		return shards[r.shard].recordSize(r.index);
+	}
+	// Split a level into nodes, using the prefix sum of the record sizes to find how many
+	// fit in a page. The separators form the next level.
+	void planLevel(uint32_t l)
+	{
+		if(levels.size() == l + 1)
+			levels.emplace_back();
+		const std::vector<RecordRef>& level = levels[l];
+		std::vector<RecordRef>& upper = levels[l + 1];
+		upper.clear();
+		levelFirstNode.push_back(nodes.size());
+		// Internal nodes store the left child of each record
+		uint32_t perRecord = l ? 4 : 0;
+		uint32_t count = level.size();
+		prefix.resize(count + 1);
+		prefix[0] = 0;
+		for(uint32_t i=0;i<count;i++)
+			prefix[i + 1] = prefix[i] + perRecord + recordSize(level[i]);
+		// Leaves are not split by --edit, when there are several some room is left for the records
+		// it inserts. A single leaf can grow up to the page size.
+		uint32_t fill = l == 0 && 8 + prefix[count] > PageSize ? PageSize - PageSize / leafSlack : PageSize;
+		uint32_t i = 0;
+		while(true)
+		{
+			uint32_t j = std::upper_bound(prefix.begin() + i + 1, prefix.end(), prefix[i] + fill - 8) - prefix.begin() - 1;
+			// Records that do not fit a page on their own get a bigger node
+			if(j == i && i < count)
+				j++;
+			// The record that does not fit tends to be a big one, if so move up the last one of
+			// the node instead. Big separators make for a small fan-out.
+			if(j < count && j - i > 1 && recordSize(level[j - 1]) < recordSize(level[j]))
+				j--;
+			// Do not leave an empty node after the last separator
+			if(j + 1 == count)
+			{
+				if(j - i > 1)
+					j--;
+				else
+					j++;
+			}
+			nodes.push_back(NodePlan{ l, i, j, 8 + prefix[j] - prefix[i] });
+			if(j == count)
+				break;
+			upper.push_back(level[j]);
+			i = j + 1;
+		}
+	}
+	void writeNode(uint32_t index, uint32_t firstNodeId, std::vector<uint8_t>& name)
+	{
+		const NodePlan& n = nodes[index];
+		const std::vector<RecordRef>& level = levels[n.level];
+		Block& b = buddy.getBlock(firstNodeId + index);
+		// The children are the nodes of the level below, in order
+		uint32_t firstChild = n.level ? firstNodeId + levelFirstNode[n.level - 1] : 0;
+		// The right-most child, 0 for leaves
+		b.writeInt32(n.level ? firstChild + n.end : 0);
+		b.writeInt32(n.end - n.begin);
+		for(uint32_t i=n.begin;i<n.end;i++)
+		{
+			if(n.level)
+				b.writeInt32(firstChild + i);
+			shards[level[i].shard].writeRecord(level[i].index, b, name);
+		}
 	}
 public:
-	BTree(BuddyAllocator& a):buddy(a),entryCount(0),curPageId(0)
-	{
-		// Only 1 page is supported, should be plenty for our purpose
-		// NOTE: Although the master block declares 4096 as the size, it seems that the leaf is 2048
-		curPageId = buddy.allocateBlock(2048);
-		Block& b = buddy.getBlock(curPageId);
-		// Leave the first int32 to 0, that signals that this is a child leaf
-		b.writeInt32(0);
-		// Skip another 4 bytes, they will contain the record count
-		b.writeInt32(0);
-	}
-	// NOTE: The user is responsible for adding values in lexicographical order
-	void addBlob(const char* fileName, const char* recordType, std::vector<uint8_t>& data)
-	{
-		entryCount++;
-		writeFileName(fileName);
-		Block& b = buddy.getBlock(curPageId);
-		b.writeStr(recordType);
-		b.writeStr("blob");
-		b.writeInt32(data.size());
-		b.writeData(data);
+	// Records are sorted using the pool, if any
+	BTree(BuddyAllocator& a, uint32_t shardCount = 1, ThreadPool* p = nullptr):buddy(a),pool(p),shards(shardCount)
+	{
+	}
+	// Start a new tree, the memory used by the previous one is kept
+	void reset()
+	{
+		for(RecordShard& s: shards)
+			s.clear();
+	}
+	RecordShard& getShard(uint32_t i)
+	{
+		return shards[i];
+	}
+	uint32_t getShardCount() const
+	{
+		return shards.size();
+	}
+	void addBlob(const char* fileName, const char* recordType, std::span<const uint8_t> data)
+	{
+		shards[0].addBlob(fileName, recordType, data);
 	}
 	void addBool(const char* fileName, const char* recordType, uint8_t v)
 	{
-		entryCount++;
-		writeFileName(fileName);
-		Block& b = buddy.getBlock(curPageId);
-		b.writeStr(recordType);
-		b.writeStr("bool");
-		b.writeInt8(v);
+		shards[0].addBool(fileName, recordType, v);
 	}
 	void addShort(const char* fileName, const char* recordType, uint16_t v)
 	{
-		entryCount++;
-		writeFileName(fileName);
-		Block& b = buddy.getBlock(curPageId);
-		b.writeStr(recordType);
-		b.writeStr("shor");
-		// Uses 4 bytes anyway
-		b.writeInt32(v);
+		shards[0].addShort(fileName, recordType, v);
+	}
+	void addLong(const char* fileName, const char* recordType, uint32_t v)
+	{
+		shards[0].addLong(fileName, recordType, v);
 	}
+	// Bulk load the tree from the leaves up, all the producers must be done
 	// Returns the page id of the master block
 	uint32_t finish()
 	{
-		// Write the final entry count
-		Block& b = buddy.getBlock(curPageId);
-		b.seek(4);
-		b.writeInt32(entryCount);
+		sortRecords();
+		uint32_t recordCount = levels[0].size();
+		nodes.clear();
+		levelFirstNode.clear();
+		uint32_t l = 0;
+		planLevel(0);
+		while(nodes.size() - levelFirstNode[l] > 1)
+			planLevel(++l);
+		// The blocks of all the nodes are reserved at once, then filled in parallel
+		nodeSizes.clear();
+		for(const NodePlan& n: nodes)
+		{
+			uint32_t blockSize = minNodeSize;
+			while(blockSize < n.size)
+				blockSize *= 2;
+			nodeSizes.push_back(blockSize);
+		}
+		uint32_t firstNodeId = buddy.allocateBlocks(nodeSizes);
+		const uint32_t nodesPerJob = 64;
+		auto writeNodes = [&](uint32_t job, uint32_t)
+		{
+			uint32_t end = std::min<uint32_t>((job + 1) * nodesPerJob, nodes.size());
+			std::vector<uint8_t> name;
+			for(uint32_t i=job*nodesPerJob;i<end;i++)
+				writeNode(i, firstNodeId, name);
+		};
+		uint32_t jobCount = (nodes.size() + nodesPerJob - 1) / nodesPerJob;
+		if(pool)
+			pool->parallelFor(jobCount, writeNodes);
+		else
+		{
+			for(uint32_t i=0;i<jobCount;i++)
+				writeNodes(i, 0);
+		}
+		// The root is the last node
+		uint32_t rootBlockID = firstNodeId + nodes.size() - 1;
 		// Create the master block for the Btree
-		uint32_t rootBlockID = curPageId;
-		curPageId = buddy.allocateBlock(20);
-		Block& master = buddy.getBlock(curPageId);
+		uint32_t masterId = buddy.allocateBlock(20);
+		Block& master = buddy.getBlock(masterId);
 		master.writeInt32(rootBlockID);
-		// Tree depth = 0, we only support a single leaf page
-		master.writeInt32(0);
-		master.writeInt32(entryCount);
-		// Total nodes = 1, a single leaf page
-		master.writeInt32(1);
-		// Page size
-		master.writeInt32(4096);
-		return curPageId;
+		// Levels of internal nodes above the leaves
+		master.writeInt32(l);
+		master.writeInt32(recordCount);
+		master.writeInt32(nodes.size());
+		master.writeInt32(PageSize);
+		return masterId;
 	}
 };
 
-int main(int argc, char* argv[])
+// Update the Iloc record of fileName in a store opened with BuddyAllocator::openFile, or insert
+// it if missing. Leaves are moved to bigger blocks as needed, but never split.
+bool setIconLocation(BuddyAllocator& buddy, const char* fileName, uint32_t x, uint32_t y)
+{
+	uint32_t masterId = buddy.getDirectoryEntry("DSDB");
+	if(!buddy.isValidBlock(masterId) || buddy.getBlock(masterId).size() < 20)
+	{
+		printf("Invalid DSDB master block\n");
+		return false;
+	}
+	uint32_t nodeId = readInt32(buddy.getBlock(masterId).data());
+	uint32_t pageSize = readInt32(buddy.getBlock(masterId).data() + 16);
+	std::vector<uint8_t> name = encodeName(fileName);
+	DSRecord key;
+	key.name = name.data();
+	key.nameLen = name.size() / 2;
+	key.type = fourCC("Iloc");
+	for(uint32_t depth=0;depth<32;depth++)
+	{
+		if(!buddy.isValidBlock(nodeId) || buddy.getBlock(nodeId).size() < 8)
+		{
+			printf("Invalid B-tree node %u\n", nodeId);
+			return false;
+		}
+		Block& node = buddy.getBlock(nodeId);
+		const uint8_t* start = node.data();
+		const uint8_t* end = start + node.size();
+		uint32_t rightChild = readInt32(start);
+		uint32_t count = readInt32(start + 4);
+		const uint8_t* p = start + 8;
+		const uint8_t* insertPos = nullptr;
+		uint32_t child = rightChild;
+		for(uint32_t i=0;i<count;i++)
+		{
+			uint32_t recordChild = 0;
+			if(rightChild)
+			{
+				if(end - p < 4)
+					return false;
+				recordChild = readInt32(p);
+				p += 4;
+			}
+			DSRecord r;
+			uint32_t len = parseRecord(p, end, r);
+			if(len == 0)
+				return false;
+			int cmp = insertPos ? 1 : compareRecords(r, key);
+			if(cmp == 0)
+			{
+				IconLocation iloc;
+				if(r.dataType != fourCC("blob") || !IconLocationSchema::decode(r.payload, r.payloadLen, iloc))
+					return false;
+				// Same size, patch the coordinates in place
+				iloc.x = x;
+				iloc.y = y;
+				IconLocationSchema::encode(iloc, node.data() + (r.payload - start));
+				buddy.markDirty(nodeId);
+				return true;
+			}
+			if(cmp > 0 && !insertPos)
+			{
+				insertPos = p - (rightChild ? 4 : 0);
+				child = recordChild;
+				// Internal nodes do not need the rest
+				if(rightChild)
+					break;
+			}
+			p += len;
+		}
+		if(rightChild)
+		{
+			nodeId = child;
+			continue;
+		}
+		// Insert a new record in the leaf
+		uint32_t usedSize = p - start;
+		uint32_t insertOffset = (insertPos ? insertPos : p) - start;
+		Record iloc(4 + name.size() + 8 + 4 + IconLocationSchema::size);
+		iloc.writeInt32(key.nameLen);
+		iloc.writeData(name.data(), name.size());
+		iloc.writeStr("Iloc");
+		iloc.writeStr("blob");
+		iloc.writeInt32(IconLocationSchema::size);
+		auto payload = IconLocationSchema::encode(IconLocation{ x, y });
+		iloc.writeData(payload.data(), payload.size());
+		if(usedSize + iloc.size() > pageSize)
+		{
+			printf("The leaf for %s is full\n", fileName);
+			return false;
+		}
+		if(usedSize + iloc.size() > node.size() && !buddy.resizeBlock(nodeId, usedSize + iloc.size()))
+			return false;
+		// The block might have moved
+		Block& leaf = buddy.getBlock(nodeId);
+		uint8_t* d = leaf.data();
+		memmove(d + insertOffset + iloc.size(), d + insertOffset, usedSize - insertOffset);
+		memcpy(d + insertOffset, iloc.data(), iloc.size());
+		leaf.seek(4);
+		leaf.writeInt32(count + 1);
+		buddy.markDirty(nodeId);
+		buddy.markDirty(masterId);
+		Block& master = buddy.getBlock(masterId);
+		master.seek(8);
+		master.writeInt32(readInt32(master.data() + 8) + 1);
+		return true;
+	}
+	return false;
+}
+
+int editStore(int argc, char* argv[])
 {
-	if(argc < 8 || ((argc - 8) % 3) != 0)
+	const char* fileName = argv[2];
+	BuddyAllocator buddy;
+	if(!buddy.openFile(fileName))
 	{
-		printf("Usage: %s output_file bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n", argv[0]);
+		printf("Invalid .DS_Store file: %s\n", fileName);
 		return 1;
 	}
+	for(int i=3;i<argc;i+=3)
+	{
+		uint32_t x, y;
+		if(!getInt(argv[i+1], x) || !getInt(argv[i+2], y))
+			return 1;
+		if(!setIconLocation(buddy, argv[i], x, y))
+		{
+			printf("Cannot update the location of %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if(!buddy.flush())
+	{
+		printf("Cannot write %s\n", fileName);
+		return 1;
+	}
+	return 0;
+}
+
+bool isValidStoreArgs(int argc)
+{
+	return argc >= 8 && ((argc - 8) % 3) == 0;
+}
+
+// What to do with the layouts whose icons or labels overlap or leave the window
+enum LayoutMode
+{
+	LAYOUT_UNCHECKED,
+	// Report the issues and do not build the store
+	LAYOUT_CHECK,
+	// Move the items with issues to the closest free place
+	LAYOUT_NUDGE
+};
+
+// The state needed to build a store, batches use a single one for all the outputs
+template<uint32_t PageSize>
+struct StoreBuilder
+{
+	BuddyAllocator buddy;
+	// With a pool the tree has a shard for each thread, the records are added, sorted and
+	// written in parallel
+	ThreadPool* pool;
+	BTree<PageSize> bTree;
+	std::vector<uint8_t> aliasFile;
+	LayoutMode layoutMode;
+	LayoutChecker checker;
+	FinderLayout layout;
+	std::vector<LayoutIssue> issues;
+	StoreBuilder(LayoutMode mode, ThreadPool* p = nullptr):pool(p),bTree(buddy, p ? p->getThreadCount() : 1, p),layoutMode(mode)
+	{
+	}
+	void reset()
+	{
+		buddy.reset();
+		bTree.reset();
+	}
+};
+
+// Check the icons and labels before anything is built, the moved items are left in builder.layout
+template<uint32_t PageSize>
+bool checkLayout(int argc, char* argv[], StoreBuilder<PageSize>& builder)
+{
+	const char* outFileName = argv[1];
+	FinderLayout& layout = builder.layout;
+	if(!parseLayoutArgs(std::vector<std::string_view>(argv + 2, argv + argc), layout))
+		return false;
+	builder.checker.check(layout, builder.issues);
+	if(builder.issues.empty())
+		return true;
+	printLayoutIssues(outFileName, layout, builder.issues);
+	if(builder.layoutMode == LAYOUT_CHECK)
+		return false;
+	uint32_t unplaced = builder.checker.nudge(layout, builder.issues);
+	for(uint32_t i=0;i<layout.items.size();i++)
+	{
+		uint32_t x, y;
+		if(parseInt(argv[9 + i * 3], x) && parseInt(argv[10 + i * 3], y) && (layout.items[i].x != int32_t(x) || layout.items[i].y != int32_t(y)))
+			printf("%s: moved %s to %d,%d\n", outFileName, layout.items[i].name.c_str(), layout.items[i].x, layout.items[i].y);
+	}
+	if(unplaced)
+	{
+		printf("%s: no free place for %u items\n", outFileName, unplaced);
+		return false;
+	}
+	return true;
+}
+
+// Build the store described by the arguments, with the same layout as the command line
+// The output is added to the batch, which will make it visible on commit
+template<uint32_t PageSize>
+bool forgeStore(int argc, char* argv[], StoreBuilder<PageSize>& builder, OutputBatch& batch, DigestManifest* manifest)
+{
 	const char* outFileName = argv[1];
 	const char* bgFileName = argv[2];
 	const char* bgWidth = argv[3];
@@ -397,53 +1380,311 @@ int main(int argc, char* argv[])
 	const char* volumeName = argv[5];
 	const char* iconSize = argv[6];
 	const char* textSize = argv[7];
+	builder.reset();
+	BuddyAllocator& buddy = builder.buddy;
+	BTree<PageSize>& bTree = builder.bTree;
+	std::vector<uint8_t>& aliasFile = builder.aliasFile;
+	uint32_t width, height, iconSizeValue, textSizeValue;
+	if(!getInt(bgWidth, width) || !getInt(bgHeight, height) || !getInt(iconSize, iconSizeValue) || !getInt(textSize, textSizeValue))
+		return false;
+	if(builder.layoutMode != LAYOUT_UNCHECKED && !checkLayout(argc, argv, builder))
+		return false;
 	// Create the alias file first, we need to know the size to build the Btree
-	std::vector<uint8_t> aliasFile = createAliasFile(volumeName, bgFileName);
-	BuddyAllocator buddy;
-	BTree bTree(buddy);
+	createAliasFile(volumeName, bgFileName, aliasFile);
 	// Forge a PctB blob for the bg
-	std::vector<uint8_t> PctB(12, 0);
-	PctBRecord* pctBRecord = (PctBRecord*)PctB.data();
-	memcpy(pctBRecord->type, "PctB", 4);
-	pctBRecord->aliasLen = htonl(aliasFile.size());
-	bTree.addBlob(".", "BKGD", PctB);
+	bTree.addBlob(".", "BKGD", BackgroundPictureSchema::encode(BackgroundPicture{ uint32_t(aliasFile.size()) }));
 	bTree.addBool(".", "ICVO", 1);
 	// Forge a Finder Window blob
-	std::vector<uint8_t> Fw(16, 0);
-	FinderWindowRecord* fw = (FinderWindowRecord*)Fw.data();
-	fw->top = htons(200);
-	fw->left = htons(300);
-	fw->bottom = htons(200 + getInt(bgHeight));
-	fw->right = htons(300 + getInt(bgWidth));
-	memcpy(fw->viewType, "icnv", 4);
-	bTree.addBlob(".", "fwi0", Fw);
+	FinderWindow fw;
+	fw.top = 200;
+	fw.left = 300;
+	fw.bottom = 200 + height;
+	fw.right = 300 + width;
+	fw.viewType = fourCC("icnv");
+	bTree.addBlob(".", "fwi0", FinderWindowSchema::encode(fw));
 	// Force an Icon View record
-	std::vector<uint8_t> ivData(26, 0);
-	Icv4Record* iv = (Icv4Record*)ivData.data();
-	memcpy(iv->type, "icv4", 4);
-	iv->iconSize = htons(getInt(iconSize));
-	memcpy(iv->arrangedBy, "none", 4);
-	memcpy(iv->labelPosition, "botm", 4);
-	bTree.addBlob(".", "icvo", ivData);
-	bTree.addShort(".", "icvt", getInt(textSize));
+	IconViewOptions iv;
+	iv.iconSize = iconSizeValue;
+	iv.arrangedBy = fourCC("none");
+	iv.labelPosition = fourCC("botm");
+	bTree.addBlob(".", "icvo", IconViewOptionsSchema::encode(iv));
+	bTree.addShort(".", "icvt", textSizeValue);
 	bTree.addBlob(".", "pict", aliasFile);
-	for(int i=8;i<argc;i+=3)
-	{
-		const char* fileName = argv[i];
-		uint32_t centerX = getInt(argv[i+1]);
-		uint32_t centerY = getInt(argv[i+2]);
-		Record ilocRecord(16);
-		ilocRecord.writeInt32(centerX);
-		ilocRecord.writeInt32(centerY);
-		ilocRecord.writeInt16(0xffff);
-		ilocRecord.writeInt16(0xffff);
-		ilocRecord.writeInt16(0xffff);
-		bTree.addBlob(fileName, "Iloc", ilocRecord);
-	}
+	// Big stores get a run of items for each shard. Equal records keep the order of the shards
+	// when merged, so the output is the same as with a single one.
+	static const uint32_t minShardedItems = 4096;
+	uint32_t itemCount = (argc - 8) / 3;
+	uint32_t shardCount = builder.pool && itemCount >= minShardedItems ? bTree.getShardCount() : 1;
+	std::atomic<bool> validItems(true);
+	auto addItems = [&](uint32_t shard, uint32_t)
+	{
+		RecordShard& records = bTree.getShard(shard);
+		uint32_t end = uint64_t(itemCount) * (shard + 1) / shardCount;
+		for(uint32_t item=uint64_t(itemCount) * shard / shardCount;item<end;item++)
+		{
+			int i = 8 + item * 3;
+			IconLocation iloc;
+			if(!getInt(argv[i+1], iloc.x) || !getInt(argv[i+2], iloc.y))
+			{
+				validItems = false;
+				return;
+			}
+			if(builder.layoutMode == LAYOUT_NUDGE)
+			{
+				iloc.x = builder.layout.items[item].x;
+				iloc.y = builder.layout.items[item].y;
+			}
+			records.addBlob(argv[i], "Iloc", IconLocationSchema::encode(iloc));
+		}
+	};
+	if(shardCount > 1)
+		builder.pool->parallelFor(shardCount, addItems);
+	else
+		addItems(0, 0);
+	if(!validItems)
+		return false;
 	uint32_t bTreeBlockId = bTree.finish();
 	buddy.createMetaDataBlock(bTreeBlockId);
-	FILE* outFile = fopen(outFileName, "w");
-	buddy.writeFile(outFile);
-	fclose(outFile);
-	return 0;
+	return buddy.writeFile(batch, outFileName, manifest);
+}
+
+// The lines of a list file with their numbers, empty lines and comments are skipped
+bool readList(const char* listFileName, std::vector<std::pair<uint32_t, std::string>>& lines)
+{
+	lines.clear();
+	ManifestReader reader;
+	if(!reader.open(listFileName))
+		return false;
+	std::string_view line;
+	while(reader.nextLine(line))
+		lines.emplace_back(reader.getLineNum(), std::string(line));
+	return true;
+}
+
+// Turn the fields of a list line into arguments after the program name, they are copied to buffer
+bool splitStoreArgs(char* progName, const char* listFileName, uint32_t lineNum, const std::vector<std::string_view>& fields,
+	std::string& buffer, std::vector<char*>& args)
+{
+	args.clear();
+	args.push_back(progName);
+	if(!isValidStoreArgs(fields.size() + 1))
+	{
+		printf("%s:%u: Expected output_file bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n", listFileName, lineNum);
+		return false;
+	}
+	// The fields are consecutive in the line, separated by single tabs
+	const char* lineStart = fields.front().data();
+	buffer.assign(lineStart, fields.back().data() + fields.back().size());
+	for(std::string_view f: fields)
+	{
+		uint32_t offset = f.data() - lineStart;
+		args.push_back(&buffer[offset]);
+		buffer[offset + f.size()] = 0;
+	}
+	return true;
+}
+
+// Build one store for each line of the list, the arguments are separated by tabs
+// All the outputs are synced together at the end
+template<uint32_t PageSize>
+int forgeBatch(char* progName, const char* listFileName, bool useIoRing, const char* manifestPath, LayoutMode layoutMode, ThreadPool* pool)
+{
+	ManifestReader reader;
+	if(!reader.open(listFileName))
+		return 1;
+	OutputBatch batch;
+	// Falls back to regular writes if io_uring is not available
+	if(useIoRing)
+		batch.enableIoRing();
+	std::vector<char*> args;
+	std::string buffer;
+	StoreBuilder<PageSize> builder(layoutMode, pool);
+	DigestManifest manifest;
+	// Each line is built as soon as it is parsed
+	std::string_view line;
+	while(reader.nextLine(line))
+	{
+		if(!splitStoreArgs(progName, listFileName, reader.getLineNum(), reader.getFields(), buffer, args) ||
+			!forgeStore(args.size(), args.data(), builder, batch, manifestPath ? &manifest : nullptr))
+		{
+			return 1;
+		}
+	}
+	if(manifestPath && !manifest.write(batch, manifestPath))
+		return 1;
+	return batch.commit() ? 0 : 1;
+}
+
+// Rebuild the stores every time the list changes, only the lines which are new or modified are built again
+// The store contents only depend on the list, the background image is referenced by name
+template<uint32_t PageSize>
+int watchStores(char* progName, const char* listFileName, LayoutMode layoutMode, ThreadPool* pool)
+{
+	FileWatcher watcher;
+	if(!watcher.addFile(listFileName))
+		return 1;
+	// The line each output has been built from
+	std::map<std::string, std::string> built;
+	std::vector<std::pair<uint32_t, std::string>> lines;
+	ManifestReader splitter;
+	std::vector<char*> args;
+	std::string buffer;
+	StoreBuilder<PageSize> builder(layoutMode, pool);
+	std::set<std::string> changed;
+	FileWatcher::Clock::time_point changeTime;
+	bool initial = true;
+	while(true)
+	{
+		auto start = FileWatcher::Clock::now();
+		// A broken list is reported, the next change may fix it
+		if(readList(listFileName, lines))
+		{
+			OutputBatch batch;
+			std::set<std::string> outputs;
+			uint32_t count = 0;
+			bool ok = true;
+			for(auto& line: lines)
+			{
+				const std::string& text = line.second;
+				splitter.split(text);
+				if(!splitStoreArgs(progName, listFileName, line.first, splitter.getFields(), buffer, args))
+				{
+					ok = false;
+					continue;
+				}
+				outputs.insert(args[1]);
+				auto it = built.find(args[1]);
+				if(it != built.end() && it->second == text)
+					continue;
+				if(!forgeStore(args.size(), args.data(), builder, batch, nullptr))
+				{
+					ok = false;
+					continue;
+				}
+				built[args[1]] = text;
+				count++;
+			}
+			// Lines may have been removed, build their outputs again if they come back
+			for(auto it = built.begin(); it != built.end(); )
+				it = outputs.count(it->first) ? std::next(it) : built.erase(it);
+			if(!batch.commit())
+			{
+				built.clear();
+				ok = false;
+			}
+			auto end = FileWatcher::Clock::now();
+			printf("Updated %u of %zu stores in %.1f ms", count, outputs.size(), std::chrono::duration<double, std::milli>(end - start).count());
+			if(!initial)
+				printf(", %.1f ms after the change", std::chrono::duration<double, std::milli>(end - changeTime).count());
+			printf(ok ? "\n" : ", with errors\n");
+		}
+		fflush(stdout);
+		initial = false;
+		if(!watcher.wait(changed, changeTime))
+			return 1;
+	}
+}
+
+int usage(const char* progName)
+{
+	printf("Usage: %s [--digests manifest.txt] [--page-size 4096|8192|16384] [--layout check|nudge] [--jobs N] output_file bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n", progName);
+	printf("       %s --edit file.DS_Store [file_name file_center_x file_center_y]+\n", progName);
+	printf("       %s [--digests manifest.txt] [--page-size 4096|8192|16384] [--layout check|nudge] [--jobs N] --batch list.txt [--io-uring]\n", progName);
+	printf("       %s [--page-size 4096|8192|16384] [--layout check|nudge] [--jobs N] --watch list.txt\n", progName);
+	printf("With --jobs, big stores are built with N threads, 0 is one per core\n");
+	return 1;
+}
+
+// Build new stores with the given B-tree page size, with threadCount threads for each store
+template<uint32_t PageSize>
+int forgeStores(int argc, char* argv[], const char* manifestPath, LayoutMode layoutMode, uint32_t threadCount)
+{
+	std::unique_ptr<ThreadPool> pool;
+	if(threadCount != 1)
+		pool.reset(new ThreadPool(threadCount));
+	if(argc == 3 && strcmp(argv[1], "--watch") == 0)
+	{
+		// The outputs change all the time, a manifest would be stale right away
+		if(manifestPath)
+			return usage(argv[0]);
+		return watchStores<PageSize>(argv[0], argv[2], layoutMode, pool.get());
+	}
+	if((argc == 3 || (argc == 4 && strcmp(argv[3], "--io-uring") == 0)) && strcmp(argv[1], "--batch") == 0)
+		return forgeBatch<PageSize>(argv[0], argv[2], argc == 4, manifestPath, layoutMode, pool.get());
+	if(!isValidStoreArgs(argc))
+		return usage(argv[0]);
+	StoreBuilder<PageSize> builder(layoutMode, pool.get());
+	OutputBatch batch;
+	DigestManifest manifest;
+	if(!forgeStore(argc, argv, builder, batch, manifestPath ? &manifest : nullptr))
+		return 1;
+	if(manifestPath && !manifest.write(batch, manifestPath))
+		return 1;
+	return batch.commit() ? 0 : 1;
+}
+
+int dsStoreMain(int argc, char* argv[])
+{
+	// The SHA-256 and XXH3 digests of the new stores, the page size, the layout checks and the
+	// threads building each store can be requested before the other arguments
+	const char* manifestPath = nullptr;
+	uint32_t pageSize = 0;
+	LayoutMode layoutMode = LAYOUT_UNCHECKED;
+	uint32_t threadCount = 1;
+	while(argc >= 3 && (strcmp(argv[1], "--digests") == 0 || strcmp(argv[1], "--page-size") == 0 ||
+		strcmp(argv[1], "--layout") == 0 || strcmp(argv[1], "--jobs") == 0))
+	{
+		if(argv[1][2] == 'j')
+		{
+			if(!getInt(argv[2], threadCount))
+				return 1;
+		}
+		else if(argv[1][2] == 'd')
+			manifestPath = argv[2];
+		else if(argv[1][2] == 'l')
+		{
+			if(strcmp(argv[2], "check") == 0)
+				layoutMode = LAYOUT_CHECK;
+			else if(strcmp(argv[2], "nudge") == 0)
+				layoutMode = LAYOUT_NUDGE;
+			else
+				return usage(argv[0]);
+		}
+		else
+		{
+			if(!getInt(argv[2], pageSize))
+				return 1;
+		}
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	if(argc >= 2 && strcmp(argv[1], "--edit") == 0)
+	{
+		// Edits are done in place, there is no new output to digest and the page size is the
+		// one of the store
+		if(argc < 3 || ((argc - 3) % 3) != 0 || manifestPath || pageSize || layoutMode != LAYOUT_UNCHECKED || threadCount != 1)
+			return usage(argv[0]);
+		return editStore(argc, argv);
+	}
+	switch(pageSize)
+	{
+		case 0:
+		case 4096:
+			return forgeStores<4096>(argc, argv, manifestPath, layoutMode, threadCount);
+		case 8192:
+			return forgeStores<8192>(argc, argv, manifestPath, layoutMode, threadCount);
+		case 16384:
+			return forgeStores<16384>(argc, argv, manifestPath, layoutMode, threadCount);
+	}
+	printf("Unsupported page size: %u\n", pageSize);
+	return 1;
+}
+
+// The multi-call binary includes this file and provides its own main
+#ifndef MACOS_UTILS
+int main(int argc, char* argv[])
+{
+	return dsStoreMain(argc, argv);
 }
+#endif
@@ -23,11 +23,30 @@
  * SOFTWARE.
  */
 
+#include <array>
+#include <assert.h>
+#include <atomic>
+#include <errno.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <string>
 #include <vector>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "digest.h"
+#include "file_watcher.h"
+#include "icns_image.h"
+#include "manifest_reader.h"
+#include "output_file.h"
+#include "thread_pool.h"
 
 class Record: public std::vector<uint8_t>
 {
@@ -79,102 +98,702 @@ public:
 	{
 		curOffset = o;
 	}
+	// Start over, the memory is kept
+	void reset()
+	{
+		clear();
+		curOffset = 0;
+	}
 };
 
-int main(int argc, char* argv[])
+// It seems that some space must be left alone for the "system"
+static const uint32_t startOffset = 0x100;
+static const uint8_t systemPad[startOffset - 16] = {};
+// Bigger inputs are copied by the kernel instead of read in memory
+static const uint32_t maxBufferedSize = 1 << 20;
+
+// The classic icon resources stored before the icns one, each preceded by its length
+struct ClassicIcons
 {
-	if(argc < 3)
+	std::vector<uint8_t> data;
+	// The type and the offset in data of each resource
+	std::vector<std::pair<const char*, uint32_t>> resources;
+	void reset()
 	{
-		printf("Usage %s output_file file.icns\n", argv[0]);
-		return 1;
+		data.clear();
+		resources.clear();
 	}
-	const char* outFileName = argv[1];
-	const char* fileName = argv[2];
-	FILE* f = fopen(fileName, "r");
-	if(f == nullptr)
+	// Make room for a new resource, to be filled right away
+	uint8_t* add(const char* type, uint32_t len)
 	{
-		printf("File not found\n");
-		return 1;
+		resources.emplace_back(type, data.size());
+		uint32_t beLen = htonl(len);
+		data.insert(data.end(), (const uint8_t*)&beLen, (const uint8_t*)&beLen + 4);
+		data.resize(data.size() + len);
+		return data.data() + data.size() - len;
 	}
-	// Forge the resource map first, the first 16-bytes are also equal to the file header
+};
+
+// The classic icons of each size, the 1-bit one also holds the mask
+struct ClassicFamily
+{
+	uint32_t size;
+	const char* types[3];
+	// The length of types[i]
+	constexpr uint32_t length(uint32_t i) const
+	{
+		return i == 0 ? size * size / 4 : size * size * i / 2;
+	}
+};
+
+// In the order of the resources, their layout is always the same
+static constexpr ClassicFamily classicFamilies[2] = { { 32, { "ICN#", "icl4", "icl8" } }, { 16, { "ics#", "ics4", "ics8" } } };
+static constexpr uint32_t classicIconCount = 6;
+
+// What to store next to the icns resource
+struct ForgeOptions
+{
+	bool classicIcons;
+	bool dither;
+};
+
+// The memory used by each worker, reused for all the files it processes
+struct WorkerBuffers
+{
 	Record resMap;
-	fseek(f, 0, SEEK_END);
-	uint32_t fileLen = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	uint32_t resLen = fileLen + 4;
-	// It seems that some space must be left alone for the "system"
-	const uint32_t startOffset = 0x100;
+	std::vector<uint8_t> payload;
+	OutputDigest digest;
+	ClassicIcons classicIcons;
+	IcnsReader reader;
+	BoxScaler scaler;
+	Image source;
+	Image scaled;
+	std::vector<uint8_t> indices;
+	std::vector<int16_t> errors;
+};
+
+// A Mac system color table, with a cube mapping every 15-bit color to its nearest entry
+struct Palette
+{
+	uint32_t count;
+	uint8_t colors[256][3];
+	uint8_t cube[32 * 32 * 32];
+	void buildCube()
+	{
+		for(uint32_t i=0;i<32 * 32 * 32;i++)
+		{
+			// The center of the cell
+			int r = ((i >> 10) << 3) | 4;
+			int g = (((i >> 5) & 31) << 3) | 4;
+			int b = ((i & 31) << 3) | 4;
+			uint32_t best = 0;
+			int bestDist = INT32_MAX;
+			for(uint32_t j=0;j<count;j++)
+			{
+				int dr = r - colors[j][0];
+				int dg = g - colors[j][1];
+				int db = b - colors[j][2];
+				// Weighted for the sensitivity of the eye
+				int dist = 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+				if(dist < bestDist)
+				{
+					best = j;
+					bestDist = dist;
+				}
+			}
+			cube[i] = best;
+		}
+	}
+	uint8_t nearest(int r, int g, int b) const
+	{
+		return cube[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+	}
+};
+
+// The 1-bit, 4-bit and 8-bit system palettes, the first entry is always white
+const Palette& getPalette(uint32_t depth)
+{
+	static Palette palettes[3];
+	static bool built = [](){
+		palettes[0].count = 2;
+		memset(palettes[0].colors[0], 0xff, 3);
+		memset(palettes[0].colors[1], 0, 3);
+		static const uint32_t colors4[16] = { 0xffffff, 0xfcf305, 0xff6402, 0xdd0806, 0xf20884, 0x4600a5, 0x0000d4, 0x02abea,
+			0x1fb714, 0x006411, 0x562c05, 0x90713a, 0xc0c0c0, 0x808080, 0x404040, 0x000000 };
+		palettes[1].count = 16;
+		for(uint32_t i=0;i<16;i++)
+		{
+			palettes[1].colors[i][0] = colors4[i] >> 16;
+			palettes[1].colors[i][1] = colors4[i] >> 8;
+			palettes[1].colors[i][2] = colors4[i];
+		}
+		// The 6x6x6 cube from white, without black, then the red, green, blue and gray ramps and black
+		Palette& p = palettes[2];
+		p.count = 256;
+		for(uint32_t i=0;i<215;i++)
+		{
+			p.colors[i][0] = (5 - i / 36) * 0x33;
+			p.colors[i][1] = (5 - (i / 6) % 6) * 0x33;
+			p.colors[i][2] = (5 - i % 6) * 0x33;
+		}
+		static const uint8_t ramp[10] = { 0xee, 0xdd, 0xbb, 0xaa, 0x88, 0x77, 0x55, 0x44, 0x22, 0x11 };
+		memset(p.colors[215], 0, 41 * 3);
+		for(uint32_t i=0;i<10;i++)
+		{
+			p.colors[215 + i][0] = ramp[i];
+			p.colors[225 + i][1] = ramp[i];
+			p.colors[235 + i][2] = ramp[i];
+			memset(p.colors[245 + i], ramp[i], 3);
+		}
+		for(Palette& palette: palettes)
+			palette.buildCube();
+		return true;
+	}();
+	(void)built;
+	return palettes[depth == 1 ? 0 : depth == 4 ? 1 : 2];
+}
+
+// Map the premultiplied pixels, composited over white, to the palette with optional Floyd-Steinberg dithering
+// Pixels outside of the mask get the white entry
+void quantize(const Image& img, const Palette& palette, bool dither, std::vector<uint8_t>& indices, std::vector<int16_t>& errors)
+{
+	uint32_t size = img.width;
+	indices.resize(size * size);
+	// The errors for the current and the next row, with a pixel of padding on both sides
+	uint32_t rowLen = (size + 2) * 3;
+	errors.assign(rowLen * 2, 0);
+	int16_t* cur = errors.data();
+	int16_t* next = cur + rowLen;
+	for(uint32_t y=0;y<size;y++)
+	{
+		std::fill(next, next + rowLen, 0);
+		for(uint32_t x=0;x<size;x++)
+		{
+			const uint8_t* p = img.pixels.data() + (y * size + x) * 4;
+			uint8_t& index = indices[y * size + x];
+			if(p[3] < 128)
+			{
+				index = 0;
+				continue;
+			}
+			int v[3];
+			for(uint32_t c=0;c<3;c++)
+				v[c] = std::clamp(p[c] + 255 - p[3] + cur[(x + 1) * 3 + c], 0, 255);
+			index = palette.nearest(v[0], v[1], v[2]);
+			if(!dither)
+				continue;
+			for(uint32_t c=0;c<3;c++)
+			{
+				int e = v[c] - palette.colors[index][c];
+				cur[(x + 2) * 3 + c] += e * 7 / 16;
+				next[x * 3 + c] += e * 3 / 16;
+				next[(x + 1) * 3 + c] += e * 5 / 16;
+				next[(x + 2) * 3 + c] += e / 16;
+			}
+		}
+		std::swap(cur, next);
+	}
+}
+
+// Pack the indices row after row, most significant bits first
+void packIndices(const std::vector<uint8_t>& indices, uint32_t depth, uint8_t* dst)
+{
+	uint32_t perByte = 8 / depth;
+	for(uint32_t i=0;i<indices.size();i++)
+	{
+		if(i % perByte == 0)
+			dst[i / perByte] = 0;
+		dst[i / perByte] |= indices[i] << (8 - depth * (i % perByte + 1));
+	}
+}
+
+// Generate the 32x32 and 16x16 classic icons from the best icns member for each size
+// The 1-bit ones (ICN# and ics#) also contain the mask for all of them
+bool createClassicIcons(const uint8_t* icns, uint32_t len, bool dither, WorkerBuffers& buffers)
+{
+	ClassicIcons& icons = buffers.classicIcons;
+	std::vector<uint8_t>& indices = buffers.indices;
+	if(!buffers.reader.parse(icns, len))
+		return false;
+	for(const ClassicFamily& f: classicFamilies)
+	{
+		if(!buffers.reader.decode(f.size, buffers.source))
+		{
+			icons.reset();
+			return false;
+		}
+		premultiplyAlpha(buffers.source);
+		buffers.scaler.scale(buffers.source, f.size, buffers.scaled);
+		const Image& img = buffers.scaled;
+		uint32_t pixelCount = f.size * f.size;
+		uint8_t* p = icons.add(f.types[0], f.length(0));
+		quantize(img, getPalette(1), dither, indices, buffers.errors);
+		packIndices(indices, 1, p);
+		for(uint32_t i=0;i<pixelCount;i++)
+			indices[i] = img.pixels[i * 4 + 3] >= 128;
+		packIndices(indices, 1, p + pixelCount / 8);
+		for(uint32_t depth: { 4, 8 })
+		{
+			p = icons.add(f.types[depth / 4], f.length(depth / 4));
+			quantize(img, getPalette(depth), dither, indices, buffers.errors);
+			packIndices(indices, depth, p);
+		}
+	}
+	return true;
+}
+
+// Forge the resource map for the given number of classic icons, the first 16-bytes are also
+// equal to the file header. The icns resource comes after the classic icons, if any.
+// Only the map offset and the resource length depend on the icns, they are left for an empty one.
+template<uint32_t ClassicCount>
+constexpr std::array<uint8_t, 30 + (ClassicCount + 1) * 20> makeResourceMap()
+{
+	std::array<uint8_t, 30 + (ClassicCount + 1) * 20> resMap{};
+	uint32_t offset = 0;
+	auto writeInt16 = [&](uint16_t v)
+	{
+		resMap[offset++] = v >> 8;
+		resMap[offset++] = v;
+	};
+	auto writeInt32 = [&](uint32_t v)
+	{
+		writeInt16(v >> 16);
+		writeInt16(v);
+	};
+	auto writeStr = [&](const char* s)
+	{
+		while(*s)
+			resMap[offset++] = *s++;
+	};
+	// The type and the offset in the data of each classic icon
+	const char* types[ClassicCount + 1] = { "icns" };
+	uint32_t dataOffsets[ClassicCount + 1] = {};
+	uint32_t classicLen = 0;
+	for(uint32_t i=0;i<ClassicCount;i++)
+	{
+		const ClassicFamily& f = classicFamilies[i / 3];
+		types[i + 1] = f.types[i % 3];
+		dataOffsets[i + 1] = classicLen;
+		classicLen += 4 + f.length(i % 3);
+	}
+	dataOffsets[0] = classicLen;
+	uint32_t resLen = classicLen + 4;
 	// The offset to the resource from the start of the file
-	resMap.writeInt32(startOffset);
+	writeInt32(startOffset);
 	// The end of the resource (start of the map)
-	resMap.writeInt32(startOffset + resLen);
+	writeInt32(startOffset + resLen);
 	// The lenght of the resource
-	resMap.writeInt32(resLen);
-	// We need to fixup the map size later on
-	uint32_t mapSizePos = resMap.size();
-	resMap.writeInt32(0);
+	writeInt32(resLen);
+	// The full map length
+	writeInt32(resMap.size());
 	// Next map (not present)
-	resMap.writeInt32(0);
+	writeInt32(0);
 	// File reference number
 	// TODO: How is this determined?
-	resMap.writeInt16(0xaa09);
+	writeInt16(0xaa09);
 	// Resource fork attributes
-	resMap.writeInt16(0);
-	// Offset from map start to type list, to fixup
-	uint32_t mapToTypeListPos = resMap.size();
-	resMap.writeInt16(0);
-	// Offset from map start to name list, to fixup
-	resMap.writeInt16(0);
-	uint32_t typeListStartPos = resMap.size();
+	writeInt16(0);
+	// Offset from map start to type list
+	uint32_t typeListStartPos = offset + 4;
+	writeInt16(typeListStartPos);
+	// Offset from map start to name list, as we have no name list the offset is equal to the map size
+	writeInt16(resMap.size());
+	uint32_t typeCount = ClassicCount + 1;
 	// Number of types - 1
-	resMap.writeInt16(0);
-	// Type ID
-	resMap.writeStr("icns");
-	// Number of resources for this type - 1
-	resMap.writeInt16(0);
-	// Offset from type list start to res list, to fixup
-	uint32_t typeListToResListPos = resMap.size();
-	resMap.writeInt16(0);
-	uint32_t resListStartPos = resMap.size();
-	// Resource ID (is this fixed?)
-	resMap.writeInt16(0xbfb9);
-	// Offset to name (no name, so 0xffff)
-	resMap.writeInt16(0xffff);
-	// Atributes | Offset to data
-	resMap.writeInt32(0);
-	// Resource handle (is this fixed?)
-	resMap.writeInt32(0xb0000000);
-	// Fixup the full map length
-	resMap.seek(mapSizePos);
-	resMap.writeInt32(resMap.size());
-	// Fixup the offset from the map to the type and name list
-	// as we have no name list the offset is equal to the map size
-	resMap.seek(mapToTypeListPos);
-	resMap.writeInt16(typeListStartPos);
-	resMap.writeInt16(resMap.size());
-	// Fixup the last one
-	resMap.seek(typeListToResListPos);
-	resMap.writeInt16(resListStartPos - typeListStartPos);
-	FILE* outFile = fopen(outFileName, "w");
-	// Write out the header first
-	fwrite(resMap.data(), 1, 16, outFile);
+	writeInt16(typeCount - 1);
+	// A single resource for each type, the res lists follow the type list
+	uint32_t resListOffset = 2 + typeCount * 8;
+	for(uint32_t i=0;i<typeCount;i++)
+	{
+		// Type ID
+		writeStr(types[i]);
+		// Number of resources for this type - 1
+		writeInt16(0);
+		// Offset from type list start to res list
+		writeInt16(resListOffset + i * 12);
+	}
+	for(uint32_t i=0;i<typeCount;i++)
+	{
+		// Resource ID (is this fixed?)
+		writeInt16(0xbfb9);
+		// Offset to name (no name, so 0xffff)
+		writeInt16(0xffff);
+		// Atributes | Offset to data
+		writeInt32(dataOffsets[i]);
+		// Resource handle (is this fixed?)
+		writeInt32(0xb0000000);
+	}
+	return resMap;
+}
+
+static constexpr auto icnsResourceMap = makeResourceMap<0>();
+static constexpr auto classicResourceMap = makeResourceMap<classicIconCount>();
+
+// Copy the resource map built at compile time and patch the lengths
+void createResourceMap(uint32_t fileLen, const ClassicIcons& icons, Record& resMap)
+{
+	if(icons.resources.empty())
+		resMap.assign(icnsResourceMap.begin(), icnsResourceMap.end());
+	else
+	{
+		assert(icons.resources.size() == classicIconCount);
+		resMap.assign(classicResourceMap.begin(), classicResourceMap.end());
+	}
+	uint32_t resLen = icons.data.size() + fileLen + 4;
+	resMap.seek(4);
+	resMap.writeInt32(startOffset + resLen);
+	resMap.writeInt32(resLen);
+}
+
+// Write the output sequentially, hashing everything on the way
+bool copyHashed(int fd, const char* fileName, uint32_t fileLen, WorkerBuffers& buffers, OutputFile& outFile, const char* outFileName)
+{
+	Record& resMap = buffers.resMap;
+	OutputDigest& digest = buffers.digest;
+	uint32_t beFileLen = htonl(fileLen);
+	digest.reset();
+	digest.update(resMap.data(), 16);
+	digest.update(systemPad, sizeof(systemPad));
+	digest.update(&beFileLen, 4);
+	if(!outFile.open(outFileName) || !outFile.write(resMap.data(), 16) || !outFile.write(systemPad, sizeof(systemPad)) ||
+		!outFile.write(&beFileLen, 4))
+	{
+		return false;
+	}
+	buffers.payload.resize(maxBufferedSize);
+	for(uint32_t copied=0;copied<fileLen;)
+	{
+		ssize_t r = pread(fd, buffers.payload.data(), std::min(fileLen - copied, maxBufferedSize), copied);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+		{
+			printf("Cannot read %s\n", fileName);
+			return false;
+		}
+		digest.update(buffers.payload.data(), r);
+		if(!outFile.write(buffers.payload.data(), r))
+			return false;
+		copied += r;
+	}
+	digest.update(resMap.data(), resMap.size());
+	return outFile.write(resMap.data(), resMap.size());
+}
+
+// Write the resource fork for the icns file at fileName, the output is left uncommitted
+// If digestResult is not null the digests of the output are computed while writing it
+bool forgeResource(const char* outFileName, const char* fileName, const ForgeOptions& options, WorkerBuffers& buffers,
+	OutputFile& outFile, DigestResult* digestResult)
+{
+	Record& resMap = buffers.resMap;
+	ClassicIcons& icons = buffers.classicIcons;
+	icons.reset();
+	int fd = open(fileName, O_RDONLY);
+	if(fd < 0)
+	{
+		printf("File not found: %s\n", fileName);
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		printf("Cannot read %s\n", fileName);
+		close(fd);
+		return false;
+	}
+	uint32_t fileLen = st.st_size;
+	uint32_t beFileLen = htonl(fileLen);
+	// Small icons are read in memory and written with a single syscall
+	// The classic icons are generated from memory as well, whatever the size
+	if(fileLen > 0 && (fileLen <= maxBufferedSize || options.classicIcons))
+	{
+		buffers.payload.resize(fileLen);
+		ssize_t r;
+		do
+			r = pread(fd, buffers.payload.data(), fileLen, 0);
+		while(r < 0 && errno == EINTR);
+		close(fd);
+		if(r != ssize_t(fileLen))
+		{
+			printf("Cannot read %s\n", fileName);
+			return false;
+		}
+		if(options.classicIcons && !createClassicIcons(buffers.payload.data(), fileLen, options.dither, buffers))
+			printf("No usable image in %s, classic icons skipped\n", fileName);
+		createResourceMap(fileLen, icons, resMap);
+		struct iovec iov[6];
+		uint32_t iovCount = 0;
+		iov[iovCount++] = { resMap.data(), 16 };
+		iov[iovCount++] = { (void*)systemPad, sizeof(systemPad) };
+		if(!icons.data.empty())
+			iov[iovCount++] = { icons.data.data(), icons.data.size() };
+		iov[iovCount++] = { &beFileLen, 4 };
+		iov[iovCount++] = { buffers.payload.data(), fileLen };
+		iov[iovCount++] = { resMap.data(), resMap.size() };
+		if(digestResult)
+		{
+			buffers.digest.reset();
+			for(uint32_t i=0;i<iovCount;i++)
+				buffers.digest.update(iov[i].iov_base, iov[i].iov_len);
+			*digestResult = buffers.digest.finish();
+		}
+		return outFile.open(outFileName) && outFile.writev(iov, iovCount);
+	}
+	createResourceMap(fileLen, icons, resMap);
+	if(digestResult)
+	{
+		// The payload must pass through memory to be hashed
+		bool ok = copyHashed(fd, fileName, fileLen, buffers, outFile, outFileName);
+		close(fd);
+		*digestResult = buffers.digest.finish();
+		return ok;
+	}
+	bool ok = outFile.open(outFileName) &&
+		// Write out the header first
+		outFile.write(resMap.data(), 16);
 	// Skip the "system" reserved part
-	fseek(outFile, startOffset, SEEK_SET);
 	// The resource itself, plus the size as an header
-	uint32_t beFileLen = htonl(fileLen);
-	fwrite(&beFileLen, 1, 4, outFile);
-	// Copy over the whole file
-	uint8_t buf[1024];
-	uint32_t r = 0;
-	do
-	{
-		r = fread(buf, 1, 1024, f);
-		fwrite(buf, 1, r, outFile);
-	}
-	while(r == 1024);
-	// Copy over the map
-	fwrite(resMap.data(), 1, resMap.size(), outFile);
-	fclose(f);
-	fclose(outFile);
+	ok = ok && outFile.writeAt(startOffset, &beFileLen, 4) &&
+		// Copy over the whole file
+		outFile.copyFrom(fd, 0, fileLen) &&
+		// Copy over the map
+		outFile.write(resMap.data(), resMap.size());
+	close(fd);
+	return ok;
+}
+
+typedef std::vector<std::pair<std::string, std::string>> JobList;
+
+// Read the list of output_file<TAB>file.icns lines
+bool readJobs(const char* listFileName, JobList& jobs)
+{
+	jobs.clear();
+	ManifestReader reader;
+	if(!reader.open(listFileName))
+		return false;
+	std::string_view line;
+	while(reader.nextLine(line))
+	{
+		const std::vector<std::string_view>& fields = reader.getFields();
+		if(fields.size() != 2)
+		{
+			printf("%s:%u: Expected output_file file.icns\n", listFileName, reader.getLineNum());
+			return false;
+		}
+		jobs.emplace_back(std::string(fields[0]), std::string(fields[1]));
+	}
+	return true;
+}
+
+// The state kept between batches, the workers and their buffers stay warm
+struct BatchContext
+{
+	ThreadPool pool;
+	std::vector<WorkerBuffers> workerBuffers;
+	BatchContext(uint32_t threadCount):pool(threadCount),workerBuffers(pool.getThreadCount())
+	{
+	}
+};
+
+// Forge the resources in parallel and add them to the batch
+// If digests is not null it receives the digests of the outputs, in the same order as the jobs
+bool forgeJobs(const JobList& jobs, const ForgeOptions& options, BatchContext& context, OutputBatch& batch,
+	DigestResult* digests, uint64_t& totalBytes)
+{
+	std::mutex batchMutex;
+	std::atomic<bool> failed(false);
+	std::atomic<uint64_t> bytes(0);
+	context.pool.parallelFor(jobs.size(), [&](uint32_t i, uint32_t thread)
+	{
+		if(failed.load(std::memory_order_relaxed))
+			return;
+		OutputFile outFile;
+		if(batch.isInMemory())
+			outFile.keepInMemory();
+		DigestResult* digest = digests ? &digests[i] : nullptr;
+		if(!forgeResource(jobs[i].first.c_str(), jobs[i].second.c_str(), options, context.workerBuffers[thread], outFile, digest))
+		{
+			failed = true;
+			return;
+		}
+		bytes += outFile.getSize();
+		std::lock_guard<std::mutex> lock(batchMutex);
+		if(!batch.add(outFile))
+			failed = true;
+	});
+	totalBytes = bytes;
+	return !failed;
+}
+
+// Forge a resource for each line of the list, in the form output_file<TAB>file.icns
+// The files are processed in parallel and synced together at the end
+int forgeBatch(const char* listFileName, uint32_t threadCount, const ForgeOptions& options, const char* manifestPath)
+{
+	JobList jobs;
+	if(!readJobs(listFileName, jobs))
+		return 1;
+	auto start = std::chrono::steady_clock::now();
+	BatchContext context(threadCount);
+	OutputBatch batch;
+	uint64_t totalBytes;
+	std::vector<DigestResult> digests(manifestPath ? jobs.size() : 0);
+	if(!forgeJobs(jobs, options, context, batch, manifestPath ? digests.data() : nullptr, totalBytes))
+		return 1;
+	if(manifestPath)
+	{
+		// Listed in the same order as the inputs
+		DigestManifest manifest;
+		for(uint32_t i=0;i<jobs.size();i++)
+			manifest.add(jobs[i].first, digests[i]);
+		if(!manifest.write(batch, manifestPath))
+			return 1;
+	}
+	if(!batch.commit())
+		return 1;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	double mb = totalBytes / (1024.0 * 1024.0);
+	printf("Forged %zu resources, %.1f MB in %.1f ms: %.0f files/s, %.1f MB/s with %u threads\n", jobs.size(), mb, ms,
+		jobs.size() * 1000.0 / ms, mb * 1000.0 / ms, context.pool.getThreadCount());
 	return 0;
 }
+
+// Forge the resources again when the list or the icns files change, only the affected outputs are written
+int watchResources(const char* listFileName, uint32_t threadCount, const ForgeOptions& options)
+{
+	FileWatcher watcher;
+	BatchContext context(threadCount);
+	// The input each output has been forged from
+	std::map<std::string, std::string> forged;
+	std::set<std::string> changed;
+	// The changed inputs not forged yet, they are kept while the list is broken
+	std::set<std::string> stale;
+	FileWatcher::Clock::time_point changeTime;
+	bool initial = true;
+	JobList jobs;
+	JobList affected;
+	while(true)
+	{
+		auto start = FileWatcher::Clock::now();
+		stale.insert(changed.begin(), changed.end());
+		// A broken list is reported, the next change may fix it
+		bool listOk = readJobs(listFileName, jobs);
+		if(listOk || initial)
+		{
+			watcher.clearFiles();
+			if(!watcher.addFile(listFileName))
+				return 1;
+			affected.clear();
+			std::set<std::string> outputs;
+			// Inputs which cannot be watched, for example in a directory not created yet, are skipped
+			// until the next change
+			bool watched = true;
+			for(const auto& job: jobs)
+			{
+				if(!watcher.addFile(job.second))
+				{
+					watched = false;
+					continue;
+				}
+				outputs.insert(job.first);
+				auto it = forged.find(job.first);
+				if(it == forged.end() || it->second != job.second || stale.count(job.second))
+					affected.push_back(job);
+			}
+			// Lines may have been removed, forge their outputs again if they come back
+			for(auto it = forged.begin(); it != forged.end(); )
+				it = outputs.count(it->first) ? std::next(it) : forged.erase(it);
+			OutputBatch batch;
+			uint64_t totalBytes;
+			bool ok = listOk && forgeJobs(affected, options, context, batch, nullptr, totalBytes) && batch.commit();
+			// Everything is forged again on the next change after a failure
+			stale.clear();
+			if(ok)
+			{
+				for(const auto& job: affected)
+					forged[job.first] = job.second;
+			}
+			else
+				forged.clear();
+			auto end = FileWatcher::Clock::now();
+			printf("Updated %zu of %zu resources in %.1f ms", affected.size(), outputs.size(),
+				std::chrono::duration<double, std::milli>(end - start).count());
+			if(!initial)
+				printf(", %.1f ms after the change", std::chrono::duration<double, std::milli>(end - changeTime).count());
+			printf(ok && watched ? "\n" : ", with errors\n");
+		}
+		fflush(stdout);
+		initial = false;
+		if(!watcher.wait(changed, changeTime))
+			return 1;
+	}
+}
+
+int iconResourceMain(int argc, char* argv[])
+{
+	// The options come before the other arguments
+	// The SHA-256 and XXH3 digests of the outputs can be requested as well as the classic icons
+	const char* manifestPath = nullptr;
+	ForgeOptions options = { false, false };
+	while(argc >= 2)
+	{
+		uint32_t consumed = 1;
+		if(argc >= 3 && strcmp(argv[1], "--digests") == 0)
+		{
+			manifestPath = argv[2];
+			consumed = 2;
+		}
+		else if(strcmp(argv[1], "--classic-icons") == 0)
+			options.classicIcons = true;
+		else if(strcmp(argv[1], "--dither") == 0)
+			options.dither = true;
+		else
+			break;
+		argv[consumed] = argv[0];
+		argv += consumed;
+		argc -= consumed;
+	}
+	bool isWatch = argc >= 3 && strcmp(argv[1], "--watch") == 0;
+	bool isBatch = isWatch || (argc >= 3 && strcmp(argv[1], "--batch") == 0);
+	// Dithering only applies to the classic icons
+	// In watch mode the outputs change all the time, a manifest would be stale right away
+	bool badOptions = (options.dither && !options.classicIcons) || (isWatch && manifestPath) ||
+		(isBatch && argc != 3 && (argc != 5 || strcmp(argv[3], "--jobs") != 0));
+	uint32_t threadCount = 0;
+	if(isBatch && argc == 5 && !parseInt(argv[4], threadCount))
+		badOptions = true;
+	if(isBatch && !badOptions)
+	{
+		if(isWatch)
+			return watchResources(argv[2], threadCount, options);
+		return forgeBatch(argv[2], threadCount, options, manifestPath);
+	}
+	if(argc < 3 || badOptions)
+	{
+		printf("Usage %s [--digests manifest.txt] [--classic-icons [--dither]] output_file file.icns\n", argv[0]);
+		printf("      %s [--digests manifest.txt] [--classic-icons [--dither]] --batch list.txt [--jobs N]\n", argv[0]);
+		printf("      %s [--classic-icons [--dither]] --watch list.txt [--jobs N]\n", argv[0]);
+		return 1;
+	}
+	WorkerBuffers buffers;
+	OutputFile outFile;
+	DigestResult digest;
+	if(!forgeResource(argv[1], argv[2], options, buffers, outFile, manifestPath ? &digest : nullptr))
+		return 1;
+	if(manifestPath == nullptr)
+		return outFile.commit() ? 0 : 1;
+	// Commit the manifest together with the output
+	OutputBatch batch;
+	DigestManifest manifest;
+	manifest.add(argv[1], digest);
+	if(!batch.add(outFile) || !manifest.write(batch, manifestPath))
+		return 1;
+	return batch.commit() ? 0 : 1;
+}
+
+// The multi-call binary includes this file and provides its own main
+#ifndef MACOS_UTILS
+int main(int argc, char* argv[])
+{
+	return iconResourceMain(argc, argv);
+}
+#endif
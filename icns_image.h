@@ -0,0 +1,843 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ICNS_IMAGE_H
+#define ICNS_IMAGE_H
+
+#include <algorithm>
+#include <numeric>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+inline uint16_t readBE16(const uint8_t* p)
+{
+	return (uint16_t(p[0]) << 8) | p[1];
+}
+
+inline uint32_t readBE32(const uint8_t* p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// 8-bit RGBA pixels, row after row
+struct Image
+{
+	uint32_t width;
+	uint32_t height;
+	std::vector<uint8_t> pixels;
+	Image():width(0),height(0)
+	{
+	}
+	void resize(uint32_t w, uint32_t h)
+	{
+		width = w;
+		height = h;
+		pixels.resize(size_t(w) * h * 4);
+	}
+};
+
+// Bigger images are not expected in icns files
+static const uint32_t maxImageSize = 2048;
+
+// A plain DEFLATE decoder (RFC 1951), enough for PNG data
+class Inflate
+{
+private:
+	struct Huffman
+	{
+		uint16_t count[16];
+		uint16_t symbol[288];
+	};
+	const uint8_t* in;
+	size_t inLen;
+	size_t inPos;
+	uint32_t bitBuf;
+	uint32_t bitCount;
+	uint8_t* out;
+	size_t outLen;
+	size_t outPos;
+	bool error;
+	uint32_t bits(uint32_t need)
+	{
+		uint32_t v = bitBuf;
+		while(bitCount < need)
+		{
+			if(inPos == inLen)
+			{
+				error = true;
+				return 0;
+			}
+			v |= uint32_t(in[inPos++]) << bitCount;
+			bitCount += 8;
+		}
+		bitBuf = v >> need;
+		bitCount -= need;
+		return v & ((1u << need) - 1);
+	}
+	// Canonical codes are decoded one bit at a time, most significant first
+	int decode(const Huffman& h)
+	{
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for(uint32_t len=1;len<16;len++)
+		{
+			code |= bits(1);
+			int count = h.count[len];
+			if(code - count < first)
+				return h.symbol[index + (code - first)];
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		error = true;
+		return -1;
+	}
+	// Incomplete codes are accepted, over-subscribed ones are not
+	static bool build(Huffman& h, const uint8_t* lengths, uint32_t n)
+	{
+		memset(h.count, 0, sizeof(h.count));
+		for(uint32_t i=0;i<n;i++)
+			h.count[lengths[i]]++;
+		if(h.count[0] == n)
+			return true;
+		int left = 1;
+		for(uint32_t len=1;len<16;len++)
+		{
+			left = (left << 1) - h.count[len];
+			if(left < 0)
+				return false;
+		}
+		uint16_t offsets[16];
+		offsets[1] = 0;
+		for(uint32_t len=1;len<15;len++)
+			offsets[len + 1] = offsets[len] + h.count[len];
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(lengths[i])
+				h.symbol[offsets[lengths[i]]++] = i;
+		}
+		return true;
+	}
+	bool stored()
+	{
+		// Go to the byte boundary
+		bitBuf = 0;
+		bitCount = 0;
+		if(inLen - inPos < 4)
+			return false;
+		uint32_t len = in[inPos] | (in[inPos + 1] << 8);
+		uint32_t nlen = in[inPos + 2] | (in[inPos + 3] << 8);
+		inPos += 4;
+		if(len != (~nlen & 0xffff) || inLen - inPos < len || outLen - outPos < len)
+			return false;
+		memcpy(out + outPos, in + inPos, len);
+		inPos += len;
+		outPos += len;
+		return true;
+	}
+	bool codes(const Huffman& lengthCodes, const Huffman& distCodes)
+	{
+		static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+		while(!error)
+		{
+			int symbol = decode(lengthCodes);
+			if(symbol < 0)
+				return false;
+			if(symbol < 256)
+			{
+				if(outPos == outLen)
+					return false;
+				out[outPos++] = symbol;
+				continue;
+			}
+			if(symbol == 256)
+				return true;
+			symbol -= 257;
+			if(symbol >= 29)
+				return false;
+			uint32_t len = lengthBase[symbol] + bits(lengthExtra[symbol]);
+			symbol = decode(distCodes);
+			if(symbol < 0 || symbol >= 30)
+				return false;
+			uint32_t dist = distBase[symbol] + bits(distExtra[symbol]);
+			if(error || dist > outPos || outLen - outPos < len)
+				return false;
+			// The source may overlap the destination
+			const uint8_t* src = out + outPos - dist;
+			for(uint32_t i=0;i<len;i++)
+				out[outPos + i] = src[i];
+			outPos += len;
+		}
+		return false;
+	}
+	bool fixed()
+	{
+		static Huffman lengthCodes, distCodes;
+		static bool built = [](){
+			uint8_t lengths[288];
+			memset(lengths, 8, 144);
+			memset(lengths + 144, 9, 112);
+			memset(lengths + 256, 7, 24);
+			memset(lengths + 280, 8, 8);
+			build(lengthCodes, lengths, 288);
+			memset(lengths, 5, 30);
+			build(distCodes, lengths, 30);
+			return true;
+		}();
+		(void)built;
+		return codes(lengthCodes, distCodes);
+	}
+	bool dynamic()
+	{
+		static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		uint32_t lengthCount = bits(5) + 257;
+		uint32_t distCount = bits(5) + 1;
+		uint32_t codeCount = bits(4) + 4;
+		if(error || lengthCount > 286 || distCount > 30)
+			return false;
+		uint8_t lengths[320] = {};
+		for(uint32_t i=0;i<codeCount;i++)
+			lengths[order[i]] = bits(3);
+		Huffman lengthCodes, distCodes;
+		if(error || !build(lengthCodes, lengths, 19))
+			return false;
+		for(uint32_t i=0;i<lengthCount + distCount;)
+		{
+			int symbol = decode(lengthCodes);
+			if(symbol < 0)
+				return false;
+			if(symbol < 16)
+			{
+				lengths[i++] = symbol;
+				continue;
+			}
+			uint8_t len = 0;
+			uint32_t repeat;
+			if(symbol == 16)
+			{
+				if(i == 0)
+					return false;
+				len = lengths[i - 1];
+				repeat = 3 + bits(2);
+			}
+			else if(symbol == 17)
+				repeat = 3 + bits(3);
+			else
+				repeat = 11 + bits(7);
+			if(error || i + repeat > lengthCount + distCount)
+				return false;
+			while(repeat--)
+				lengths[i++] = len;
+		}
+		// The end of block code is required
+		if(lengths[256] == 0)
+			return false;
+		if(!build(lengthCodes, lengths, lengthCount) || !build(distCodes, lengths + lengthCount, distCount))
+			return false;
+		return codes(lengthCodes, distCodes);
+	}
+public:
+	// Decompress a zlib stream, the output must be exactly expectedLen bytes
+	bool zlibDecompress(const uint8_t* data, size_t len, std::vector<uint8_t>& ret, size_t expectedLen)
+	{
+		// Only DEFLATE without a preset dictionary
+		if(len < 2 || (data[0] & 0xf) != 8 || (data[1] & 0x20) || ((data[0] << 8) | data[1]) % 31)
+			return false;
+		in = data + 2;
+		inLen = len - 2;
+		inPos = 0;
+		bitBuf = 0;
+		bitCount = 0;
+		ret.resize(expectedLen);
+		out = ret.data();
+		outLen = expectedLen;
+		outPos = 0;
+		error = false;
+		uint32_t last;
+		do
+		{
+			last = bits(1);
+			uint32_t type = bits(2);
+			bool ok;
+			if(type == 0)
+				ok = stored();
+			else if(type == 1)
+				ok = fixed();
+			else if(type == 2)
+				ok = dynamic();
+			else
+				ok = false;
+			if(!ok || error)
+				return false;
+		}
+		while(!last);
+		return outPos == expectedLen;
+	}
+};
+
+// Decodes PNG images to RGBA, the buffers are kept between images
+class PngDecoder
+{
+private:
+	std::vector<uint8_t> compressed;
+	std::vector<uint8_t> raw;
+	Inflate inflate;
+	static uint32_t pngSample(const uint8_t* row, uint32_t i, uint32_t depth)
+	{
+		if(depth == 8)
+			return row[i];
+		if(depth == 16)
+			return readBE16(row + i * 2);
+		uint32_t bit = i * depth;
+		return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+	}
+	static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+	{
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+		if(pa <= pb && pa <= pc)
+			return a;
+		return pb <= pc ? b : c;
+	}
+public:
+	// Non-interlaced PNG of any standard color type and bit depth, up to maxSize pixels on each side
+	bool decode(const uint8_t* data, uint32_t len, Image& img, uint32_t maxSize = maxImageSize)
+	{
+		static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		if(len < 8 || memcmp(data, signature, 8) != 0)
+			return false;
+		uint32_t width = 0, height = 0, depth = 0, colorType = 0;
+		bool haveHeader = false;
+		uint8_t palette[256][4];
+		memset(palette, 0xff, sizeof(palette));
+		bool haveKey = false;
+		uint16_t key[3] = {};
+		compressed.clear();
+		for(uint32_t pos=8;len - pos >= 12;)
+		{
+			uint32_t chunkLen = readBE32(data + pos);
+			const uint8_t* type = data + pos + 4;
+			const uint8_t* chunk = data + pos + 8;
+			if(chunkLen > len - pos - 12)
+				return false;
+			if(memcmp(type, "IHDR", 4) == 0 && chunkLen >= 13)
+			{
+				width = readBE32(chunk);
+				height = readBE32(chunk + 4);
+				depth = chunk[8];
+				colorType = chunk[9];
+				// Only deflate, adaptive filtering and no interlacing
+				if(chunk[10] != 0 || chunk[11] != 0 || chunk[12] != 0)
+					return false;
+				haveHeader = true;
+			}
+			else if(memcmp(type, "PLTE", 4) == 0)
+			{
+				for(uint32_t i=0;i<chunkLen / 3 && i<256;i++)
+					memcpy(palette[i], chunk + i * 3, 3);
+			}
+			else if(memcmp(type, "tRNS", 4) == 0)
+			{
+				if(colorType == 3)
+				{
+					for(uint32_t i=0;i<chunkLen && i<256;i++)
+						palette[i][3] = chunk[i];
+				}
+				else if(chunkLen >= (colorType == 2 ? 6u : 2u))
+				{
+					haveKey = true;
+					for(uint32_t i=0;i<chunkLen / 2 && i<3;i++)
+						key[i] = readBE16(chunk + i * 2);
+				}
+			}
+			else if(memcmp(type, "IDAT", 4) == 0)
+				compressed.insert(compressed.end(), chunk, chunk + chunkLen);
+			else if(memcmp(type, "IEND", 4) == 0)
+				break;
+			pos += chunkLen + 12;
+		}
+		if(!haveHeader || width == 0 || height == 0 || width > maxSize || height > maxSize)
+			return false;
+		uint32_t channels;
+		switch(colorType)
+		{
+			case 0: channels = 1; break;
+			case 2: channels = 3; break;
+			case 3: channels = 1; break;
+			case 4: channels = 2; break;
+			case 6: channels = 4; break;
+			default: return false;
+		}
+		bool validDepth = depth == 8 || (depth == 16 && colorType != 3) ||
+			((depth == 1 || depth == 2 || depth == 4) && (colorType == 0 || colorType == 3));
+		if(!validDepth)
+			return false;
+		uint32_t pixelBytes = std::max(1u, channels * depth / 8);
+		uint32_t stride = (width * channels * depth + 7) / 8;
+		if(!inflate.zlibDecompress(compressed.data(), compressed.size(), raw, size_t(stride + 1) * height))
+			return false;
+		// Undo the filters in place, each row starts with its filter type
+		const uint8_t* prev = nullptr;
+		for(uint32_t y=0;y<height;y++)
+		{
+			uint8_t* row = raw.data() + size_t(y) * (stride + 1);
+			uint8_t filter = row[0];
+			row++;
+			for(uint32_t i=0;i<stride;i++)
+			{
+				uint8_t a = i >= pixelBytes ? row[i - pixelBytes] : 0;
+				uint8_t b = prev ? prev[i] : 0;
+				uint8_t c = (prev && i >= pixelBytes) ? prev[i - pixelBytes] : 0;
+				switch(filter)
+				{
+					case 0: break;
+					case 1: row[i] += a; break;
+					case 2: row[i] += b; break;
+					case 3: row[i] += (a + b) >> 1; break;
+					case 4: row[i] += paeth(a, b, c); break;
+					default: return false;
+				}
+			}
+			prev = row;
+		}
+		img.resize(width, height);
+		uint32_t maxSample = (1 << depth) - 1;
+		for(uint32_t y=0;y<height;y++)
+		{
+			const uint8_t* row = raw.data() + size_t(y) * (stride + 1) + 1;
+			uint8_t* dst = img.pixels.data() + size_t(y) * width * 4;
+			for(uint32_t x=0;x<width;x++, dst+=4)
+			{
+				uint32_t s[4] = {};
+				for(uint32_t c=0;c<channels;c++)
+					s[c] = pngSample(row, x * channels + c, depth);
+				if(colorType == 3)
+				{
+					memcpy(dst, palette[s[0]], 4);
+					continue;
+				}
+				bool transparent = haveKey && (colorType == 0 ? s[0] == key[0] :
+					colorType == 2 && s[0] == key[0] && s[1] == key[1] && s[2] == key[2]);
+				for(uint32_t c=0;c<channels;c++)
+					s[c] = depth == 16 ? s[c] >> 8 : s[c] * 255 / maxSample;
+				switch(colorType)
+				{
+					case 0: dst[0] = dst[1] = dst[2] = s[0]; dst[3] = 0xff; break;
+					case 2: dst[0] = s[0]; dst[1] = s[1]; dst[2] = s[2]; dst[3] = 0xff; break;
+					case 4: dst[0] = dst[1] = dst[2] = s[0]; dst[3] = s[1]; break;
+					case 6: dst[0] = s[0]; dst[1] = s[1]; dst[2] = s[2]; dst[3] = s[3]; break;
+				}
+				if(transparent)
+					dst[3] = 0;
+			}
+		}
+		return true;
+	}
+};
+
+// Decode the members of an icns file to RGBA images
+class IcnsReader
+{
+private:
+	struct Member
+	{
+		enum Kind { PNG, ARGB, RGB };
+		Kind kind;
+		uint32_t size;
+		const uint8_t* data;
+		uint32_t len;
+		// The 8-bit alpha of RGB members, if any
+		const uint8_t* mask;
+	};
+	std::vector<Member> members;
+	PngDecoder png;
+	// The channels of ARGB and RGB members are compressed separately with a PackBits variant
+	static bool unpackChannel(const uint8_t*& p, const uint8_t* end, uint8_t* dst, uint32_t count)
+	{
+		for(uint32_t i=0;i<count;)
+		{
+			if(p == end)
+				return false;
+			uint8_t c = *p++;
+			if(c < 0x80)
+			{
+				uint32_t n = c + 1;
+				if(uint32_t(end - p) < n || count - i < n)
+					return false;
+				for(uint32_t j=0;j<n;j++)
+					dst[(i++) * 4] = *p++;
+			}
+			else
+			{
+				uint32_t n = c - 125;
+				if(p == end || count - i < n)
+					return false;
+				uint8_t v = *p++;
+				for(uint32_t j=0;j<n;j++)
+					dst[(i++) * 4] = v;
+			}
+		}
+		return true;
+	}
+	bool decodeMember(const Member& m, Image& img)
+	{
+		if(m.kind == Member::PNG)
+			return png.decode(m.data, m.len, img);
+		img.resize(m.size, m.size);
+		uint32_t count = m.size * m.size;
+		const uint8_t* p = m.data;
+		const uint8_t* end = m.data + m.len;
+		if(m.kind == Member::ARGB)
+		{
+			p += 4;
+			for(uint32_t c=0;c<4;c++)
+			{
+				// Alpha comes first
+				if(!unpackChannel(p, end, img.pixels.data() + (c + 3) % 4, count))
+					return false;
+			}
+			return true;
+		}
+		// The biggest one starts with 4 zero bytes
+		if(m.size == 128 && m.len >= 4 && readBE32(p) == 0)
+			p += 4;
+		for(uint32_t c=0;c<3;c++)
+		{
+			if(!unpackChannel(p, end, img.pixels.data() + c, count))
+				return false;
+		}
+		for(uint32_t i=0;i<count;i++)
+			img.pixels[i * 4 + 3] = m.mask ? m.mask[i] : 0xff;
+		return true;
+	}
+public:
+	// Collect the members that can be decoded, other ones (i.e. JPEG 2000) are ignored
+	bool parse(const uint8_t* data, uint32_t len)
+	{
+		members.clear();
+		if(len < 8 || memcmp(data, "icns", 4) != 0)
+			return false;
+		len = std::min(len, readBE32(data + 4));
+		struct RGBType
+		{
+			const char* type;
+			const char* mask;
+			uint32_t size;
+		};
+		static const RGBType rgbTypes[4] = {
+			{ "is32", "s8mk", 16 }, { "il32", "l8mk", 32 }, { "ih32", "h8mk", 48 }, { "it32", "t8mk", 128 }
+		};
+		for(uint32_t pos=8;len - pos >= 8;)
+		{
+			const uint8_t* type = data + pos;
+			uint32_t memberLen = readBE32(data + pos + 4);
+			if(memberLen < 8 || memberLen > len - pos)
+				return false;
+			Member m;
+			m.data = data + pos + 8;
+			m.len = memberLen - 8;
+			m.mask = nullptr;
+			if(m.len >= 24 && memcmp(m.data, "\x89PNG", 4) == 0)
+			{
+				m.kind = Member::PNG;
+				m.size = std::min(readBE32(m.data + 16), readBE32(m.data + 20));
+				members.push_back(m);
+			}
+			else if(m.len >= 4 && memcmp(m.data, "ARGB", 4) == 0 &&
+				(memcmp(type, "ic04", 4) == 0 || memcmp(type, "ic05", 4) == 0))
+			{
+				m.kind = Member::ARGB;
+				m.size = type[3] == '4' ? 16 : 32;
+				members.push_back(m);
+			}
+			for(const RGBType& t: rgbTypes)
+			{
+				if(memcmp(type, t.type, 4) != 0)
+					continue;
+				m.kind = Member::RGB;
+				m.size = t.size;
+				members.push_back(m);
+			}
+			pos += memberLen;
+		}
+		// Attach the masks, they may come in any order
+		for(uint32_t pos=8;len - pos >= 8;pos += readBE32(data + pos + 4))
+		{
+			for(const RGBType& t: rgbTypes)
+			{
+				if(memcmp(data + pos, t.mask, 4) != 0 || readBE32(data + pos + 4) - 8 < t.size * t.size)
+					continue;
+				for(Member& m: members)
+				{
+					if(m.kind == Member::RGB && m.size == t.size)
+						m.mask = data + pos + 8;
+				}
+			}
+		}
+		return !members.empty();
+	}
+	// Decode the best member to scale down to size, which is the smallest one at least as big
+	bool decode(uint32_t size, Image& img)
+	{
+		std::vector<const Member*> order;
+		for(const Member& m: members)
+			order.push_back(&m);
+		std::stable_sort(order.begin(), order.end(), [size](const Member* a, const Member* b)
+		{
+			bool bigA = a->size >= size;
+			bool bigB = b->size >= size;
+			if(bigA != bigB)
+				return bigA;
+			return bigA ? a->size < b->size : a->size > b->size;
+		});
+		// Fallback to the next one if something is broken
+		for(const Member* m: order)
+		{
+			if(decodeMember(*m, img))
+				return true;
+		}
+		return false;
+	}
+};
+
+// Multiply the colors by alpha, so that transparent pixels do not bleed when averaging
+inline void premultiplyAlpha(Image& img)
+{
+	uint8_t* p = img.pixels.data();
+	size_t count = img.pixels.size() / 4;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alphaMask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	const __m128i round = _mm_set1_epi16(128);
+	for(;i + 4 <= count;i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i * 4));
+		__m128i halves[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+		for(__m128i& h: halves)
+		{
+			__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(h, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			// x * a / 255, rounded
+			__m128i t = _mm_add_epi16(_mm_mullo_epi16(h, a), round);
+			t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+			h = _mm_or_si128(_mm_andnot_si128(alphaMask, t), _mm_and_si128(alphaMask, h));
+		}
+		_mm_storeu_si128((__m128i*)(p + i * 4), _mm_packus_epi16(halves[0], halves[1]));
+	}
+#endif
+	for(;i<count;i++)
+	{
+		uint32_t a = p[i * 4 + 3];
+		for(uint32_t c=0;c<3;c++)
+		{
+			uint32_t t = p[i * 4 + c] * a + 128;
+			p[i * 4 + c] = (t + (t >> 8)) >> 8;
+		}
+	}
+}
+
+// Source-over of premultiplied pixels, dst = src + dst * (255 - srcAlpha) / 255
+inline void blendRow(uint8_t* dst, const uint8_t* src, uint32_t count, uint32_t srcStep)
+{
+	uint32_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128i full = _mm_set1_epi16(255);
+	for(;i + 4 <= count;i += 4)
+	{
+		// A step of 0 repeats a single pixel, for solid fills
+		__m128i s;
+		if(srcStep)
+			s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		else
+		{
+			int32_t pixel;
+			memcpy(&pixel, src, 4);
+			s = _mm_set1_epi32(pixel);
+		}
+		__m128i d = _mm_loadu_si128((__m128i*)(dst + i * 4));
+		__m128i halves[2] = { _mm_unpacklo_epi8(d, zero), _mm_unpackhi_epi8(d, zero) };
+		__m128i srcHalves[2] = { _mm_unpacklo_epi8(s, zero), _mm_unpackhi_epi8(s, zero) };
+		for(uint32_t h=0;h<2;h++)
+		{
+			__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(srcHalves[h], _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			__m128i t = _mm_add_epi16(_mm_mullo_epi16(halves[h], _mm_sub_epi16(full, a)), round);
+			t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+			halves[h] = _mm_add_epi16(t, srcHalves[h]);
+		}
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(halves[0], halves[1]));
+	}
+#endif
+	for(;i<count;i++)
+	{
+		const uint8_t* s = src + (srcStep ? i * 4 : 0);
+		uint32_t inv = 255 - s[3];
+		for(uint32_t c=0;c<4;c++)
+		{
+			uint32_t t = dst[i * 4 + c] * inv + 128;
+			dst[i * 4 + c] = std::min(255u, s[c] + ((t + (t >> 8)) >> 8));
+		}
+	}
+}
+
+// Composite a premultiplied image with its top left corner at x, y, clipped to dst
+inline void blendImage(Image& dst, const Image& src, int32_t x, int32_t y)
+{
+	int32_t left = std::max(0, x), top = std::max(0, y);
+	int32_t right = std::min<int64_t>(dst.width, int64_t(x) + src.width);
+	int32_t bottom = std::min<int64_t>(dst.height, int64_t(y) + src.height);
+	for(int32_t row=top;row<bottom;row++)
+	{
+		uint8_t* d = dst.pixels.data() + (size_t(row) * dst.width + left) * 4;
+		const uint8_t* s = src.pixels.data() + (size_t(row - y) * src.width + (left - x)) * 4;
+		if(right > left)
+			blendRow(d, s, right - left, 1);
+	}
+}
+
+// Composite a premultiplied color over a rectangle, clipped to dst
+inline void blendRect(Image& dst, int32_t x, int32_t y, uint32_t width, uint32_t height, const uint8_t color[4])
+{
+	int32_t left = std::max(0, x), top = std::max(0, y);
+	int32_t right = std::min<int64_t>(dst.width, int64_t(x) + width);
+	int32_t bottom = std::min<int64_t>(dst.height, int64_t(y) + height);
+	for(int32_t row=top;row<bottom;row++)
+	{
+		if(right > left)
+			blendRow(dst.pixels.data() + (size_t(row) * dst.width + left) * 4, color, right - left, 0);
+	}
+}
+
+// Area averaging resize to size x size, every output pixel is the exact average of the source area it covers
+// The source is conceptually enlarged to a common multiple of both sizes, with weights for the source pixels
+class BoxScaler
+{
+private:
+	struct Tap
+	{
+		uint32_t index;
+		uint32_t weight;
+	};
+	// For each output position, the source positions it covers
+	std::vector<uint32_t> firstTap[2];
+	std::vector<Tap> taps[2];
+	std::vector<uint32_t> rowSums;
+	static uint32_t planAxis(uint32_t srcLen, uint32_t dstLen, std::vector<uint32_t>& first, std::vector<Tap>& taps)
+	{
+		uint32_t g = std::gcd(srcLen, dstLen);
+		uint32_t scale = dstLen / g;
+		uint32_t box = srcLen / g;
+		first.clear();
+		taps.clear();
+		for(uint32_t x=0;x<dstLen;x++)
+		{
+			first.push_back(taps.size());
+			for(uint32_t u=x * box;u<(x + 1) * box;u++)
+			{
+				uint32_t s = u / scale;
+				if(!taps.empty() && first.back() < taps.size() && taps.back().index == s)
+					taps.back().weight++;
+				else
+					taps.push_back(Tap{ s, 1 });
+			}
+		}
+		first.push_back(taps.size());
+		return box;
+	}
+	// rowSums += weight * row
+	static void accumulateRow(uint32_t* sums, const uint8_t* row, uint32_t len, uint32_t weight)
+	{
+		uint32_t i = 0;
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i w = _mm_set1_epi16(weight);
+		for(;i + 16 <= len;i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+			// The products fit in 16 bits as the weights are below 256
+			__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w);
+			__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w);
+			__m128i* s = (__m128i*)(sums + i);
+			_mm_storeu_si128(s + 0, _mm_add_epi32(_mm_loadu_si128(s + 0), _mm_unpacklo_epi16(lo, zero)));
+			_mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(lo, zero)));
+			_mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(hi, zero)));
+			_mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(hi, zero)));
+		}
+#endif
+		for(;i<len;i++)
+			sums[i] += row[i] * weight;
+	}
+public:
+	void scale(const Image& src, uint32_t size, Image& dst)
+	{
+		uint32_t boxX = planAxis(src.width, size, firstTap[0], taps[0]);
+		uint32_t boxY = planAxis(src.height, size, firstTap[1], taps[1]);
+		uint32_t total = boxX * boxY;
+		dst.resize(size, size);
+		rowSums.resize(size_t(src.width) * 4);
+		for(uint32_t y=0;y<size;y++)
+		{
+			// Vertical pass over the full rows, then the horizontal one on the sums
+			std::fill(rowSums.begin(), rowSums.end(), 0);
+			for(uint32_t t=firstTap[1][y];t<firstTap[1][y + 1];t++)
+			{
+				const Tap& tap = taps[1][t];
+				accumulateRow(rowSums.data(), src.pixels.data() + size_t(tap.index) * src.width * 4, src.width * 4, tap.weight);
+			}
+			uint8_t* out = dst.pixels.data() + size_t(y) * size * 4;
+			for(uint32_t x=0;x<size;x++)
+			{
+				uint32_t sum[4] = {};
+				for(uint32_t t=firstTap[0][x];t<firstTap[0][x + 1];t++)
+				{
+					const Tap& tap = taps[0][t];
+					const uint32_t* s = rowSums.data() + tap.index * 4;
+					for(uint32_t c=0;c<4;c++)
+						sum[c] += s[c] * tap.weight;
+				}
+				for(uint32_t c=0;c<4;c++)
+					out[x * 4 + c] = (sum[c] + total / 2) / total;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,698 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ds_store_reader.h"
+#include "ds_store_records.h"
+#include "finder_layout.h"
+
+typedef std::vector<std::pair<std::string, std::string>> Fields;
+
+std::string fourCCStr(uint32_t v)
+{
+	std::string ret;
+	for(int i=24;i>=0;i-=8)
+	{
+		char c = v >> i;
+		ret += (c >= 0x20 && c < 0x7f) ? c : '?';
+	}
+	return ret;
+}
+
+std::string hexStr(const uint8_t* p, uint32_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string ret;
+	for(uint32_t i=0;i<len;i++)
+	{
+		ret += digits[p[i] >> 4];
+		ret += digits[p[i] & 0xf];
+	}
+	return ret;
+}
+
+// Minimal binary property list decoder, the objects are flattened to (path, value) pairs
+class BPlistReader
+{
+private:
+	const uint8_t* data;
+	uint32_t size;
+	uint32_t offsetIntSize;
+	uint32_t objectRefSize;
+	uint64_t numObjects;
+	uint64_t offsetTableOffset;
+	// Objects may be shared, so the decoded nodes are capped rather than the objects
+	uint32_t nodesLeft;
+	static const uint32_t maxNodes = 65536;
+	uint64_t readBE(const uint8_t* p, uint32_t n)
+	{
+		uint64_t ret = 0;
+		for(uint32_t i=0;i<n;i++)
+			ret = (ret << 8) | p[i];
+		return ret;
+	}
+	bool getObjectOffset(uint64_t ref, uint64_t& offset)
+	{
+		if(ref >= numObjects)
+			return false;
+		offset = readBE(data + offsetTableOffset + ref * offsetIntSize, offsetIntSize);
+		return offset < offsetTableOffset;
+	}
+	// Decode the count of containers and strings, returns the offset of the contents
+	bool getCount(uint64_t offset, uint64_t& count, uint64_t& contents)
+	{
+		count = data[offset] & 0xf;
+		contents = offset + 1;
+		if(count != 0xf)
+			return true;
+		if(contents >= offsetTableOffset || (data[contents] & 0xf0) != 0x10)
+			return false;
+		uint32_t n = 1 << (data[contents] & 0xf);
+		if(n > 8 || contents + 1 + n > offsetTableOffset)
+			return false;
+		count = readBE(data + contents + 1, n);
+		contents += 1 + n;
+		return true;
+	}
+	bool decodeString(uint64_t ref, std::string& out)
+	{
+		uint64_t offset, count, contents;
+		if(!getObjectOffset(ref, offset) || !getCount(offset, count, contents))
+			return false;
+		uint8_t marker = data[offset] >> 4;
+		if(marker == 0x5)
+		{
+			if(count > offsetTableOffset - contents)
+				return false;
+			out.assign((const char*)data + contents, count);
+			return true;
+		}
+		if(marker == 0x6)
+		{
+			if(count > (offsetTableOffset - contents) / 2)
+				return false;
+			DSRecord r;
+			r.name = data + contents;
+			r.nameLen = count;
+			out = recordName(r);
+			return true;
+		}
+		return false;
+	}
+	bool decode(uint64_t ref, const std::string& path, Fields& fields, uint32_t depth)
+	{
+		uint64_t offset;
+		if(depth > 32 || nodesLeft == 0 || !getObjectOffset(ref, offset))
+			return false;
+		nodesLeft--;
+		uint8_t marker = data[offset];
+		uint8_t low = marker & 0xf;
+		char buf[64];
+		switch(marker >> 4)
+		{
+			case 0x0:
+				if(marker == 0x08 || marker == 0x09)
+					fields.emplace_back(path, marker == 0x09 ? "true" : "false");
+				else
+					fields.emplace_back(path, "null");
+				return true;
+			case 0x1:
+			{
+				uint32_t n = 1 << low;
+				if(n > 8 || offset + 1 + n > offsetTableOffset)
+					return false;
+				snprintf(buf, sizeof(buf), "%lld", (long long)readBE(data + offset + 1, n));
+				fields.emplace_back(path, buf);
+				return true;
+			}
+			case 0x2:
+			case 0x3:
+			{
+				uint32_t n = (marker >> 4) == 0x3 ? 8 : (1 << low);
+				if((n != 4 && n != 8) || offset + 1 + n > offsetTableOffset)
+					return false;
+				uint64_t bits = readBE(data + offset + 1, n);
+				double v;
+				if(n == 4)
+				{
+					float f;
+					uint32_t b32 = bits;
+					memcpy(&f, &b32, 4);
+					v = f;
+				}
+				else
+					memcpy(&v, &bits, 8);
+				snprintf(buf, sizeof(buf), (marker >> 4) == 0x3 ? "date %.17g" : "%.17g", v);
+				fields.emplace_back(path, buf);
+				return true;
+			}
+			case 0x4:
+			{
+				uint64_t count, contents;
+				if(!getCount(offset, count, contents) || count > offsetTableOffset - contents)
+					return false;
+				fields.emplace_back(path, "data " + hexStr(data + contents, count));
+				return true;
+			}
+			case 0x5:
+			case 0x6:
+			{
+				std::string s;
+				if(!decodeString(ref, s))
+					return false;
+				fields.emplace_back(path, "\"" + s + "\"");
+				return true;
+			}
+			case 0x8:
+			{
+				uint32_t n = low + 1;
+				if(n > 8 || offset + 1 + n > offsetTableOffset)
+					return false;
+				snprintf(buf, sizeof(buf), "uid %llu", (unsigned long long)readBE(data + offset + 1, n));
+				fields.emplace_back(path, buf);
+				return true;
+			}
+			case 0xa:
+			{
+				uint64_t count, contents;
+				if(!getCount(offset, count, contents) || count > (offsetTableOffset - contents) / objectRefSize)
+					return false;
+				if(count == 0)
+					fields.emplace_back(path, "[]");
+				for(uint64_t i=0;i<count;i++)
+				{
+					snprintf(buf, sizeof(buf), "[%llu]", (unsigned long long)i);
+					uint64_t child = readBE(data + contents + i * objectRefSize, objectRefSize);
+					if(!decode(child, path + buf, fields, depth + 1))
+						return false;
+				}
+				return true;
+			}
+			case 0xd:
+			{
+				uint64_t count, contents;
+				if(!getCount(offset, count, contents) || count > (offsetTableOffset - contents) / (objectRefSize * 2))
+					return false;
+				if(count == 0)
+					fields.emplace_back(path, "{}");
+				for(uint64_t i=0;i<count;i++)
+				{
+					std::string key;
+					uint64_t keyRef = readBE(data + contents + i * objectRefSize, objectRefSize);
+					uint64_t valueRef = readBE(data + contents + (count + i) * objectRefSize, objectRefSize);
+					if(!decodeString(keyRef, key))
+						return false;
+					if(!decode(valueRef, path.empty() ? key : path + "." + key, fields, depth + 1))
+						return false;
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+public:
+	BPlistReader(const uint8_t* d, uint32_t s):data(d),size(s),offsetIntSize(0),objectRefSize(0),
+		numObjects(0),offsetTableOffset(0),nodesLeft(0)
+	{
+	}
+	static bool isBPlist(const uint8_t* d, uint32_t s)
+	{
+		return s >= 40 && memcmp(d, "bplist00", 8) == 0;
+	}
+	bool decode(Fields& fields)
+	{
+		// The trailer is stored in the last 32 bytes
+		const uint8_t* trailer = data + size - 32;
+		offsetIntSize = trailer[6];
+		objectRefSize = trailer[7];
+		numObjects = readBE(trailer + 8, 8);
+		uint64_t topObject = readBE(trailer + 16, 8);
+		offsetTableOffset = readBE(trailer + 24, 8);
+		if(offsetIntSize == 0 || offsetIntSize > 8 || objectRefSize == 0 || objectRefSize > 8)
+			return false;
+		if(offsetTableOffset < 8 || offsetTableOffset > size - 32 ||
+			numObjects > (size - 32 - offsetTableOffset) / offsetIntSize)
+			return false;
+		nodesLeft = maxNodes;
+		return decode(topObject, "", fields, 0);
+	}
+};
+
+// Decode the record payload into named fields for the known record types
+Fields decodeFields(const DSRecord& r)
+{
+	Fields fields;
+	char buf[64];
+	const uint8_t* p = r.payload;
+	switch(r.dataType)
+	{
+		case 0x626f6f6c: // bool
+			fields.emplace_back("value", p[0] ? "true" : "false");
+			return fields;
+		case 0x6c6f6e67: // long
+		case 0x73686f72: // shor
+			snprintf(buf, sizeof(buf), "%d", (int32_t)readInt32(p));
+			fields.emplace_back("value", buf);
+			return fields;
+		case 0x74797065: // type
+			fields.emplace_back("value", fourCCStr(readInt32(p)));
+			return fields;
+		case 0x636f6d70: // comp
+		case 0x64757463: // dutc
+			snprintf(buf, sizeof(buf), "%llu", ((unsigned long long)readInt32(p) << 32) | readInt32(p + 4));
+			fields.emplace_back("value", buf);
+			return fields;
+		case 0x75737472: // ustr
+		{
+			DSRecord s;
+			s.name = p;
+			s.nameLen = r.payloadLen / 2;
+			fields.emplace_back("value", "\"" + recordName(s) + "\"");
+			return fields;
+		}
+	}
+	// Blobs
+	IconLocation iloc;
+	if(r.type == fourCC("Iloc") && IconLocationSchema::decode(p, r.payloadLen, iloc))
+	{
+		snprintf(buf, sizeof(buf), "%d", (int32_t)iloc.x);
+		fields.emplace_back("x", buf);
+		snprintf(buf, sizeof(buf), "%d", (int32_t)iloc.y);
+		fields.emplace_back("y", buf);
+		return fields;
+	}
+	FinderWindow fw;
+	if(r.type == fourCC("fwi0") && FinderWindowSchema::decode(p, r.payloadLen, fw))
+	{
+		const uint16_t bounds[] = { fw.top, fw.left, fw.bottom, fw.right };
+		static const char* names[] = { "top", "left", "bottom", "right" };
+		for(int i=0;i<4;i++)
+		{
+			snprintf(buf, sizeof(buf), "%d", bounds[i]);
+			fields.emplace_back(names[i], buf);
+		}
+		fields.emplace_back("view", fourCCStr(fw.viewType));
+		return fields;
+	}
+	IconViewOptions iv;
+	if(r.type == fourCC("icvo") && IconViewOptionsSchema::decode(p, r.payloadLen, iv))
+	{
+		snprintf(buf, sizeof(buf), "%d", iv.iconSize);
+		fields.emplace_back("iconSize", buf);
+		fields.emplace_back("arrangedBy", fourCCStr(iv.arrangedBy));
+		fields.emplace_back("labelPosition", fourCCStr(iv.labelPosition));
+		return fields;
+	}
+	BackgroundPicture bg;
+	if(r.type == fourCC("BKGD") && BackgroundPictureSchema::decode(p, r.payloadLen, bg))
+	{
+		snprintf(buf, sizeof(buf), "%u", bg.aliasLen);
+		fields.emplace_back("aliasLen", buf);
+		return fields;
+	}
+	AliasHeader alias;
+	if(r.type == fourCC("pict") && AliasHeaderSchema::decode(p, r.payloadLen, alias) && alias.recordSize == r.payloadLen)
+	{
+		fields.emplace_back("volume", "\"" + std::string(alias.volumeName) + "\"");
+		fields.emplace_back("file", "\"" + std::string(alias.fileName) + "\"");
+		// Only the absolute path is shown from the extra data
+		forEachAliasExtra(p, r.payloadLen, [&fields](const AliasExtra& extra, const uint8_t* data)
+		{
+			if(extra.tag == ALIAS_ABSOLUTE_PATH)
+			{
+				const char* path = (const char*)data;
+				fields.emplace_back("path", "\"" + std::string(path, strnlen(path, extra.length)) + "\"");
+			}
+		});
+		return fields;
+	}
+	if(BPlistReader::isBPlist(p, r.payloadLen))
+	{
+		BPlistReader bplist(p, r.payloadLen);
+		if(bplist.decode(fields))
+		{
+			// Keep the fields sorted to compare them linearly
+			std::stable_sort(fields.begin(), fields.end(),
+				[](const Fields::value_type& a, const Fields::value_type& b) { return a.first < b.first; });
+			return fields;
+		}
+		fields.clear();
+	}
+	fields.emplace_back("blob", hexStr(p, r.payloadLen));
+	return fields;
+}
+
+std::string describeRecord(const DSRecord& r)
+{
+	std::string ret = "\"" + recordName(r) + "\" " + fourCCStr(r.type) + " " + fourCCStr(r.dataType);
+	return ret;
+}
+
+void printFields(const Fields& fields)
+{
+	for(const auto& f: fields)
+		printf("    %s = %s\n", f.first.c_str(), f.second.c_str());
+}
+
+void diffFields(const Fields& a, const Fields& b)
+{
+	// Known layouts produce fields in a fixed order and bplists are sorted, so a merge is enough
+	uint32_t i = 0, j = 0;
+	while(i < a.size() || j < b.size())
+	{
+		int cmp = i == a.size() ? 1 : j == b.size() ? -1 : a[i].first.compare(b[j].first);
+		if(cmp < 0)
+		{
+			printf("    - %s = %s\n", a[i].first.c_str(), a[i].second.c_str());
+			i++;
+		}
+		else if(cmp > 0)
+		{
+			printf("    + %s = %s\n", b[j].first.c_str(), b[j].second.c_str());
+			j++;
+		}
+		else
+		{
+			if(a[i].second != b[j].second)
+				printf("    %s: %s -> %s\n", a[i].first.c_str(), a[i].second.c_str(), b[j].second.c_str());
+			i++;
+			j++;
+		}
+	}
+}
+
+// Merge the two record streams, returns the number of differences or -1 on errors
+int diffStores(const DSStore& a, const DSStore& b)
+{
+	DSRecordCursor ca(a);
+	DSRecordCursor cb(b);
+	DSRecord ra, rb;
+	bool hasA = ca.next(ra);
+	bool hasB = cb.next(rb);
+	int differences = 0;
+	while(hasA || hasB)
+	{
+		int cmp = !hasA ? 1 : !hasB ? -1 : compareRecords(ra, rb);
+		if(cmp < 0)
+		{
+			printf("- %s\n", describeRecord(ra).c_str());
+			printFields(decodeFields(ra));
+			differences++;
+			hasA = ca.next(ra);
+		}
+		else if(cmp > 0)
+		{
+			printf("+ %s\n", describeRecord(rb).c_str());
+			printFields(decodeFields(rb));
+			differences++;
+			hasB = cb.next(rb);
+		}
+		else
+		{
+			if(ra.dataType != rb.dataType || ra.payloadLen != rb.payloadLen ||
+				memcmp(ra.payload, rb.payload, ra.payloadLen) != 0)
+			{
+				printf("~ %s\n", describeRecord(ra).c_str());
+				if(ra.dataType != rb.dataType)
+					printf("    type: %s -> %s\n", fourCCStr(ra.dataType).c_str(), fourCCStr(rb.dataType).c_str());
+				diffFields(decodeFields(ra), decodeFields(rb));
+				differences++;
+			}
+			hasA = ca.next(ra);
+			hasB = cb.next(rb);
+		}
+	}
+	if(ca.failed() || cb.failed())
+	{
+		printf("Malformed B-tree in %s\n", ca.failed() ? "first file" : "second file");
+		return -1;
+	}
+	return differences;
+}
+
+// Print the records of the given file, all of them if type is not specified
+// Returns the number of records found
+int findRecords(const DSStore& store, const char* fileName, const char* type)
+{
+	DSNodeCache cache(store);
+	std::vector<uint8_t> name = encodeName(fileName);
+	DSRecord key;
+	key.name = name.data();
+	key.nameLen = name.size() / 2;
+	key.type = type ? fourCC(type) : 0;
+	int found = 0;
+	DSRecord r;
+	// Every type is a separate lookup from the root
+	while(cache.lowerBound(key, r))
+	{
+		if(compareNames(r, key) != 0)
+			break;
+		if(type && r.type != key.type)
+			break;
+		printf("%s\n", describeRecord(r).c_str());
+		printFields(decodeFields(r));
+		found++;
+		if(type || r.type == 0xffffffff)
+			break;
+		key.type = r.type + 1;
+	}
+	fprintf(stderr, "Decoded %u of %u nodes\n", cache.getDecodedCount(), store.getNodeCount());
+	return found;
+}
+
+// Print every record, returns false if the B-tree is malformed
+bool dumpStore(const DSStore& store)
+{
+	DSRecordCursor cursor(store);
+	DSRecord r;
+	while(cursor.next(r))
+	{
+		printf("%s\n", describeRecord(r).c_str());
+		printFields(decodeFields(r));
+	}
+	if(cursor.failed())
+	{
+		printf("Malformed B-tree\n");
+		return false;
+	}
+	return true;
+}
+
+// Validate the B-tree structure and the record order, returns true if the store is sane
+// Equal records are allowed, the builder keeps the duplicate file names it is given
+bool checkStore(const DSStore& store)
+{
+	DSRecordCursor cursor(store);
+	DSRecord prev, r;
+	uint32_t count = 0;
+	uint32_t duplicates = 0;
+	bool ok = true;
+	while(cursor.next(r))
+	{
+		int order = count ? compareRecords(prev, r) : -1;
+		if(order > 0)
+		{
+			printf("Record %u is out of order: %s after %s\n", count, describeRecord(r).c_str(), describeRecord(prev).c_str());
+			ok = false;
+		}
+		else if(order == 0)
+			duplicates++;
+		prev = r;
+		count++;
+	}
+	if(cursor.failed())
+	{
+		printf("Malformed B-tree after %u records\n", count);
+		return false;
+	}
+	if(count != store.getRecordCount())
+	{
+		printf("Found %u records, the master block declares %u\n", count, store.getRecordCount());
+		ok = false;
+	}
+	if(count && cursor.getMaxDepth() != store.getTreeLevels() + 1)
+	{
+		printf("Tree depth is %u, the master block declares %u levels\n", cursor.getMaxDepth(), store.getTreeLevels());
+		ok = false;
+	}
+	if(duplicates)
+		printf("Note: %u records have the same name and type as the previous one\n", duplicates);
+	if(ok)
+		printf("%u records, %u levels, %u nodes\n", count, store.getTreeLevels(), store.getNodeCount());
+	return ok;
+}
+
+// Print the shape of the tree and the cost of looking up its records, to compare page sizes
+bool printStats(const DSStore& store)
+{
+	// Visit every node once, the children are copied since nodes are only valid until the next lookup
+	DSNodeCache cache(store, 1);
+	std::vector<uint32_t> pending = { store.getRootNode() };
+	std::set<uint32_t> visited;
+	uint64_t blockBytes = 0;
+	uint64_t usedBytes = 0;
+	uint32_t maxNodeSize = 0;
+	while(!pending.empty())
+	{
+		uint32_t blockId = pending.back();
+		pending.pop_back();
+		const DSNode* node = visited.insert(blockId).second ? cache.getNode(blockId) : nullptr;
+		if(node == nullptr)
+		{
+			printf("Malformed B-tree at block %u\n", blockId);
+			return false;
+		}
+		uint32_t used = 8;
+		if(!node->recordOffsets.empty())
+		{
+			DSRecord r;
+			uint32_t last = node->recordOffsets.back();
+			used = last + parseRecord(node->data + last, node->data + node->size, r);
+		}
+		blockBytes += node->size;
+		usedBytes += used;
+		maxNodeSize = std::max(maxNodeSize, used);
+		if(node->rightChild)
+		{
+			pending.insert(pending.end(), node->children.begin(), node->children.end());
+			pending.push_back(node->rightChild);
+		}
+	}
+	printf("Page size %u, %u records, %u levels, %zu nodes\n", store.getPageSize(), store.getRecordCount(),
+		store.getTreeLevels(), visited.size());
+	printf("File %.2f MB, nodes %.2f MB, %.1f%% full, biggest node %u bytes\n", store.getFileSize() / 1048576.0,
+		blockBytes / 1048576.0, blockBytes ? usedBytes * 100.0 / blockBytes : 0.0, maxNodeSize);
+	// Look up a sample of the records from the root, without caching any node
+	std::vector<std::pair<std::vector<uint8_t>, uint32_t>> keys;
+	DSRecordCursor cursor(store);
+	DSRecord r;
+	uint32_t step = std::max(store.getRecordCount() / 10000, 1u);
+	for(uint32_t i=0;cursor.next(r);i++)
+	{
+		if(i % step == 0)
+			keys.emplace_back(std::vector<uint8_t>(r.name, r.name + r.nameLen * 2), r.type);
+	}
+	if(keys.empty())
+		return true;
+	uint32_t decoded = cache.getDecodedCount();
+	auto start = std::chrono::steady_clock::now();
+	for(const auto& key: keys)
+	{
+		if(!cache.find(key.first, key.second, r))
+		{
+			printf("Lookup failed for sample %zu\n", &key - keys.data());
+			return false;
+		}
+	}
+	double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	printf("Lookup %.2f nodes, %.2f us (uncached, %zu samples)\n", double(cache.getDecodedCount() - decoded) / keys.size(),
+		us / keys.size(), keys.size());
+	return true;
+}
+
+// Report the icons and labels which overlap or leave the window, returns true if there are none
+bool checkLayout(const DSStore& store, const char* fileName)
+{
+	FinderLayout layout;
+	if(!loadLayout(store, fileName, layout))
+		return false;
+	LayoutChecker checker;
+	std::vector<LayoutIssue> issues;
+	auto start = std::chrono::steady_clock::now();
+	checker.check(layout, issues);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printLayoutIssues(fileName, layout, issues);
+	printf("%zu items in a %ux%u window, %zu issues, checked in %.2f ms\n", layout.items.size(), layout.width, layout.height,
+		issues.size(), ms);
+	return issues.empty();
+}
+
+void printUsage(const char* argv0)
+{
+	printf("Usage: %s diff old.DS_Store new.DS_Store\n", argv0);
+	printf("       %s find file.DS_Store file_name [type]\n", argv0);
+	printf("       %s dump file.DS_Store\n", argv0);
+	printf("       %s check file.DS_Store\n", argv0);
+	printf("       %s stats file.DS_Store\n", argv0);
+	printf("       %s layout file.DS_Store\n", argv0);
+	printf("Use - to read a .DS_Store file redirected to stdin\n");
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2)
+	{
+		printUsage(argv[0]);
+		return 2;
+	}
+	if(strcmp(argv[1], "diff") == 0 && argc == 4)
+	{
+		DSStore a, b;
+		if(!a.open(argv[2]) || !b.open(argv[3]))
+			return 2;
+		int differences = diffStores(a, b);
+		if(differences < 0)
+			return 2;
+		// Same convention as diff(1)
+		return differences ? 1 : 0;
+	}
+	if((strcmp(argv[1], "dump") == 0 || strcmp(argv[1], "check") == 0 || strcmp(argv[1], "stats") == 0 ||
+		strcmp(argv[1], "layout") == 0) && argc == 3)
+	{
+		DSStore store;
+		if(!store.open(argv[2]))
+			return 2;
+		if(argv[1][0] == 'd')
+			return dumpStore(store) ? 0 : 1;
+		if(argv[1][0] == 's')
+			return printStats(store) ? 0 : 1;
+		if(argv[1][0] == 'l')
+			return checkLayout(store, argv[2]) ? 0 : 1;
+		return checkStore(store) ? 0 : 1;
+	}
+	if(strcmp(argv[1], "find") == 0 && (argc == 4 || argc == 5))
+	{
+		DSStore store;
+		if(!store.open(argv[2]))
+			return 2;
+		const char* type = argc == 5 ? argv[4] : nullptr;
+		if(type && strlen(type) != 4)
+		{
+			printf("Expected a 4 character type: %s\n", type);
+			return 2;
+		}
+		return findRecords(store, argv[3], type) ? 0 : 1;
+	}
+	printUsage(argv[0]);
+	return 2;
+}
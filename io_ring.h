@@ -0,0 +1,235 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// Minimal io_uring wrapper using the raw system calls, with a single registered buffer
+// used as a staging arena and a table of direct file descriptors
+class IoRing
+{
+private:
+	int ringFd;
+	uint8_t* sqRing;
+	size_t sqRingSize;
+	uint8_t* cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+	uint32_t* sqHead;
+	uint32_t* sqTail;
+	uint32_t sqMask;
+	uint32_t* sqArray;
+	uint32_t sqEntries;
+	uint32_t* cqHead;
+	uint32_t* cqTail;
+	uint32_t cqMask;
+	struct io_uring_cqe* cqes;
+	uint32_t queued;
+	uint8_t* arena;
+	size_t arenaSize;
+	uint32_t fileSlots;
+	void release()
+	{
+		if(arena)
+			munmap(arena, arenaSize);
+		if(sqes)
+			munmap(sqes, sqesSize);
+		if(cqRing && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if(sqRing)
+			munmap(sqRing, sqRingSize);
+		if(ringFd >= 0)
+			close(ringFd);
+		ringFd = -1;
+		arena = nullptr;
+		sqes = nullptr;
+		cqRing = nullptr;
+		sqRing = nullptr;
+	}
+public:
+	IoRing():ringFd(-1),sqRing(nullptr),sqRingSize(0),cqRing(nullptr),cqRingSize(0),sqes(nullptr),sqesSize(0),
+		sqHead(nullptr),sqTail(nullptr),sqMask(0),sqArray(nullptr),sqEntries(0),cqHead(nullptr),cqTail(nullptr),
+		cqMask(0),cqes(nullptr),queued(0),arena(nullptr),arenaSize(0),fileSlots(0)
+	{
+	}
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+	~IoRing()
+	{
+		release();
+	}
+	// Returns false if io_uring is not available, or lacks the features we need
+	bool init(uint32_t entries, size_t stagingSize, uint32_t slots)
+	{
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		ringFd = syscall(__NR_io_uring_setup, entries, &p);
+		if(ringFd < 0)
+			return false;
+		if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_SUBMIT_STABLE))
+		{
+			release();
+			return false;
+		}
+		sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+		cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if(cqRingSize > sqRingSize)
+			sqRingSize = cqRingSize;
+		void* m = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		if(m == MAP_FAILED)
+		{
+			release();
+			return false;
+		}
+		sqRing = cqRing = (uint8_t*)m;
+		cqRingSize = sqRingSize;
+		sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+		m = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if(m == MAP_FAILED)
+		{
+			release();
+			return false;
+		}
+		sqes = (struct io_uring_sqe*)m;
+		sqHead = (uint32_t*)(sqRing + p.sq_off.head);
+		sqTail = (uint32_t*)(sqRing + p.sq_off.tail);
+		sqMask = *(uint32_t*)(sqRing + p.sq_off.ring_mask);
+		sqArray = (uint32_t*)(sqRing + p.sq_off.array);
+		sqEntries = p.sq_entries;
+		cqHead = (uint32_t*)(cqRing + p.cq_off.head);
+		cqTail = (uint32_t*)(cqRing + p.cq_off.tail);
+		cqMask = *(uint32_t*)(cqRing + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)(cqRing + p.cq_off.cqes);
+		// The staging arena is registered once, writes use it with WRITE_FIXED
+		arenaSize = stagingSize;
+		m = mmap(nullptr, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(m == MAP_FAILED)
+		{
+			arena = nullptr;
+			release();
+			return false;
+		}
+		arena = (uint8_t*)m;
+		struct iovec iov = { arena, arenaSize };
+		if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+		{
+			release();
+			return false;
+		}
+		// Sparse table of direct descriptors, opened files never get a regular fd
+		struct io_uring_rsrc_register files;
+		memset(&files, 0, sizeof(files));
+		files.nr = slots;
+		files.flags = IORING_RSRC_REGISTER_SPARSE;
+		if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES2, &files, sizeof(files)) != 0)
+		{
+			release();
+			return false;
+		}
+		fileSlots = slots;
+		return true;
+	}
+	uint8_t* getArena() const
+	{
+		return arena;
+	}
+	size_t getArenaSize() const
+	{
+		return arenaSize;
+	}
+	uint32_t getFileSlots() const
+	{
+		return fileSlots;
+	}
+	uint32_t getFreeSqes() const
+	{
+		return sqEntries - queued;
+	}
+	// Returns a cleared entry, the caller must check getFreeSqes first
+	struct io_uring_sqe* getSqe()
+	{
+		uint32_t tail = *sqTail + queued;
+		uint32_t index = tail & sqMask;
+		struct io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqArray[index] = index;
+		queued++;
+		return sqe;
+	}
+	// Submit all the queued entries and wait for waitCount completions
+	bool submitAndWait(uint32_t waitCount)
+	{
+		__atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+		uint32_t toSubmit = queued;
+		queued = 0;
+		while(toSubmit || waitCount)
+		{
+			int r = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitCount, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if(r < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				return false;
+			}
+			toSubmit -= r;
+			// Completions are consumed by the caller, only wait once
+			waitCount = 0;
+		}
+		return true;
+	}
+	// Pop a completion, returns false if none is available
+	bool getCompletion(struct io_uring_cqe& cqe)
+	{
+		uint32_t head = *cqHead;
+		if(head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+			return false;
+		cqe = cqes[head & cqMask];
+		__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+	// Wait for a single completion
+	bool waitCompletion(struct io_uring_cqe& cqe)
+	{
+		while(!getCompletion(cqe))
+		{
+			int r = syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if(r < 0 && errno != EINTR)
+				return false;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LOCAL_SOCKET_H
+#define LOCAL_SOCKET_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The protocol of the local service. Both ends run on the same machine, the integers are in host order.
+// A request is a RequestHeader followed by a command line, with its fields separated by tabs as in scripts.
+// A response is a ResponseHeader followed by the path of the output, then by the output itself in
+// stream mode. In descriptor mode the output is a sealed memfd attached to the header.
+enum ResponseMode : uint32_t
+{
+	RESPONSE_STREAM,
+	RESPONSE_FD
+};
+
+// Interactive requests are run ahead of bulk ones
+enum RequestLane : uint32_t
+{
+	LANE_INTERACTIVE,
+	LANE_BULK
+};
+
+enum ResponseStatus : int32_t
+{
+	STATUS_OK,
+	STATUS_FAILED,
+	// The output would not fit in the memory budget of the server
+	STATUS_REJECTED
+};
+
+struct RequestHeader
+{
+	uint32_t mode;
+	uint32_t lane;
+	uint32_t length;
+};
+
+struct ResponseHeader
+{
+	// There is no output unless the status is STATUS_OK
+	int32_t status;
+	uint32_t pathLength;
+	uint64_t size;
+};
+
+// A Unix stream socket, errors are reported on stdout except for closed connections
+class LocalSocket
+{
+private:
+	int fd;
+	bool fail(const char* what, const char* path)
+	{
+		printf("Cannot %s %s: %s\n", what, path, strerror(errno));
+		close();
+		return false;
+	}
+	bool setPath(struct sockaddr_un& addr, const char* path)
+	{
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(path) >= sizeof(addr.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		strcpy(addr.sun_path, path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		return fd >= 0;
+	}
+public:
+	LocalSocket():fd(-1)
+	{
+	}
+	explicit LocalSocket(int f):fd(f)
+	{
+	}
+	LocalSocket(const LocalSocket&) = delete;
+	LocalSocket& operator=(const LocalSocket&) = delete;
+	~LocalSocket()
+	{
+		close();
+	}
+	void close()
+	{
+		if(fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+	int getFd() const
+	{
+		return fd;
+	}
+	// A stale socket file from an earlier server is replaced
+	bool listen(const char* path)
+	{
+		struct sockaddr_un addr;
+		if(!setPath(addr, path))
+			return fail("listen on", path);
+		unlink(path);
+		if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 64) != 0)
+			return fail("listen on", path);
+		return true;
+	}
+	bool connect(const char* path)
+	{
+		struct sockaddr_un addr;
+		if(!setPath(addr, path) || ::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+			return fail("connect to", path);
+		return true;
+	}
+	// Returns -1 on errors
+	int accept()
+	{
+		int r;
+		do
+			r = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+		while(r < 0 && errno == EINTR);
+		return r;
+	}
+	// Read what is available, up to len bytes, without waiting. Returns 0 when the other end closed
+	// the connection and -1 on errors, errno is EAGAIN if there is nothing to read yet.
+	ssize_t readSome(void* data, size_t len)
+	{
+		ssize_t r;
+		do
+			r = recv(fd, data, len, MSG_DONTWAIT);
+		while(r < 0 && errno == EINTR);
+		return r;
+	}
+	// Returns false on errors and when the other end closes the connection
+	bool readFull(void* data, size_t len)
+	{
+		int passedFd = -1;
+		return receive(data, len, passedFd) && passedFd < 0;
+	}
+	bool writeFull(const void* data, size_t len)
+	{
+		return send(data, len, -1);
+	}
+	// Send what the socket takes of len bytes without waiting, passFd is attached to the first one
+	// unless it is negative. Returns -1 on errors, errno is EAGAIN if the socket buffer is full.
+	ssize_t writeSome(const void* data, size_t len, int passFd, int flags = MSG_DONTWAIT)
+	{
+		struct iovec iov = { (void*)data, len };
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		if(passFd >= 0)
+		{
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+		}
+		ssize_t r;
+		do
+			r = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+		while(r < 0 && errno == EINTR);
+		return r;
+	}
+	// Send len bytes, passFd is attached to the first one unless it is negative
+	bool send(const void* data, size_t len, int passFd)
+	{
+		const uint8_t* p = (const uint8_t*)data;
+		while(len)
+		{
+			ssize_t r = writeSome(p, len, passFd, 0);
+			if(r <= 0)
+				return false;
+			passFd = -1;
+			p += r;
+			len -= r;
+		}
+		return true;
+	}
+	// Receive exactly len bytes, and the descriptor sent with them if any
+	bool receive(void* data, size_t len, int& passedFd)
+	{
+		uint8_t* p = (uint8_t*)data;
+		passedFd = -1;
+		while(len)
+		{
+			struct iovec iov = { p, len };
+			struct msghdr msg = {};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			ssize_t r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r <= 0)
+				break;
+			for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);cmsg;cmsg = CMSG_NXTHDR(&msg, cmsg))
+			{
+				if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && passedFd < 0)
+					memcpy(&passedFd, CMSG_DATA(cmsg), sizeof(int));
+			}
+			p += r;
+			len -= r;
+		}
+		if(len && passedFd >= 0)
+		{
+			::close(passedFd);
+			passedFd = -1;
+		}
+		return len == 0;
+	}
+};
+
+#endif
@@ -0,0 +1,1008 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// A single executable for the tools: macos-utils ds-store ... and macos-utils icon-resource ...
+// take the same arguments as forge_ds_store and forge_icon_resource. With --script the commands
+// are read from stdin, one per line, and run in the same process with warm buffers, builders
+// and worker threads. The outputs of a script are committed together at the end.
+// With --serve the same commands come from local clients and the outputs are sent back to them.
+// Interactive and bulk requests have their own queues, workers and warm state.
+
+// Everything the tools include comes first, so that their includes are no-ops in the namespaces
+#include <algorithm>
+#include <array>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "digest.h"
+#include "ds_store_reader.h"
+#include "ds_store_records.h"
+#include "file_watcher.h"
+#include "finder_layout.h"
+#include "icns_image.h"
+#include "local_socket.h"
+#include "manifest_reader.h"
+#include "output_file.h"
+#include "thread_pool.h"
+
+#define MACOS_UTILS
+// Both tools define their own helpers with the same names
+namespace ds_store
+{
+#include "forge_ds_store.cpp"
+}
+namespace icon_resource
+{
+#include "forge_icon_resource.cpp"
+}
+
+typedef int (*ToolMain)(int argc, char* argv[]);
+
+struct Tool
+{
+	const char* command;
+	// The name of the standalone executable, for links to this one
+	const char* executable;
+	ToolMain toolMain;
+};
+
+static const Tool tools[] = {
+	{ "ds-store", "forge_ds_store", ds_store::dsStoreMain },
+	{ "icon-resource", "forge_icon_resource", icon_resource::iconResourceMain }
+};
+
+// The state kept for the whole script
+class ScriptRunner
+{
+private:
+	OutputBatch batch;
+	DigestManifest manifest;
+	bool withDigests;
+	std::unique_ptr<ds_store::StoreBuilder<4096>> builder4k;
+	std::unique_ptr<ds_store::StoreBuilder<8192>> builder8k;
+	std::unique_ptr<ds_store::StoreBuilder<16384>> builder16k;
+	icon_resource::BatchContext iconContext;
+	// Consecutive icon resources with the same options are forged in parallel
+	icon_resource::JobList iconJobs;
+	icon_resource::ForgeOptions iconOptions;
+	std::vector<DigestResult> iconDigests;
+	ManifestReader splitter;
+	std::vector<char*> args;
+	std::string buffer;
+	uint32_t outputs;
+	// Where the commands come from, for the messages
+	const char* source;
+	template<uint32_t PageSize>
+	bool forgeStore(std::unique_ptr<ds_store::StoreBuilder<PageSize>>& builder, ds_store::LayoutMode layoutMode)
+	{
+		if(!builder)
+			builder.reset(new ds_store::StoreBuilder<PageSize>(layoutMode, &iconContext.pool));
+		builder->layoutMode = layoutMode;
+		return ds_store::forgeStore(args.size(), args.data(), *builder, batch, withDigests ? &manifest : nullptr);
+	}
+	bool flushIcons()
+	{
+		if(iconJobs.empty())
+			return true;
+		uint64_t totalBytes;
+		iconDigests.resize(withDigests ? iconJobs.size() : 0);
+		if(!icon_resource::forgeJobs(iconJobs, iconOptions, iconContext, batch, withDigests ? iconDigests.data() : nullptr, totalBytes))
+			return false;
+		for(uint32_t i=0;i<iconDigests.size();i++)
+			manifest.add(iconJobs[i].first, iconDigests[i]);
+		outputs += iconJobs.size();
+		iconJobs.clear();
+		return true;
+	}
+	// ds-store [--page-size 4096|8192|16384] [--layout check|nudge] output_file bg.img ...
+	bool runStore(char* progName, uint32_t lineNum, std::span<const std::string_view> fields)
+	{
+		uint32_t pageSize = 4096;
+		ds_store::LayoutMode layoutMode = ds_store::LAYOUT_UNCHECKED;
+		while(fields.size() >= 2 && (fields[0] == "--page-size" || fields[0] == "--layout"))
+		{
+			if(fields[0] == "--layout" && (fields[1] == "check" || fields[1] == "nudge"))
+				layoutMode = fields[1] == "check" ? ds_store::LAYOUT_CHECK : ds_store::LAYOUT_NUDGE;
+			else if(fields[0] == "--layout" || !parseInt(fields[1], pageSize))
+			{
+				printf("%s:%u: Invalid option %.*s\n", source, lineNum, int(fields[1].size()), fields[1].data());
+				return false;
+			}
+			fields = fields.subspan(2);
+		}
+		std::vector<std::string_view> storeFields(fields.begin(), fields.end());
+		if(!ds_store::splitStoreArgs(progName, source, lineNum, storeFields, buffer, args))
+			return false;
+		bool ok;
+		switch(pageSize)
+		{
+			case 4096: ok = forgeStore(builder4k, layoutMode); break;
+			case 8192: ok = forgeStore(builder8k, layoutMode); break;
+			case 16384: ok = forgeStore(builder16k, layoutMode); break;
+			default:
+				printf("Unsupported page size: %u\n", pageSize);
+				return false;
+		}
+		outputs += ok;
+		return ok;
+	}
+	// icon-resource [--classic-icons [--dither]] output_file file.icns
+	bool runIcon(uint32_t lineNum, std::span<const std::string_view> fields)
+	{
+		icon_resource::ForgeOptions options = { false, false };
+		for(;!fields.empty() && (fields[0] == "--classic-icons" || fields[0] == "--dither");fields = fields.subspan(1))
+			(fields[0] == "--dither" ? options.dither : options.classicIcons) = true;
+		if(fields.size() != 2 || (options.dither && !options.classicIcons))
+		{
+			printf("%s:%u: Expected icon-resource [--classic-icons [--dither]] output_file file.icns\n", source, lineNum);
+			return false;
+		}
+		if(!iconJobs.empty() && (options.classicIcons != iconOptions.classicIcons || options.dither != iconOptions.dither) &&
+			!flushIcons())
+		{
+			return false;
+		}
+		iconOptions = options;
+		iconJobs.emplace_back(std::string(fields[0]), std::string(fields[1]));
+		return true;
+	}
+public:
+	ScriptRunner(uint32_t threadCount, bool digests, const char* sourceName):withDigests(digests),iconContext(threadCount),
+		iconOptions{ false, false },outputs(0),source(sourceName)
+	{
+	}
+	// The outputs are not written anywhere but kept for takeOutputs
+	void keepInMemory()
+	{
+		batch.keepInMemory();
+	}
+	// Run a command line, icon resources may wait for flush to be forged together
+	bool runLine(char* progName, uint32_t lineNum, std::string_view text)
+	{
+		splitter.split(text);
+		std::span<const std::string_view> fields(splitter.getFields());
+		if(fields[0] == "ds-store")
+			return flushIcons() && runStore(progName, lineNum, fields.subspan(1));
+		if(fields[0] == "icon-resource")
+			return runIcon(lineNum, fields.subspan(1));
+		printf("%s:%u: Unknown command %.*s\n", source, lineNum, int(fields[0].size()), fields[0].data());
+		return false;
+	}
+	bool flush()
+	{
+		return flushIcons();
+	}
+	// Drop everything which was not committed or taken yet
+	void discard()
+	{
+		iconJobs.clear();
+		batch.discard();
+	}
+	void takeOutputs(std::vector<MemoryOutput>& taken)
+	{
+		batch.takeMemoryOutputs(taken);
+	}
+	// Run the commands of the script, the first failure stops it and nothing is committed
+	bool run(FILE* in, char* progName, const char* manifestPath)
+	{
+		char* line = nullptr;
+		size_t lineCap = 0;
+		ssize_t len;
+		uint32_t lineNum = 0;
+		bool ok = true;
+		while(ok && (len = getline(&line, &lineCap, in)) >= 0)
+		{
+			lineNum++;
+			std::string_view text(line, len);
+			while(!text.empty() && (text.back() == '\n' || text.back() == '\r'))
+				text.remove_suffix(1);
+			if(text.empty() || text[0] == '#')
+				continue;
+			ok = runLine(progName, lineNum, text);
+		}
+		free(line);
+		ok = ok && flushIcons();
+		if(ok && manifestPath)
+			ok = manifest.write(batch, manifestPath);
+		return ok && batch.commit();
+	}
+	uint32_t getOutputCount() const
+	{
+		return outputs;
+	}
+	uint32_t getThreadCount() const
+	{
+		return iconContext.pool.getThreadCount();
+	}
+};
+
+// The size of the output of a command line, from the arguments and the sizes of the inputs. Stores
+// are counted in nodes of the page size, icon resources are about as big as their icns.
+uint64_t estimateOutput(ManifestReader& splitter, std::string_view text)
+{
+	splitter.split(text);
+	std::span<const std::string_view> fields(splitter.getFields());
+	if(fields[0] == "ds-store")
+	{
+		uint32_t pageSize = 4096;
+		fields = fields.subspan(1);
+		for(;fields.size() >= 2 && (fields[0] == "--page-size" || fields[0] == "--layout");fields = fields.subspan(2))
+		{
+			// The runner rejects the unsupported sizes
+			if(fields[0] == "--page-size" && (!parseInt(fields[1], pageSize) || pageSize == 0))
+				pageSize = 4096;
+		}
+		// The records of the window, with the alias of the background, and an Iloc record for each file
+		uint64_t recordBytes = 1024;
+		uint64_t recordCount = 1;
+		for(size_t i=7;i<fields.size();i+=3,recordCount++)
+			recordBytes += 32 + fields[i].size() * 2;
+		// The header, the allocator info and the table of contents fit in a page
+		static const uint64_t metaDataBytes = 4096;
+		uint64_t leaves = recordBytes / pageSize + 1;
+		if(leaves == 1)
+			return metaDataBytes + std::max<uint64_t>(recordBytes, 2048);
+		// A separator record for each leaf goes up to the inner nodes, with its child pointer
+		uint64_t separatorBytes = leaves * (recordBytes / recordCount + 4);
+		uint64_t nodes = leaves + separatorBytes / pageSize + 1;
+		return metaDataBytes + nodes * pageSize;
+	}
+	// The icns is copied as it is, the classic icons are a few KB
+	static const uint64_t resourceOverhead = 8192;
+	struct stat st;
+	if(stat(std::string(fields.back()).c_str(), &st) != 0)
+		return resourceOverhead;
+	return st.st_size + resourceOverhead;
+}
+
+int usage(const char* progName)
+{
+	printf("Usage: %s ds-store [forge_ds_store arguments]\n", progName);
+	printf("       %s icon-resource [forge_icon_resource arguments]\n", progName);
+	printf("       %s [--digests manifest.txt] [--jobs N] --script < commands.txt\n", progName);
+	printf("       %s [--jobs N] [--budget MB] [--bulk-nice N] --serve socket\n", progName);
+	printf("       %s --request socket [--stream] [--bulk] [--repeat N] command [arguments]\n", progName);
+	printf("       %s --load-test socket [--bulk-clients N] [--requests N] [--interval ms] [--one-lane] interactive.txt bulk.txt\n", progName);
+	printf("The script has a command per line, with the arguments separated by tabs, requests have a single command:\n");
+	printf("  ds-store [--page-size 4096|8192|16384] [--layout check|nudge] output_file bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n");
+	printf("  icon-resource [--classic-icons [--dither]] output_file file.icns\n");
+	return 1;
+}
+
+// A response waiting to be sent by the polling thread. The output stays mapped until the last
+// byte is sent in stream mode, the memfd goes with the head otherwise.
+struct PendingResponse
+{
+	std::string head;
+	int fd = -1;
+	bool passFd = false;
+	const uint8_t* data = nullptr;
+	uint64_t size = 0;
+	// Bytes of the head and the data sent so far
+	uint64_t sent = 0;
+	// Released from the memory budget once sent
+	uint64_t estimate = 0;
+};
+
+// A client of the server, it sends a request at a time and waits for the response
+struct ServerClient
+{
+	LocalSocket socket;
+	// From the time the request is queued until its response is sent, only used by the polling thread
+	bool busy;
+	// The part of the next request received so far, only used by the polling thread
+	std::string pending;
+	// Filled by a lane, then sent by the polling thread
+	PendingResponse response;
+	explicit ServerClient(int fd):socket(fd),busy(false)
+	{
+	}
+};
+
+struct ServerRequest
+{
+	std::shared_ptr<ServerClient> client;
+	uint32_t mode;
+	uint32_t num;
+	uint64_t estimate;
+	std::string text;
+};
+
+// The bytes of the outputs being built or sent, a request waits until its estimate fits. Interactive
+// requests are admitted ahead of bulk ones, and a request always fits when nothing else is in progress.
+class MemoryBudget
+{
+private:
+	std::mutex mutex;
+	std::condition_variable released;
+	uint64_t limit;
+	uint64_t used;
+	uint32_t interactiveWaiting;
+public:
+	explicit MemoryBudget(uint64_t l):limit(l),used(0),interactiveWaiting(0)
+	{
+	}
+	void acquire(uint64_t bytes, uint32_t lane)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		bool interactive = lane == LANE_INTERACTIVE;
+		interactiveWaiting += interactive;
+		released.wait(lock, [&] { return (used == 0 || used + bytes <= limit) && (interactive || interactiveWaiting == 0); });
+		interactiveWaiting -= interactive;
+		used += bytes;
+	}
+	void release(uint64_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		used -= bytes;
+		released.notify_all();
+	}
+	uint64_t getLimit() const
+	{
+		return limit;
+	}
+};
+
+// The responses the lanes are done with, they wake the polling thread to send them
+class ResponseQueue
+{
+private:
+	std::mutex mutex;
+	std::vector<std::shared_ptr<ServerClient>> ready;
+	int wakeFd;
+public:
+	explicit ResponseQueue(int fd):wakeFd(fd)
+	{
+	}
+	void push(const std::shared_ptr<ServerClient>& client)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			ready.push_back(client);
+		}
+		uint64_t one = 1;
+		if(write(wakeFd, &one, sizeof(one)) < 0)
+			printf("Cannot wake the server: %s\n", strerror(errno));
+	}
+	void take(std::vector<std::shared_ptr<ServerClient>>& taken)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		taken.swap(ready);
+		ready.clear();
+	}
+};
+
+// Run the command of a request and prepare the response, nothing is sent yet
+void prepareResponse(const ServerRequest& request, ScriptRunner& runner, char* progName)
+{
+	PendingResponse& pending = request.client->response;
+	pending = PendingResponse();
+	pending.estimate = request.estimate;
+	bool ok = runner.runLine(progName, request.num, request.text) && runner.flush();
+	std::vector<MemoryOutput> outputs;
+	runner.takeOutputs(outputs);
+	if(!ok)
+		runner.discard();
+	// Every command has a single output
+	ResponseHeader response = { ok && outputs.size() == 1 ? STATUS_OK : STATUS_FAILED, 0, 0 };
+	std::string path;
+	if(response.status == STATUS_OK)
+	{
+		MemoryOutput& out = outputs[0];
+		path = out.path;
+		response.pathLength = out.path.size();
+		response.size = out.size;
+		pending.fd = out.fd;
+		pending.passFd = request.mode == RESPONSE_FD;
+		// Mapped rather than read, the bytes are only copied into the socket
+		if(!pending.passFd && out.size)
+		{
+			void* m = mmap(nullptr, out.size, PROT_READ, MAP_SHARED, out.fd, 0);
+			if(m == MAP_FAILED)
+			{
+				printf("Cannot map the output of request %u: %s\n", request.num, strerror(errno));
+				response = { STATUS_FAILED, 0, 0 };
+			}
+			else
+			{
+				pending.data = (const uint8_t*)m;
+				pending.size = out.size;
+			}
+		}
+		outputs.erase(outputs.begin());
+	}
+	for(MemoryOutput& out: outputs)
+		close(out.fd);
+	if(response.status != STATUS_OK && pending.fd >= 0)
+	{
+		close(pending.fd);
+		pending.fd = -1;
+	}
+	pending.head.assign((const char*)&response, sizeof(response));
+	if(response.status == STATUS_OK)
+		pending.head += path;
+}
+
+// The requests of a lane are run in order by its worker. The kernel shares the CPU between the
+// lanes by the weights of their nice values, so a long bulk job is preempted by interactive ones
+// instead of delaying them.
+class ServerLane
+{
+private:
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::deque<ServerRequest> requests;
+	bool stopping;
+	std::thread worker;
+	void workerLoop(uint32_t lane, int nice, uint32_t threadCount, char* progName, MemoryBudget& budget, ResponseQueue& responses)
+	{
+		// Before the runner starts its threads, they inherit it
+		if(nice != 0 && setpriority(PRIO_PROCESS, gettid(), nice) != 0)
+			printf("Cannot set the priority of the bulk lane: %s\n", strerror(errno));
+		ScriptRunner runner(threadCount, false, lane == LANE_INTERACTIVE ? "interactive request" : "bulk request");
+		runner.keepInMemory();
+		while(true)
+		{
+			ServerRequest request;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queued.wait(lock, [&] { return stopping || !requests.empty(); });
+				if(stopping)
+					return;
+				request = std::move(requests.front());
+				requests.pop_front();
+			}
+			// Released by the polling thread once the response is sent
+			budget.acquire(request.estimate, lane);
+			prepareResponse(request, runner, progName);
+			responses.push(request.client);
+		}
+	}
+public:
+	ServerLane(uint32_t lane, int nice, uint32_t threadCount, char* progName, MemoryBudget& budget, ResponseQueue& responses):stopping(false)
+	{
+		worker = std::thread([=, this, &budget, &responses] { workerLoop(lane, nice, threadCount, progName, budget, responses); });
+	}
+	~ServerLane()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		queued.notify_one();
+		worker.join();
+	}
+	void push(ServerRequest&& request)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back(std::move(request));
+		}
+		queued.notify_one();
+	}
+};
+
+// Send what the socket takes of the response without waiting, returns false if the client is gone
+bool sendResponse(ServerClient& client)
+{
+	PendingResponse& r = client.response;
+	uint64_t total = r.head.size() + r.size;
+	while(r.sent < total)
+	{
+		ssize_t n;
+		if(r.sent < r.head.size())
+			n = client.socket.writeSome(r.head.data() + r.sent, r.head.size() - r.sent, r.sent == 0 && r.passFd ? r.fd : -1);
+		else
+			n = client.socket.writeSome(r.data + (r.sent - r.head.size()), total - r.sent, -1);
+		if(n < 0)
+			return errno == EAGAIN;
+		r.sent += n;
+	}
+	return true;
+}
+
+// Drop the output of the response, sent or not, and give its memory back
+void endResponse(ServerClient& client, MemoryBudget& budget)
+{
+	PendingResponse& r = client.response;
+	if(r.data)
+		munmap((void*)r.data, r.size);
+	if(r.fd >= 0)
+		close(r.fd);
+	budget.release(r.estimate);
+	r = PendingResponse();
+	client.busy = false;
+}
+
+// Read what a client sent without waiting, the request is queued in its lane once complete. A
+// client which stalls in the middle of a request only holds its own connection.
+// Returns false when the connection is to be closed
+bool readRequest(const std::shared_ptr<ServerClient>& client, ManifestReader& splitter, MemoryBudget& budget,
+	std::unique_ptr<ServerLane>* lanes, std::set<ServerClient*>& sending, uint32_t& requestNum)
+{
+	static const uint32_t maxRequestSize = 1 << 20;
+	std::string& pending = client->pending;
+	RequestHeader header;
+	// Only the bytes of this request are read, the next one stays in the socket until the response
+	size_t have = pending.size();
+	size_t want = sizeof(header);
+	if(have >= sizeof(header))
+	{
+		memcpy(&header, pending.data(), sizeof(header));
+		want += header.length;
+	}
+	pending.resize(want);
+	ssize_t r = client->socket.readSome(pending.data() + have, want - have);
+	pending.resize(have + std::max<ssize_t>(r, 0));
+	if(r <= 0)
+		return r < 0 && errno == EAGAIN;
+	if(pending.size() < sizeof(header))
+		return true;
+	memcpy(&header, pending.data(), sizeof(header));
+	if(header.length > maxRequestSize || (header.mode != RESPONSE_STREAM && header.mode != RESPONSE_FD) ||
+		(header.lane != LANE_INTERACTIVE && header.lane != LANE_BULK))
+	{
+		return false;
+	}
+	if(pending.size() < sizeof(header) + header.length)
+		return true;
+	ServerRequest request = { client, header.mode, ++requestNum, 0, pending.substr(sizeof(header)) };
+	pending.clear();
+	request.estimate = estimateOutput(splitter, request.text);
+	client->busy = true;
+	if(request.estimate > budget.getLimit())
+	{
+		// Sent like the other responses, nothing was taken from the budget
+		ResponseHeader response = { STATUS_REJECTED, 0, 0 };
+		client->response = PendingResponse();
+		client->response.head.assign((const char*)&response, sizeof(response));
+		sending.insert(client.get());
+		return true;
+	}
+	lanes[header.lane]->push(std::move(request));
+	return true;
+}
+
+// Serve the commands of local clients with the warm state of a script, in an interactive and a bulk
+// lane. This thread only moves bytes: it reads the requests and sends the responses without waiting,
+// so that a client which stalls holds up nobody else.
+int serve(const char* socketPath, uint32_t threadCount, uint64_t budgetBytes, int bulkNice, char* progName)
+{
+	LocalSocket listener;
+	if(!listener.listen(socketPath))
+		return 1;
+	// Written by the lanes when a response is ready
+	int wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(wakeFd < 0)
+	{
+		printf("Cannot create an eventfd: %s\n", strerror(errno));
+		return 1;
+	}
+	MemoryBudget budget(budgetBytes);
+	ResponseQueue responses(wakeFd);
+	std::unique_ptr<ServerLane> lanes[2];
+	lanes[LANE_INTERACTIVE].reset(new ServerLane(LANE_INTERACTIVE, 0, threadCount, progName, budget, responses));
+	lanes[LANE_BULK].reset(new ServerLane(LANE_BULK, bulkNice, threadCount, progName, budget, responses));
+	ManifestReader splitter;
+	std::vector<std::shared_ptr<ServerClient>> clients;
+	// The clients with a response to send
+	std::set<ServerClient*> sending;
+	std::vector<std::shared_ptr<ServerClient>> ready;
+	std::vector<struct pollfd> fds;
+	std::vector<size_t> polled;
+	uint32_t requestNum = 0;
+	printf("Serving on %s with a budget of %.1f MB\n", socketPath, budgetBytes / (1024.0 * 1024.0));
+	fflush(stdout);
+	while(true)
+	{
+		fds.clear();
+		polled.clear();
+		fds.push_back({ listener.getFd(), POLLIN, 0 });
+		fds.push_back({ wakeFd, POLLIN, 0 });
+		for(size_t i=0;i<clients.size();i++)
+		{
+			bool isSending = sending.count(clients[i].get());
+			if(clients[i]->busy && !isSending)
+				continue;
+			fds.push_back({ clients[i]->socket.getFd(), short(isSending ? POLLOUT : POLLIN), 0 });
+			polled.push_back(i);
+		}
+		if(poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			printf("Cannot wait for requests: %s\n", strerror(errno));
+			close(wakeFd);
+			return 1;
+		}
+		uint64_t wakeCount;
+		if((fds[1].revents & POLLIN) && read(wakeFd, &wakeCount, sizeof(wakeCount)) < 0 && errno != EAGAIN)
+			printf("Cannot read the eventfd: %s\n", strerror(errno));
+		// From the end, so that erasing keeps the indices before
+		for(size_t i=polled.size();i-- > 0;)
+		{
+			if(!fds[i + 2].revents)
+				continue;
+			std::shared_ptr<ServerClient>& client = clients[polled[i]];
+			bool ok;
+			if(sending.count(client.get()))
+			{
+				ok = sendResponse(*client);
+				if(!ok || client->response.sent == client->response.head.size() + client->response.size)
+				{
+					sending.erase(client.get());
+					endResponse(*client, budget);
+				}
+			}
+			else
+				ok = readRequest(client, splitter, budget, lanes, sending, requestNum);
+			if(!ok)
+				clients.erase(clients.begin() + polled[i]);
+		}
+		// Most responses fit in the socket buffer, they are sent right away
+		responses.take(ready);
+		for(const std::shared_ptr<ServerClient>& client: ready)
+		{
+			bool ok = sendResponse(*client);
+			if(ok && client->response.sent < client->response.head.size() + client->response.size)
+			{
+				sending.insert(client.get());
+				continue;
+			}
+			endResponse(*client, budget);
+			if(!ok)
+				std::erase(clients, client);
+		}
+		if(fds[0].revents & POLLIN)
+		{
+			int fd = listener.accept();
+			if(fd >= 0)
+				clients.emplace_back(new ServerClient(fd));
+		}
+	}
+}
+
+double percentile(std::vector<double> values, double p)
+{
+	std::sort(values.begin(), values.end());
+	return values[std::min<size_t>(values.size() - 1, size_t(values.size() * p))];
+}
+
+// Send a request and wait for the response. In stream mode the output is read into data, otherwise
+// fd is set to its memfd. Returns false if the connection failed, the status tells if the command did.
+bool exchange(LocalSocket& server, uint32_t mode, uint32_t lane, const std::string& text, ResponseHeader& response,
+	std::string& path, std::vector<uint8_t>& data, int& fd)
+{
+	RequestHeader request = { mode, lane, uint32_t(text.size()) };
+	fd = -1;
+	if(!server.writeFull(&request, sizeof(request)) || !server.writeFull(text.data(), text.size()) ||
+		!server.receive(&response, sizeof(response), fd))
+	{
+		printf("The server closed the connection\n");
+		return false;
+	}
+	if(response.status != STATUS_OK)
+		return true;
+	path.resize(response.pathLength);
+	bool ok = server.readFull(path.data(), path.size());
+	if(mode == RESPONSE_STREAM)
+	{
+		data.resize(response.size);
+		ok = ok && server.readFull(data.data(), data.size());
+	}
+	else
+		ok = ok && fd >= 0;
+	if(!ok)
+		printf("Truncated response\n");
+	return ok;
+}
+
+// Send a command to a server and write its output to the path of the command. With --stream the
+// output comes as bytes on the socket instead of a descriptor. With --repeat the request is sent
+// several times and timed, the outputs are written but only the last one is committed.
+// The inputs are read by the server, relative paths are resolved in its directory.
+int sendRequest(const char* progName, const char* socketPath, int argc, char* argv[])
+{
+	uint32_t mode = RESPONSE_FD;
+	uint32_t lane = LANE_INTERACTIVE;
+	uint32_t repeat = 1;
+	for(;argc >= 1 && strncmp(argv[0], "--", 2) == 0;argc--,argv++)
+	{
+		if(strcmp(argv[0], "--stream") == 0)
+			mode = RESPONSE_STREAM;
+		else if(strcmp(argv[0], "--bulk") == 0)
+			lane = LANE_BULK;
+		else if(strcmp(argv[0], "--repeat") == 0 && argc >= 2 && parseInt(argv[1], repeat) && repeat != 0)
+		{
+			argc--;
+			argv++;
+		}
+		else
+			return usage(progName);
+	}
+	if(argc < 1)
+		return usage(progName);
+	std::string text = argv[0];
+	for(int i=1;i<argc;i++)
+		text += std::string("\t") + argv[i];
+	LocalSocket server;
+	if(!server.connect(socketPath))
+		return 1;
+	std::string path;
+	std::vector<uint8_t> data;
+	std::vector<double> received, written;
+	for(uint32_t r=0;r<repeat;r++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		ResponseHeader response;
+		int fd;
+		if(!exchange(server, mode, lane, text, response, path, data, fd))
+			return 1;
+		LocalSocket memory(fd);
+		if(response.status != STATUS_OK)
+		{
+			printf(response.status == STATUS_REJECTED ? "The output is bigger than the memory budget of the server\n" :
+				"The request failed, see the server output\n");
+			return 1;
+		}
+		auto receiveTime = std::chrono::steady_clock::now();
+		// A memfd is copied by the kernel
+		OutputFile out;
+		if(!out.open(path.c_str()) || !(mode == RESPONSE_FD ? out.copyFrom(fd, 0, response.size) : out.write(data.data(), data.size())))
+			return 1;
+		if(r + 1 < repeat)
+		{
+			out.discard();
+			auto end = std::chrono::steady_clock::now();
+			received.push_back(std::chrono::duration<double, std::milli>(receiveTime - start).count());
+			written.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+		}
+		else if(!out.commit())
+			return 1;
+		if(r + 1 == repeat && repeat > 1)
+		{
+			printf("%s responses of %.1f KB, %u requests: received p50 %.3f ms p99 %.3f ms, written p50 %.3f ms p99 %.3f ms\n",
+				mode == RESPONSE_FD ? "Descriptor" : "Stream", response.size / 1024.0, repeat - 1,
+				percentile(received, 0.5), percentile(received, 0.99), percentile(written, 0.5), percentile(written, 0.99));
+		}
+	}
+	return 0;
+}
+
+// What a load test client did, the outputs are dropped as they arrive
+struct LoadStats
+{
+	std::vector<double> latencies;
+	uint64_t bytes = 0;
+	uint32_t rejected = 0;
+	bool ok = true;
+};
+
+// Send the commands in turn, count requests or until stop is set, with interval ms between them
+void runLoadClient(const char* socketPath, uint32_t lane, const std::vector<std::string>& commands, uint32_t count,
+	uint32_t interval, const std::atomic<bool>& stop, LoadStats& stats)
+{
+	LocalSocket server;
+	stats.ok = server.connect(socketPath);
+	std::string path;
+	std::vector<uint8_t> data;
+	for(uint32_t i=0;stats.ok && (count ? i < count : !stop);i++)
+	{
+		if(interval && i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+		auto start = std::chrono::steady_clock::now();
+		ResponseHeader response = {};
+		int fd;
+		stats.ok = exchange(server, RESPONSE_FD, lane, commands[i % commands.size()], response, path, data, fd);
+		LocalSocket memory(fd);
+		stats.latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		stats.bytes += response.status == STATUS_OK ? response.size : 0;
+		stats.rejected += response.status == STATUS_REJECTED;
+		if(stats.ok && response.status == STATUS_FAILED)
+		{
+			printf("A request failed, see the server output\n");
+			stats.ok = false;
+		}
+	}
+}
+
+void printLoadStats(const char* what, const LoadStats& stats, double seconds)
+{
+	printf("%s: %zu requests, p50 %.3f ms p99 %.3f ms max %.3f ms, %.1f requests/s, %.1f MB/s, %u rejected\n", what,
+		stats.latencies.size(), percentile(stats.latencies, 0.5), percentile(stats.latencies, 0.99),
+		*std::max_element(stats.latencies.begin(), stats.latencies.end()), stats.latencies.size() / seconds,
+		stats.bytes / (1024.0 * 1024.0) / seconds, stats.rejected);
+}
+
+// Time interactive requests on an idle server, then again while bulk clients keep it busy. The
+// commands are read from files in the script syntax and sent in turn. With --one-lane the bulk
+// commands are sent as interactive ones, for comparison.
+int loadTest(const char* progName, const char* socketPath, int argc, char* argv[])
+{
+	uint32_t bulkClients = 4;
+	uint32_t requests = 1000;
+	uint32_t interval = 2;
+	uint32_t bulkLane = LANE_BULK;
+	for(;argc >= 1 && strncmp(argv[0], "--", 2) == 0;argc--,argv++)
+	{
+		if(strcmp(argv[0], "--one-lane") == 0)
+		{
+			bulkLane = LANE_INTERACTIVE;
+			continue;
+		}
+		uint32_t* value = strcmp(argv[0], "--bulk-clients") == 0 ? &bulkClients : strcmp(argv[0], "--requests") == 0 ? &requests :
+			strcmp(argv[0], "--interval") == 0 ? &interval : nullptr;
+		if(!value || argc < 2 || !parseInt(argv[1], *value) || requests == 0)
+			return usage(progName);
+		argc--;
+		argv++;
+	}
+	if(argc != 2)
+		return usage(progName);
+	std::vector<std::string> commands[2];
+	for(uint32_t lane=0;lane<2;lane++)
+	{
+		ManifestReader reader;
+		if(!reader.open(argv[lane]))
+			return 1;
+		std::string_view line;
+		while(reader.nextLine(line))
+			commands[lane].emplace_back(line);
+		if(commands[lane].empty())
+		{
+			printf("No commands in %s\n", argv[lane]);
+			return 1;
+		}
+	}
+	std::atomic<bool> stop(false);
+	LoadStats idle;
+	auto start = std::chrono::steady_clock::now();
+	runLoadClient(socketPath, LANE_INTERACTIVE, commands[LANE_INTERACTIVE], requests, interval, stop, idle);
+	double idleSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if(!idle.ok)
+		return 1;
+	std::vector<LoadStats> bulk(bulkClients);
+	std::vector<std::thread> bulkThreads;
+	auto bulkStart = std::chrono::steady_clock::now();
+	for(uint32_t i=0;i<bulkClients;i++)
+	{
+		bulkThreads.emplace_back(runLoadClient, socketPath, bulkLane, std::cref(commands[LANE_BULK]), 0, 0,
+			std::cref(stop), std::ref(bulk[i]));
+	}
+	// Let the bulk clients fill the queue first
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	LoadStats loaded;
+	start = std::chrono::steady_clock::now();
+	runLoadClient(socketPath, LANE_INTERACTIVE, commands[LANE_INTERACTIVE], requests, interval, stop, loaded);
+	double loadedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	stop = true;
+	LoadStats bulkTotal;
+	for(uint32_t i=0;i<bulkClients;i++)
+	{
+		bulkThreads[i].join();
+		bulkTotal.ok = bulkTotal.ok && bulk[i].ok;
+		bulkTotal.latencies.insert(bulkTotal.latencies.end(), bulk[i].latencies.begin(), bulk[i].latencies.end());
+		bulkTotal.bytes += bulk[i].bytes;
+		bulkTotal.rejected += bulk[i].rejected;
+	}
+	double bulkSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bulkStart).count();
+	if(!loaded.ok || !bulkTotal.ok)
+		return 1;
+	printLoadStats("Interactive, idle", idle, idleSeconds);
+	printLoadStats("Interactive, loaded", loaded, loadedSeconds);
+	if(!bulkTotal.latencies.empty())
+		printLoadStats("Bulk", bulkTotal, bulkSeconds);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	// Links named after a tool run it directly
+	const char* base = strrchr(argv[0], '/');
+	base = base ? base + 1 : argv[0];
+	for(const Tool& tool: tools)
+	{
+		if(strcmp(base, tool.executable) == 0)
+			return tool.toolMain(argc, argv);
+	}
+	if(argc >= 2)
+	{
+		for(const Tool& tool: tools)
+		{
+			if(strcmp(argv[1], tool.command) != 0)
+				continue;
+			// The usage messages show the full command
+			std::string progName = std::string(argv[0]) + " " + tool.command;
+			argv[1] = progName.data();
+			return tool.toolMain(argc - 1, argv + 1);
+		}
+	}
+	if(argc >= 3 && strcmp(argv[1], "--request") == 0)
+		return sendRequest(argv[0], argv[2], argc - 3, argv + 3);
+	if(argc >= 3 && strcmp(argv[1], "--load-test") == 0)
+		return loadTest(argv[0], argv[2], argc - 3, argv + 3);
+	const char* manifestPath = nullptr;
+	uint32_t threadCount = 0;
+	uint32_t budgetMB = 256;
+	uint32_t bulkNice = 10;
+	bool serverOptions = false;
+	while(argc >= 3 && (strcmp(argv[1], "--digests") == 0 || strcmp(argv[1], "--jobs") == 0 ||
+		strcmp(argv[1], "--budget") == 0 || strcmp(argv[1], "--bulk-nice") == 0))
+	{
+		if(strcmp(argv[1], "--digests") == 0)
+			manifestPath = argv[2];
+		else if(strcmp(argv[1], "--jobs") == 0)
+		{
+			if(!parseInt(argv[2], threadCount))
+				return usage(argv[0]);
+		}
+		else
+		{
+			uint32_t& value = strcmp(argv[1], "--budget") == 0 ? budgetMB : bulkNice;
+			if(!parseInt(argv[2], value) || budgetMB == 0 || bulkNice > 19)
+				return usage(argv[0]);
+			serverOptions = true;
+		}
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	if(argc == 3 && strcmp(argv[1], "--serve") == 0 && manifestPath == nullptr)
+		return serve(argv[2], threadCount, uint64_t(budgetMB) << 20, bulkNice, argv[0]);
+	if(argc != 2 || strcmp(argv[1], "--script") != 0 || serverOptions)
+		return usage(argv[0]);
+	auto start = std::chrono::steady_clock::now();
+	ScriptRunner runner(threadCount, manifestPath != nullptr, "stdin");
+	if(!runner.run(stdin, argv[0], manifestPath))
+		return 1;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Forged %u outputs in %.1f ms with %u threads\n", runner.getOutputCount(), ms, runner.getThreadCount());
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MANIFEST_READER_H
+#define MANIFEST_READER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <charconv>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_MANIFEST
+#include <immintrin.h>
+#endif
+
+// Parse a decimal integer, the whole string must be used. Negative values wrap around, like
+// coordinates left of the window do in the records.
+inline bool parseInt(std::string_view s, uint32_t& ret)
+{
+	int64_t v;
+	auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+	if(r.ec != std::errc() || r.ptr != s.data() + s.size() || v < INT32_MIN || v > UINT32_MAX)
+		return false;
+	ret = v;
+	return true;
+}
+
+// Scan [p, end) for the end of the line, the offsets of the tabs from lineStart are added to tabs
+// Returns the position of the newline, or end
+inline const char* scanLineGeneric(const char* p, const char* end, const char* lineStart, std::vector<uint32_t>& tabs)
+{
+	for(;p < end && *p != '\n';p++)
+	{
+		if(*p == '\t')
+			tabs.push_back(p - lineStart);
+	}
+	return p;
+}
+
+#ifdef HAVE_X86_MANIFEST
+// 32 bytes at a time, the tabs and the newline are found with the same compares
+__attribute__((target("avx2"))) inline const char* scanLineAvx2(const char* p, const char* end, const char* lineStart, std::vector<uint32_t>& tabs)
+{
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	for(;end - p >= 32;p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		uint32_t newlineMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+		uint32_t tabMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+		// Only the tabs before the newline belong to this line
+		if(newlineMask)
+			tabMask &= (newlineMask & -newlineMask) - 1;
+		for(;tabMask;tabMask &= tabMask - 1)
+			tabs.push_back(p - lineStart + __builtin_ctz(tabMask));
+		if(newlineMask)
+			return p + __builtin_ctz(newlineMask);
+	}
+	return scanLineGeneric(p, end, lineStart, tabs);
+}
+#endif
+
+// Reads tab separated lists, one job per line. The file is mapped and the delimiters are
+// found with vector compares, the fields are views into the mapping.
+class ManifestReader
+{
+private:
+	typedef const char* (*ScanFunc)(const char* p, const char* end, const char* lineStart, std::vector<uint32_t>& tabs);
+	const char* data;
+	size_t size;
+	size_t pos;
+	uint32_t lineNum;
+	std::vector<uint32_t> tabs;
+	std::vector<std::string_view> fields;
+	static ScanFunc getScan()
+	{
+#ifdef HAVE_X86_MANIFEST
+		static const ScanFunc f = __builtin_cpu_supports("avx2") ? scanLineAvx2 : scanLineGeneric;
+		return f;
+#else
+		return scanLineGeneric;
+#endif
+	}
+	void splitTabs(std::string_view line)
+	{
+		fields.clear();
+		uint32_t begin = 0;
+		for(uint32_t t: tabs)
+		{
+			fields.push_back(line.substr(begin, t - begin));
+			begin = t + 1;
+		}
+		fields.push_back(line.substr(begin));
+	}
+	void close()
+	{
+		if(data && size)
+			munmap((void*)data, size);
+		data = nullptr;
+		size = 0;
+	}
+public:
+	ManifestReader():data(nullptr),size(0),pos(0),lineNum(0)
+	{
+	}
+	ManifestReader(const ManifestReader&) = delete;
+	ManifestReader& operator=(const ManifestReader&) = delete;
+	~ManifestReader()
+	{
+		close();
+	}
+	// Errors are reported on stdout
+	bool open(const char* path)
+	{
+		close();
+		pos = 0;
+		lineNum = 0;
+		int fd = ::open(path, O_RDONLY);
+		if(fd < 0)
+		{
+			printf("File not found: %s\n", path);
+			return false;
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		{
+			printf("Cannot read %s\n", path);
+			::close(fd);
+			return false;
+		}
+		size = st.st_size;
+		void* m = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+		::close(fd);
+		if(m == MAP_FAILED)
+		{
+			size = 0;
+			printf("Cannot read %s\n", path);
+			return false;
+		}
+		// The file is read once from start to end
+		if(size)
+			madvise(m, size, MADV_SEQUENTIAL);
+		data = (const char*)m;
+		return true;
+	}
+	// Move to the next line which is not empty or a comment, and split it
+	// Returns false at the end of the file
+	bool nextLine(std::string_view& line)
+	{
+		ScanFunc scan = getScan();
+		while(pos < size)
+		{
+			const char* start = data + pos;
+			tabs.clear();
+			const char* end = scan(start, data + size, start, tabs);
+			pos = end - data + 1;
+			lineNum++;
+			line = std::string_view(start, end - start);
+			while(!line.empty() && line.back() == '\r')
+				line.remove_suffix(1);
+			if(line.empty() || line[0] == '#')
+				continue;
+			splitTabs(line);
+			return true;
+		}
+		return false;
+	}
+	// Split a line which was read earlier, as nextLine does
+	void split(std::string_view line)
+	{
+		tabs.clear();
+		getScan()(line.data(), line.data() + line.size(), line.data(), tabs);
+		splitTabs(line);
+	}
+	// The fields of the last line, they stay valid as long as the reader is open
+	const std::vector<std::string_view>& getFields() const
+	{
+		return fields;
+	}
+	uint32_t getLineNum() const
+	{
+		return lineNum;
+	}
+};
+
+#endif
@@ -0,0 +1,686 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef OUTPUT_FILE_H
+#define OUTPUT_FILE_H
+
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_RING
+#include <memory>
+#include "io_ring.h"
+#endif
+
+// The directory containing path, used for syncing renames
+inline std::string parentDirectory(const std::string& path)
+{
+	size_t slash = path.rfind('/');
+	if(slash == std::string::npos)
+		return ".";
+	if(slash == 0)
+		return "/";
+	return path.substr(0, slash);
+}
+
+// An output which is written to a temporary file in the same directory and atomically
+// renamed over the destination on commit, a crash never leaves a truncated file behind
+// Outputs can also be kept in memory, in a memfd which is sealed and handed over instead
+class OutputFile
+{
+private:
+	std::string path;
+	std::string tmpPath;
+	int fd;
+	off_t offset;
+	bool inMemory;
+	bool fail(const char* what)
+	{
+		printf("Cannot %s %s: %s\n", what, path.c_str(), strerror(errno));
+		discard();
+		return false;
+	}
+	friend class OutputBatch;
+public:
+	OutputFile():fd(-1),offset(0),inMemory(false)
+	{
+	}
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+	~OutputFile()
+	{
+		discard();
+	}
+	// The next outputs are created in memory, path is only used as a name
+	void keepInMemory()
+	{
+		inMemory = true;
+	}
+	bool open(const char* p)
+	{
+		discard();
+		path = p;
+		if(inMemory)
+		{
+#ifdef __linux__
+			// The name is only shown in /proc, it does not need to be unique
+			fd = memfd_create(path.substr(0, 200).c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+			errno = ENOSYS;
+#endif
+			offset = 0;
+			return fd >= 0 || fail("create");
+		}
+		tmpPath = path + ".XXXXXX";
+		fd = mkstemp(&tmpPath[0]);
+		if(fd < 0)
+		{
+			tmpPath.clear();
+			return fail("create");
+		}
+		// mkstemp uses 0600, use the same permissions fopen would
+		static mode_t mask = []() { mode_t m = umask(0); umask(m); return m; }();
+		if(fchmod(fd, 0666 & ~mask) != 0)
+			return fail("create");
+		offset = 0;
+		return true;
+	}
+	bool writeAt(off_t o, const void* data, size_t len)
+	{
+		const uint8_t* p = (const uint8_t*)data;
+		while(len)
+		{
+			ssize_t r = pwrite(fd, p, len, o);
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r <= 0)
+				return fail("write");
+			p += r;
+			o += r;
+			len -= r;
+		}
+		if(o > offset)
+			offset = o;
+		return true;
+	}
+	// Append after the furthest byte written so far
+	bool write(const void* data, size_t len)
+	{
+		return writeAt(offset, data, len);
+	}
+	// Append all the buffers, usually with a single syscall
+	bool writev(const struct iovec* iov, int iovcnt)
+	{
+		std::vector<struct iovec> rest;
+		while(true)
+		{
+			// Empty buffers are skipped, if nothing is left pwritev would return 0 like on a failure
+			for(;iovcnt && iov->iov_len == 0;iovcnt--)
+				iov++;
+			if(iovcnt == 0)
+				break;
+			ssize_t r = pwritev(fd, iov, std::min(iovcnt, IOV_MAX), offset);
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r <= 0)
+				return fail("write");
+			offset += r;
+			// Skip what was written
+			while(iovcnt && size_t(r) >= iov->iov_len)
+			{
+				r -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if(r)
+			{
+				// The caller's buffers are const, adjust a copy
+				if(rest.empty())
+				{
+					rest.assign(iov, iov + iovcnt);
+					iov = rest.data();
+				}
+				struct iovec& first = rest[iov - rest.data()];
+				first.iov_base = (uint8_t*)first.iov_base + r;
+				first.iov_len -= r;
+			}
+		}
+		return true;
+	}
+	// Append len bytes of inFd, starting at inOffset. On Linux the data is copied by the
+	// kernel, without going through user space
+	bool copyFrom(int inFd, off_t inOffset, size_t len)
+	{
+#ifdef __linux__
+		while(len)
+		{
+			ssize_t r = copy_file_range(inFd, &inOffset, fd, &offset, len, 0);
+			if(r < 0 && errno == EINTR)
+				continue;
+			// Not supported for this pair of files, use plain reads and writes
+			if(r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+				break;
+			if(r < 0)
+				return fail("copy data to");
+			if(r == 0)
+			{
+				errno = EIO;
+				return fail("copy data to");
+			}
+			len -= r;
+		}
+#endif
+		uint8_t buf[16384];
+		while(len)
+		{
+			ssize_t r = pread(inFd, buf, std::min(len, sizeof(buf)), inOffset);
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r <= 0)
+			{
+				if(r == 0)
+					errno = EIO;
+				return fail("copy data to");
+			}
+			if(!write(buf, r))
+				return false;
+			inOffset += r;
+			len -= r;
+		}
+		return true;
+	}
+	int getFd() const
+	{
+		return fd;
+	}
+	// Forbid any change of an output kept in memory, the reader can then trust its size and contents
+	bool seal()
+	{
+#ifdef __linux__
+		if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0)
+			return true;
+#else
+		errno = ENOSYS;
+#endif
+		return fail("seal");
+	}
+	// The furthest byte written so far
+	off_t getSize() const
+	{
+		return offset;
+	}
+	const std::string& getPath() const
+	{
+		return path;
+	}
+	// Make the data durable and replace the destination
+	bool commit()
+	{
+		if(fdatasync(fd) != 0)
+			return fail("sync");
+		int r = ::close(fd);
+		fd = -1;
+		if(r != 0)
+			return fail("write");
+		if(rename(tmpPath.c_str(), path.c_str()) != 0)
+			return fail("rename");
+		tmpPath.clear();
+		// Make the rename itself durable
+		int dirFd = ::open(parentDirectory(path).c_str(), O_RDONLY | O_DIRECTORY);
+		if(dirFd >= 0)
+		{
+			fsync(dirFd);
+			::close(dirFd);
+		}
+		return true;
+	}
+	// Drop the temporary file, the destination is left untouched
+	void discard()
+	{
+		if(fd >= 0)
+			::close(fd);
+		fd = -1;
+		if(!tmpPath.empty())
+			unlink(tmpPath.c_str());
+		tmpPath.clear();
+	}
+};
+
+// A sealed output kept in memory, the descriptor belongs to whoever holds it
+struct MemoryOutput
+{
+	std::string path;
+	int fd;
+	off_t size;
+};
+
+// Groups the durability work of many outputs: files are written first, then the data is
+// synced once for the whole batch and only then the temporary files are renamed
+// In memory batches the outputs are sealed memfds instead, there is nothing to sync
+// On Linux the outputs given as memory buffers can optionally be written with io_uring,
+// each one as a linked chain of openat, write and close
+class OutputBatch
+{
+private:
+	struct Pending
+	{
+		std::string path;
+		std::string tmpPath;
+		// Only kept open for small batches, which use fdatasync
+		int fd;
+	};
+	// Above this number of files a single syncfs is cheaper than syncing each one
+	static const uint32_t maxOpenFiles = 16;
+	std::vector<Pending> pending;
+	bool closeOutputs;
+	bool inMemory;
+	std::vector<MemoryOutput> memoryOutputs;
+#ifdef HAVE_IO_RING
+	struct InFlight
+	{
+		std::string path;
+		std::string tmpPath;
+		size_t arenaOffset;
+		size_t len;
+		int results[3];
+	};
+	std::unique_ptr<IoRing> ring;
+	std::vector<InFlight> inFlight;
+	size_t arenaUsed;
+	uint32_t tmpCounter;
+	// Set when an output queued earlier could not be written, until the batch is committed or discarded
+	bool ringFailed;
+	// Submit the queued chains and wait for all of them, failed outputs are written again
+	// with the synchronous path
+	bool flushRing()
+	{
+		if(inFlight.empty())
+			return true;
+		uint32_t expected = inFlight.size() * 3;
+		bool ringOk = ring->submitAndWait(0);
+		while(ringOk && expected)
+		{
+			struct io_uring_cqe cqe;
+			if(!ring->waitCompletion(cqe))
+			{
+				ringOk = false;
+				break;
+			}
+			inFlight[cqe.user_data >> 2].results[cqe.user_data & 3] = cqe.res;
+			expected--;
+		}
+		if(!ringOk)
+		{
+			// The ring is unusable, there is nothing safe to do but to give up on it
+			printf("io_uring failure: %s\n", strerror(errno));
+			ringFailed = true;
+			return false;
+		}
+		bool ok = true;
+		uint32_t leakedSlots = 0;
+		for(uint32_t i=0;i<inFlight.size();i++)
+		{
+			InFlight& f = inFlight[i];
+			if(f.results[0] >= 0 && f.results[1] == int(f.len) && f.results[2] == 0)
+			{
+				// Already closed, the data is synced with the rest of the batch
+				Pending p;
+				p.path = f.path;
+				p.tmpPath = f.tmpPath;
+				p.fd = -1;
+				pending.push_back(p);
+				closeOutputs = true;
+				continue;
+			}
+			// If the chain broke after the open the direct descriptor is still in use
+			if(f.results[0] >= 0)
+			{
+				unlink(f.tmpPath.c_str());
+				if(f.results[2] != 0)
+				{
+					struct io_uring_sqe* sqe = ring->getSqe();
+					sqe->opcode = IORING_OP_CLOSE;
+					sqe->file_index = i + 1;
+					sqe->user_data = i << 2;
+					leakedSlots++;
+				}
+			}
+			if(!writeSync(f.path.c_str(), ring->getArena() + f.arenaOffset, f.len))
+				ok = false;
+		}
+		if(leakedSlots)
+		{
+			ring->submitAndWait(leakedSlots);
+			struct io_uring_cqe cqe;
+			while(leakedSlots && ring->waitCompletion(cqe))
+				leakedSlots--;
+		}
+		inFlight.clear();
+		arenaUsed = 0;
+		ringFailed |= !ok;
+		return ok;
+	}
+	// Queue the chain for an output, returns false if it does not fit in the staging arena or if the
+	// outputs queued before failed, see ringFailed
+	bool queueBuffers(const char* path, const struct iovec* iov, int iovcnt)
+	{
+		size_t len = 0;
+		for(int i=0;i<iovcnt;i++)
+			len += iov[i].iov_len;
+		if(len > ring->getArenaSize() || len > 0x7fffffff)
+			return false;
+		if(arenaUsed + len > ring->getArenaSize() || inFlight.size() == ring->getFileSlots() || ring->getFreeSqes() < 3)
+		{
+			if(!flushRing())
+				return false;
+		}
+		InFlight f;
+		f.path = path;
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%x.%x", unsigned(getpid()), tmpCounter++);
+		f.tmpPath = f.path + suffix;
+		f.arenaOffset = arenaUsed;
+		f.len = len;
+		for(int i=0;i<3;i++)
+			f.results[i] = -ECANCELED;
+		uint8_t* staging = ring->getArena() + arenaUsed;
+		for(int i=0;i<iovcnt;i++)
+		{
+			memcpy(staging, iov[i].iov_base, iov[i].iov_len);
+			staging += iov[i].iov_len;
+		}
+		// Keep the next output aligned
+		arenaUsed += (len + 63) & ~size_t(63);
+		if(arenaUsed > ring->getArenaSize())
+			arenaUsed = ring->getArenaSize();
+		uint64_t id = uint64_t(inFlight.size()) << 2;
+		uint32_t slot = inFlight.size();
+		inFlight.push_back(f);
+		struct io_uring_sqe* sqe = ring->getSqe();
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)inFlight.back().tmpPath.c_str();
+		sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+		sqe->len = 0666;
+		sqe->file_index = slot + 1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = id | 0;
+		sqe = ring->getSqe();
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->fd = slot;
+		sqe->addr = (uintptr_t)(ring->getArena() + f.arenaOffset);
+		sqe->len = len;
+		sqe->off = 0;
+		sqe->buf_index = 0;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		sqe->user_data = id | 1;
+		sqe = ring->getSqe();
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = slot + 1;
+		sqe->user_data = id | 2;
+		return true;
+	}
+#endif
+	bool writeSync(const char* path, const void* data, size_t len)
+	{
+		OutputFile f;
+		return f.open(path) && f.write(data, len) && add(f);
+	}
+	void closeAll()
+	{
+		for(Pending& p: pending)
+		{
+			if(p.fd >= 0)
+				close(p.fd);
+			p.fd = -1;
+		}
+	}
+	bool syncData()
+	{
+		// One syncfs per file system for the files which are already closed
+		std::vector<dev_t> synced;
+		for(Pending& p: pending)
+		{
+			if(p.fd >= 0)
+			{
+				if(fdatasync(p.fd) != 0)
+				{
+					printf("Cannot sync %s: %s\n", p.path.c_str(), strerror(errno));
+					return false;
+				}
+				continue;
+			}
+			std::string dir = parentDirectory(p.path);
+			struct stat st;
+			if(stat(dir.c_str(), &st) != 0)
+				return false;
+			if(std::find(synced.begin(), synced.end(), st.st_dev) != synced.end())
+				continue;
+			int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+			if(dirFd < 0)
+				return false;
+#ifdef __linux__
+			int r = syncfs(dirFd);
+#else
+			sync();
+			int r = 0;
+#endif
+			close(dirFd);
+			if(r != 0)
+			{
+				printf("Cannot sync %s: %s\n", dir.c_str(), strerror(errno));
+				return false;
+			}
+			synced.push_back(st.st_dev);
+		}
+		return true;
+	}
+public:
+	OutputBatch():closeOutputs(false),inMemory(false)
+#ifdef HAVE_IO_RING
+		,arenaUsed(0),tmpCounter(0),ringFailed(false)
+#endif
+	{
+	}
+	OutputBatch(const OutputBatch&) = delete;
+	OutputBatch& operator=(const OutputBatch&) = delete;
+	~OutputBatch()
+	{
+		discard();
+	}
+	// Use io_uring for the outputs passed as buffers, returns false if it is not available
+	bool enableIoRing()
+	{
+#ifdef HAVE_IO_RING
+		if(ring)
+			return true;
+		ring.reset(new IoRing);
+		// 64 chains of 3 entries in flight, staged in 8MB
+		if(ring->init(256, 8 << 20, 64))
+		{
+			// The queued entries point to the temporary paths, they must never move
+			inFlight.reserve(ring->getFileSlots());
+			return true;
+		}
+		ring.reset();
+#endif
+		return false;
+	}
+	// Keep the next outputs in memory, the files added must be opened with keepInMemory as well
+	void keepInMemory()
+	{
+		inMemory = true;
+	}
+	bool isInMemory() const
+	{
+		return inMemory;
+	}
+	// Take over a fully written output, it will be replaced on commit
+	bool add(OutputFile& f)
+	{
+		if(inMemory)
+		{
+			if(!f.inMemory || !f.seal())
+				return false;
+			memoryOutputs.push_back(MemoryOutput{ f.path, f.fd, f.offset });
+			f.fd = -1;
+			return true;
+		}
+		if(pending.size() >= maxOpenFiles && !closeOutputs)
+		{
+			closeAll();
+			closeOutputs = true;
+		}
+		Pending p;
+		p.path = f.path;
+		p.tmpPath = f.tmpPath;
+		p.fd = f.fd;
+		f.fd = -1;
+		f.tmpPath.clear();
+		if(closeOutputs)
+		{
+			int r = close(p.fd);
+			p.fd = -1;
+			if(r != 0)
+			{
+				printf("Cannot write %s: %s\n", p.path.c_str(), strerror(errno));
+				unlink(p.tmpPath.c_str());
+				return false;
+			}
+		}
+		pending.push_back(p);
+		return true;
+	}
+	// Write a whole output from memory, the buffers can be reused as soon as this returns
+	bool addBuffers(const char* path, const struct iovec* iov, int iovcnt)
+	{
+#ifdef HAVE_IO_RING
+		if(ring && !inMemory)
+		{
+			if(queueBuffers(path, iov, iovcnt))
+				return true;
+			// Writing this one synchronously would hide the failure
+			if(ringFailed)
+				return false;
+		}
+#endif
+		OutputFile f;
+		if(inMemory)
+			f.keepInMemory();
+		return f.open(path) && f.writev(iov, iovcnt) && add(f);
+	}
+	bool addBuffer(const char* path, const void* data, size_t len)
+	{
+		struct iovec iov = { (void*)data, len };
+		return addBuffers(path, &iov, 1);
+	}
+	bool commit()
+	{
+#ifdef HAVE_IO_RING
+		if(ring && (!flushRing() || ringFailed))
+		{
+			discard();
+			return false;
+		}
+#endif
+		if(!syncData())
+		{
+			discard();
+			return false;
+		}
+		std::vector<std::string> dirs;
+		bool ok = true;
+		for(Pending& p: pending)
+		{
+			if(p.fd >= 0 && close(p.fd) != 0)
+				ok = false;
+			p.fd = -1;
+			if(!ok || rename(p.tmpPath.c_str(), p.path.c_str()) != 0)
+			{
+				printf("Cannot write %s: %s\n", p.path.c_str(), strerror(errno));
+				unlink(p.tmpPath.c_str());
+				ok = false;
+				continue;
+			}
+			std::string dir = parentDirectory(p.path);
+			if(std::find(dirs.begin(), dirs.end(), dir) == dirs.end())
+				dirs.push_back(dir);
+		}
+		pending.clear();
+		closeOutputs = false;
+		// Make the renames durable, once per directory
+		for(const std::string& dir: dirs)
+		{
+			int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+			if(dirFd >= 0)
+			{
+				fsync(dirFd);
+				close(dirFd);
+			}
+		}
+		return ok;
+	}
+	void discard()
+	{
+#ifdef HAVE_IO_RING
+		// Let the queued chains complete before removing their files
+		if(ring && !inFlight.empty())
+			flushRing();
+		ringFailed = false;
+#endif
+		closeAll();
+		for(Pending& p: pending)
+			unlink(p.tmpPath.c_str());
+		pending.clear();
+		closeOutputs = false;
+		for(MemoryOutput& m: memoryOutputs)
+			close(m.fd);
+		memoryOutputs.clear();
+	}
+	// Hand over the outputs kept in memory, the caller closes them
+	void takeMemoryOutputs(std::vector<MemoryOutput>& outputs)
+	{
+		outputs.insert(outputs.end(), memoryOutputs.begin(), memoryOutputs.end());
+		memoryOutputs.clear();
+	}
+	uint32_t size() const
+	{
+		return pending.size() + memoryOutputs.size();
+	}
+};
+
+#endif
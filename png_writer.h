@@ -0,0 +1,382 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <array>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "icns_image.h"
+
+// A DEFLATE encoder (RFC 1951) with the fixed codes and greedy matching over hash chains
+// Fast rather than small, which suits previews made of flat areas
+class Deflate
+{
+private:
+	static const uint32_t windowSize = 32768;
+	static const uint32_t hashBits = 15;
+	// How many earlier positions with the same hash are tried
+	static const uint32_t maxChain = 16;
+	static const uint32_t minMatch = 3;
+	static const uint32_t maxMatch = 258;
+	// The fixed codes, already reversed as they are sent most significant bit first
+	uint16_t litCodes[288];
+	uint8_t litLens[288];
+	uint8_t distCodes[30];
+	// Symbols for each match length, and for each distance below 256 then by steps of 128
+	uint8_t lengthSymbol[maxMatch + 1];
+	uint8_t distSymbol[512];
+	std::vector<int64_t> head;
+	std::vector<int64_t> prev;
+	std::vector<uint8_t>* out;
+	uint64_t bitBuf;
+	uint32_t bitCount;
+	static uint32_t reverse(uint32_t code, uint32_t len)
+	{
+		uint32_t r = 0;
+		for(uint32_t i=0;i<len;i++, code>>=1)
+			r = (r << 1) | (code & 1);
+		return r;
+	}
+	void putBits(uint32_t v, uint32_t n)
+	{
+		bitBuf |= uint64_t(v) << bitCount;
+		bitCount += n;
+		if(bitCount >= 32)
+		{
+			for(uint32_t i=0;i<4;i++)
+				out->push_back(uint8_t(bitBuf >> (i * 8)));
+			bitBuf >>= 32;
+			bitCount -= 32;
+		}
+	}
+	void flushBits()
+	{
+		for(;bitCount > 0;bitCount -= std::min(bitCount, 8u), bitBuf >>= 8)
+			out->push_back(uint8_t(bitBuf));
+		bitBuf = 0;
+	}
+	void symbol(uint32_t s)
+	{
+		putBits(litCodes[s], litLens[s]);
+	}
+	void match(uint32_t len, uint32_t dist)
+	{
+		static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+		uint32_t l = lengthSymbol[len];
+		symbol(257 + l);
+		if(lengthExtra[l])
+			putBits(len - lengthBase[l], lengthExtra[l]);
+		uint32_t d = distSymbol[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+		putBits(distCodes[d], 5);
+		if(distExtra[d])
+			putBits(dist - distBase[d], distExtra[d]);
+	}
+	static uint32_t hash(const uint8_t* p)
+	{
+		return ((uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2]) * 2654435761u) >> (32 - hashBits);
+	}
+public:
+	Deflate():head(size_t(1) << hashBits),prev(windowSize),out(nullptr),bitBuf(0),bitCount(0)
+	{
+		for(uint32_t s=0;s<288;s++)
+		{
+			uint32_t code, len;
+			if(s < 144)
+				code = 0x30 + s, len = 8;
+			else if(s < 256)
+				code = 0x190 + s - 144, len = 9;
+			else if(s < 280)
+				code = s - 256, len = 7;
+			else
+				code = 0xc0 + s - 280, len = 8;
+			litCodes[s] = reverse(code, len);
+			litLens[s] = len;
+		}
+		for(uint32_t d=0;d<30;d++)
+			distCodes[d] = reverse(d, 5);
+		// Each symbol covers 2^extra values from its base
+		uint32_t l = 0;
+		for(uint32_t s=0;s<28;s++)
+		{
+			uint32_t extra = s < 8 ? 0 : (s - 4) / 4;
+			for(uint32_t i=0;i<(1u << extra);i++)
+				lengthSymbol[3 + l++] = s;
+		}
+		lengthSymbol[maxMatch] = 28;
+		uint32_t d = 0;
+		for(uint32_t s=0;s<16;s++)
+		{
+			uint32_t extra = s < 4 ? 0 : (s - 2) / 2;
+			for(uint32_t i=0;i<(1u << extra);i++)
+				distSymbol[d++] = s;
+		}
+		// The bigger distances are grouped by 128, starting with 257
+		d = 256 + (256 >> 7);
+		for(uint32_t s=16;s<30;s++)
+		{
+			uint32_t extra = (s - 2) / 2;
+			for(uint32_t i=0;i<(1u << (extra - 7));i++)
+				distSymbol[d++] = s;
+		}
+	}
+	// Append the zlib stream (RFC 1950) of data to ret, as a single block
+	void zlibCompress(const uint8_t* data, size_t len, std::vector<uint8_t>& ret)
+	{
+		out = &ret;
+		bitBuf = 0;
+		bitCount = 0;
+		std::fill(head.begin(), head.end(), -1);
+		ret.push_back(0x78);
+		ret.push_back(0x01);
+		// Final block with the fixed codes
+		putBits(3, 3);
+		for(size_t pos=0;pos<len;)
+		{
+			uint32_t bestLen = 0, bestDist = 0;
+			if(len - pos >= minMatch)
+			{
+				uint32_t maxLen = std::min<size_t>(maxMatch, len - pos);
+				uint32_t h = hash(data + pos);
+				int64_t cand = head[h];
+				for(uint32_t chain=0;cand >= 0 && pos - cand <= windowSize && chain < maxChain;chain++)
+				{
+					const uint8_t* a = data + cand;
+					const uint8_t* b = data + pos;
+					if(a[bestLen] == b[bestLen])
+					{
+						uint32_t n = 0;
+						while(n < maxLen && a[n] == b[n])
+							n++;
+						if(n > bestLen)
+						{
+							bestLen = n;
+							bestDist = pos - cand;
+							if(n == maxLen)
+								break;
+						}
+					}
+					cand = prev[cand & (windowSize - 1)];
+				}
+				prev[pos & (windowSize - 1)] = head[h];
+				head[h] = pos;
+			}
+			if(bestLen < minMatch)
+			{
+				symbol(data[pos++]);
+				continue;
+			}
+			match(bestLen, bestDist);
+			// The skipped positions are still inserted, to be found by later matches
+			for(size_t end=pos + bestLen;++pos < end;)
+			{
+				if(len - pos < minMatch)
+					continue;
+				uint32_t h = hash(data + pos);
+				prev[pos & (windowSize - 1)] = head[h];
+				head[h] = pos;
+			}
+		}
+		symbol(256);
+		flushBits();
+		uint32_t adler = adler32(data, len);
+		for(int i=3;i>=0;i--)
+			ret.push_back(uint8_t(adler >> (i * 8)));
+		out = nullptr;
+	}
+	static uint32_t adler32(const uint8_t* data, size_t len)
+	{
+		uint32_t a = 1, b = 0;
+		while(len > 0)
+		{
+			// The largest run before the sums can overflow
+			size_t n = std::min<size_t>(len, 5552);
+			len -= n;
+			for(;n > 0;n--)
+			{
+				a += *data++;
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+		}
+		return (b << 16) | a;
+	}
+};
+
+constexpr std::array<uint32_t, 256> makeCrcTable()
+{
+	std::array<uint32_t, 256> table = {};
+	for(uint32_t i=0;i<256;i++)
+	{
+		uint32_t c = i;
+		for(int k=0;k<8;k++)
+			c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		table[i] = c;
+	}
+	return table;
+}
+
+inline uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0)
+{
+	static constexpr std::array<uint32_t, 256> table = makeCrcTable();
+	crc = ~crc;
+	for(size_t i=0;i<len;i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Encodes opaque images to 8-bit RGB PNG files, the buffers are kept between images
+class PngWriter
+{
+private:
+	Deflate deflate;
+	// The filtered rows, each one starting with its filter type
+	std::vector<uint8_t> filtered;
+	std::vector<uint8_t> rows[2];
+	std::vector<uint8_t> candidate;
+	static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+	{
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+		if(pa <= pb && pa <= pc)
+			return a;
+		return pb <= pc ? b : c;
+	}
+	static void putBE32(std::vector<uint8_t>& out, uint32_t v)
+	{
+		for(int i=3;i>=0;i--)
+			out.push_back(uint8_t(v >> (i * 8)));
+	}
+	// The chunk data must already be at the end of out, after its length and type
+	static void finishChunk(std::vector<uint8_t>& out, size_t start)
+	{
+		uint32_t len = out.size() - start - 8;
+		for(int i=0;i<4;i++)
+			out[start + i] = uint8_t(len >> ((3 - i) * 8));
+		putBE32(out, crc32(out.data() + start + 4, len + 4));
+	}
+	static size_t beginChunk(std::vector<uint8_t>& out, const char* type)
+	{
+		size_t start = out.size();
+		putBE32(out, 0);
+		out.insert(out.end(), type, type + 4);
+		return start;
+	}
+	static uint8_t predict(uint32_t filter, uint8_t a, uint8_t b, uint8_t c)
+	{
+		switch(filter)
+		{
+			case 1: return a;
+			case 2: return b;
+			case 3: return (a + b) >> 1;
+			case 4: return paeth(a, b, c);
+		}
+		return 0;
+	}
+	// One loop per filter, so that the simple ones are vectorized
+	template<uint32_t Filter>
+	static uint64_t applyFilter(const uint8_t* row, const uint8_t* prev, uint32_t stride, uint8_t* out)
+	{
+		const uint32_t bpp = 3;
+		uint64_t cost = 0;
+		for(uint32_t i=0;i<bpp && i<stride;i++)
+		{
+			out[i] = row[i] - predict(Filter, 0, prev[i], 0);
+			cost += abs(int8_t(out[i]));
+		}
+		for(uint32_t i=bpp;i<stride;i++)
+		{
+			out[i] = row[i] - predict(Filter, row[i - bpp], prev[i], prev[i - bpp]);
+			cost += abs(int8_t(out[i]));
+		}
+		return cost;
+	}
+	// Pick the filter with the smallest sum of absolute differences, the usual heuristic
+	// The row above the first one is taken as zeros
+	void filterRow(const uint8_t* row, const uint8_t* prev, uint32_t stride)
+	{
+		typedef uint64_t (*FilterFunc)(const uint8_t*, const uint8_t*, uint32_t, uint8_t*);
+		static const FilterFunc filters[5] = { applyFilter<0>, applyFilter<1>, applyFilter<2>, applyFilter<3>, applyFilter<4> };
+		size_t start = filtered.size();
+		filtered.resize(start + 1 + stride);
+		candidate.resize(stride);
+		uint64_t bestCost = UINT64_MAX;
+		for(uint32_t filter=0;filter<5;filter++)
+		{
+			uint64_t cost = filters[filter](row, prev, stride, candidate.data());
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				filtered[start] = filter;
+				memcpy(filtered.data() + start + 1, candidate.data(), stride);
+			}
+		}
+	}
+public:
+	// The alpha channel is dropped
+	void encode(const Image& img, std::vector<uint8_t>& out)
+	{
+		static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		out.assign(signature, signature + 8);
+		size_t start = beginChunk(out, "IHDR");
+		putBE32(out, img.width);
+		putBE32(out, img.height);
+		// 8-bit RGB, deflate, adaptive filtering, no interlacing
+		const uint8_t header[5] = { 8, 2, 0, 0, 0 };
+		out.insert(out.end(), header, header + 5);
+		finishChunk(out, start);
+		uint32_t stride = img.width * 3;
+		filtered.clear();
+		rows[1].assign(stride, 0);
+		for(uint32_t y=0;y<img.height;y++)
+		{
+			std::vector<uint8_t>& row = rows[y & 1];
+			row.resize(stride);
+			const uint8_t* src = img.pixels.data() + size_t(y) * img.width * 4;
+			for(uint32_t x=0;x<img.width;x++)
+				memcpy(row.data() + x * 3, src + x * 4, 3);
+			filterRow(row.data(), rows[(y + 1) & 1].data(), stride);
+		}
+		start = beginChunk(out, "IDAT");
+		deflate.zlibCompress(filtered.data(), filtered.size(), out);
+		finishChunk(out, start);
+		finishChunk(out, beginChunk(out, "IEND"));
+	}
+};
+
+#endif
@@ -0,0 +1,374 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ds_store_reader.h"
+#include "finder_layout.h"
+#include "icns_image.h"
+#include "manifest_reader.h"
+#include "output_file.h"
+#include "png_writer.h"
+#include "thread_pool.h"
+
+// Bigger windows do not fit on any screen
+static const uint32_t maxWindowSize = 8192;
+// Premultiplied colors of the boxes drawn for missing icons and for the labels
+static const uint8_t placeholderColor[4] = { 96, 96, 96, 160 };
+static const uint8_t labelColor[4] = { 30, 60, 110, 128 };
+
+struct PreviewOptions
+{
+	// Where the files of the volume are, the background and the bundles are looked up there
+	std::string root = ".";
+	// Explicit icons for some files, by name
+	std::map<std::string, std::string> icons;
+	std::string defaultIcon;
+};
+
+// The buffers of a worker, kept between previews
+struct WorkerBuffers
+{
+	std::vector<uint8_t> file;
+	IcnsReader icns;
+	PngDecoder png;
+	PngWriter writer;
+	BoxScaler scaler;
+	Image decoded;
+	Image canvas;
+	std::vector<uint8_t> output;
+};
+
+bool readFile(const char* fileName, std::vector<uint8_t>& data)
+{
+	int fd = open(fileName, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size > 0x7fffffff)
+	{
+		close(fd);
+		return false;
+	}
+	data.resize(st.st_size);
+	ssize_t r;
+	do
+		r = pread(fd, data.data(), data.size(), 0);
+	while(r < 0 && errno == EINTR);
+	close(fd);
+	return r == ssize_t(data.size());
+}
+
+// Pictures decoded once for all the previews, premultiplied. Icons are kept by file and size,
+// backgrounds by file with a size of 0.
+class ImageCache
+{
+private:
+	std::mutex mutex;
+	// Unusable files are kept as null, so they are only reported once
+	std::map<std::pair<std::string, uint32_t>, std::shared_ptr<const Image>> images;
+	std::shared_ptr<const Image> get(const std::string& fileName, uint32_t size, WorkerBuffers& buffers)
+	{
+		auto key = std::make_pair(fileName, size);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = images.find(key);
+			if(it != images.end())
+				return it->second;
+		}
+		// Decoded outside of the lock, two workers may race on the same file but only one is kept
+		std::shared_ptr<Image> image;
+		if(readFile(fileName.c_str(), buffers.file))
+		{
+			const uint8_t* data = buffers.file.data();
+			uint32_t len = buffers.file.size();
+			if(size == 0 && buffers.png.decode(data, len, buffers.decoded, maxWindowSize))
+			{
+				premultiplyAlpha(buffers.decoded);
+				image = std::make_shared<Image>(std::move(buffers.decoded));
+			}
+			else if(size && buffers.icns.parse(data, len) && buffers.icns.decode(size, buffers.decoded))
+			{
+				premultiplyAlpha(buffers.decoded);
+				image = std::make_shared<Image>();
+				buffers.scaler.scale(buffers.decoded, size, *image);
+			}
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		auto inserted = images.emplace(key, image);
+		if(inserted.second && !image)
+		{
+			if(size)
+				printf("No usable image in %s\n", fileName.c_str());
+			else
+				printf("Cannot use the background %s, it must be a readable PNG\n", fileName.c_str());
+		}
+		return inserted.first->second;
+	}
+public:
+	// Returns null if the file is not a usable icns
+	std::shared_ptr<const Image> getIcon(const std::string& fileName, uint32_t size, WorkerBuffers& buffers)
+	{
+		return get(fileName, size, buffers);
+	}
+	// Returns null if the file is not a PNG
+	std::shared_ptr<const Image> getBackground(const std::string& fileName, WorkerBuffers& buffers)
+	{
+		return get(fileName, 0, buffers);
+	}
+};
+
+// The icon file of an item: given explicitly, the one of the bundle or the default one
+std::string findIcon(const std::string& name, const PreviewOptions& options, std::vector<uint8_t>& buffer)
+{
+	auto it = options.icons.find(name);
+	if(it != options.icons.end())
+		return it->second;
+	// Only XML property lists are looked into
+	std::string contents = options.root + "/" + name + "/Contents/";
+	if(readFile((contents + "Info.plist").c_str(), buffer))
+	{
+		std::string_view plist((const char*)buffer.data(), buffer.size());
+		size_t key = plist.find("<key>CFBundleIconFile</key>");
+		size_t start = key == std::string_view::npos ? key : plist.find("<string>", key);
+		size_t end = start == std::string_view::npos ? start : plist.find("</string>", start);
+		if(end != std::string_view::npos)
+		{
+			std::string iconFile(plist.substr(start + 8, end - start - 8));
+			if(iconFile.find('.') == std::string::npos)
+				iconFile += ".icns";
+			std::string path = contents + "Resources/" + iconFile;
+			if(access(path.c_str(), R_OK) == 0)
+				return path;
+		}
+	}
+	return options.defaultIcon;
+}
+
+// Draw the window of the layout in buffers.canvas: the background, the icons and the boxes of the labels
+bool renderPreview(const FinderLayout& layout, const PreviewOptions& options, ImageCache& images, WorkerBuffers& buffers)
+{
+	if(layout.width == 0 || layout.height == 0 || layout.width > maxWindowSize || layout.height > maxWindowSize)
+	{
+		printf("Invalid window size %ux%u\n", layout.width, layout.height);
+		return false;
+	}
+	if(layout.iconSize == 0 || layout.iconSize > maxImageSize)
+	{
+		printf("Invalid icon size %u\n", layout.iconSize);
+		return false;
+	}
+	Image& canvas = buffers.canvas;
+	canvas.resize(layout.width, layout.height);
+	std::fill(canvas.pixels.begin(), canvas.pixels.end(), 0xff);
+	if(!layout.background.empty())
+	{
+		std::shared_ptr<const Image> background = images.getBackground(options.root + "/" + layout.background, buffers);
+		if(background)
+			blendImage(canvas, *background, 0, 0);
+	}
+	for(const LayoutItem& item: layout.items)
+	{
+		Rect r = iconRect(layout, item);
+		std::string iconFile = findIcon(item.name, options, buffers.file);
+		std::shared_ptr<const Image> icon = iconFile.empty() ? nullptr : images.getIcon(iconFile, layout.iconSize, buffers);
+		if(icon)
+			blendImage(canvas, *icon, r.left, r.top);
+		else
+			blendRect(canvas, r.left, r.top, r.right - r.left, r.bottom - r.top, placeholderColor);
+	}
+	// The labels come last, Finder draws them over the neighbouring icons
+	for(const LayoutItem& item: layout.items)
+	{
+		Rect r = labelRect(layout, item);
+		blendRect(canvas, r.left, r.top, r.right - r.left, r.bottom - r.top, labelColor);
+	}
+	return true;
+}
+
+// A preview to render, either from a store or from the forge arguments
+struct PreviewJob
+{
+	std::string output;
+	std::string store;
+	FinderLayout layout;
+};
+
+// Render the preview of a job as an uncommitted output
+bool renderJob(const PreviewJob& job, const PreviewOptions& options, ImageCache& images, WorkerBuffers& buffers, OutputFile& outFile)
+{
+	FinderLayout stored;
+	const FinderLayout* layout = &job.layout;
+	if(!job.store.empty())
+	{
+		DSStore store;
+		if(!store.open(job.store.c_str()) || !loadLayout(store, job.store.c_str(), stored))
+			return false;
+		layout = &stored;
+	}
+	if(!renderPreview(*layout, options, images, buffers))
+		return false;
+	buffers.writer.encode(buffers.canvas, buffers.output);
+	return outFile.open(job.output.c_str()) && outFile.write(buffers.output.data(), buffers.output.size());
+}
+
+// The arguments after the output file are a store, or the layout in the forge_ds_store form
+bool makeJob(const char* output, const std::vector<std::string_view>& args, PreviewJob& job)
+{
+	job.output = output;
+	job.store.clear();
+	if(args.size() == 1)
+	{
+		job.store = args[0];
+		return true;
+	}
+	return parseLayoutArgs(args, job.layout);
+}
+
+// Read the list of output.png<TAB>file.DS_Store or output.png<TAB>bg.img<TAB>... lines
+bool readJobs(const char* listFileName, std::vector<PreviewJob>& jobs)
+{
+	jobs.clear();
+	ManifestReader reader;
+	if(!reader.open(listFileName))
+		return false;
+	std::string_view line;
+	std::vector<std::string_view> args;
+	while(reader.nextLine(line))
+	{
+		const std::vector<std::string_view>& fields = reader.getFields();
+		args.assign(fields.begin() + 1, fields.end());
+		jobs.emplace_back();
+		if(fields.size() < 2 || !makeJob(std::string(fields[0]).c_str(), args, jobs.back()))
+		{
+			printf("%s:%u: Expected output.png file.DS_Store or output.png bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n",
+				listFileName, reader.getLineNum());
+			return false;
+		}
+	}
+	return true;
+}
+
+// Render the previews in parallel, they are synced together at the end
+int previewBatch(const char* listFileName, uint32_t threadCount, const PreviewOptions& options)
+{
+	std::vector<PreviewJob> jobs;
+	if(!readJobs(listFileName, jobs))
+		return 1;
+	auto start = std::chrono::steady_clock::now();
+	ThreadPool pool(threadCount);
+	std::vector<WorkerBuffers> workerBuffers(pool.getThreadCount());
+	ImageCache images;
+	OutputBatch batch;
+	std::mutex batchMutex;
+	std::atomic<bool> failed(false);
+	std::atomic<uint64_t> bytes(0);
+	pool.parallelFor(jobs.size(), [&](uint32_t i, uint32_t thread)
+	{
+		if(failed.load(std::memory_order_relaxed))
+			return;
+		OutputFile outFile;
+		if(!renderJob(jobs[i], options, images, workerBuffers[thread], outFile))
+		{
+			printf("Cannot render %s\n", jobs[i].output.c_str());
+			failed = true;
+			return;
+		}
+		bytes += outFile.getSize();
+		std::lock_guard<std::mutex> lock(batchMutex);
+		if(!batch.add(outFile))
+			failed = true;
+	});
+	if(failed || !batch.commit())
+		return 1;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Rendered %zu previews, %.1f MB in %.1f ms: %.0f previews/s with %u threads\n", jobs.size(),
+		bytes / (1024.0 * 1024.0), ms, jobs.size() * 1000.0 / ms, pool.getThreadCount());
+	return 0;
+}
+
+int usage(const char* progName)
+{
+	printf("Usage: %s [--root dir] [--icon file_name=file.icns]... [--default-icon file.icns] output.png file.DS_Store\n", progName);
+	printf("       %s [options] output.png bg.img bg_width bg_height volume_name icon_size text_size [file_name file_center_x file_center_y]+\n", progName);
+	printf("       %s [options] --batch list.txt [--jobs N]\n", progName);
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	// The options come before the other arguments
+	PreviewOptions options;
+	while(argc >= 3)
+	{
+		if(strcmp(argv[1], "--root") == 0)
+			options.root = argv[2];
+		else if(strcmp(argv[1], "--default-icon") == 0)
+			options.defaultIcon = argv[2];
+		else if(strcmp(argv[1], "--icon") == 0)
+		{
+			const char* eq = strchr(argv[2], '=');
+			if(eq == nullptr)
+				return usage(argv[0]);
+			options.icons[std::string(argv[2], eq - argv[2])] = eq + 1;
+		}
+		else
+			break;
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	if(argc >= 3 && strcmp(argv[1], "--batch") == 0)
+	{
+		uint32_t threadCount = 0;
+		if(argc != 3 && (argc != 5 || strcmp(argv[3], "--jobs") != 0 || !parseInt(argv[4], threadCount)))
+			return usage(argv[0]);
+		return previewBatch(argv[2], threadCount, options);
+	}
+	if(argc < 3)
+		return usage(argv[0]);
+	std::vector<std::string_view> args(argv + 2, argv + argc);
+	PreviewJob job;
+	if(!makeJob(argv[1], args, job))
+		return usage(argv[0]);
+	ImageCache images;
+	WorkerBuffers buffers;
+	OutputFile outFile;
+	if(!renderJob(job, options, images, buffers, outFile))
+		return 1;
+	return outFile.commit() ? 0 : 1;
+}
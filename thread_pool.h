@@ -0,0 +1,130 @@
+/*
+ * The MIT License (MIT)
+ * MIT License
+ * 
+ * Copyright (c) 2019 Leaning Technologies Ltd
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of workers for parallel loops, the calling thread takes part as well
+class ThreadPool
+{
+public:
+	// Called with the loop index and the id of the thread running it, ids are below getThreadCount()
+	typedef std::function<void(uint32_t index, uint32_t thread)> Job;
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const Job* job;
+	uint32_t jobCount;
+	std::atomic<uint32_t> nextIndex;
+	// Workers still inside the current loop
+	uint32_t busy;
+	uint64_t generation;
+	bool stopping;
+	void runJob(uint32_t thread)
+	{
+		uint32_t i;
+		while((i = nextIndex.fetch_add(1, std::memory_order_relaxed)) < jobCount)
+			(*job)(i, thread);
+	}
+	void workerLoop(uint32_t thread)
+	{
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true)
+		{
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if(stopping)
+				return;
+			seen = generation;
+			lock.unlock();
+			runJob(thread);
+			lock.lock();
+			if(--busy == 0)
+				done.notify_one();
+		}
+	}
+public:
+	// By default use one thread per core
+	explicit ThreadPool(uint32_t threadCount = 0):job(nullptr),jobCount(0),nextIndex(0),busy(0),generation(0),stopping(false)
+	{
+		if(threadCount == 0)
+			threadCount = std::thread::hardware_concurrency();
+		for(uint32_t i=1;i<threadCount;i++)
+			workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for(std::thread& t: workers)
+			t.join();
+	}
+	uint32_t getThreadCount() const
+	{
+		return workers.size() + 1;
+	}
+	// Run f for all the indexes in [0, count) and wait for all of them
+	void parallelFor(uint32_t count, const Job& f)
+	{
+		if(count == 0)
+			return;
+		if(workers.empty() || count == 1)
+		{
+			for(uint32_t i=0;i<count;i++)
+				f(i, 0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &f;
+			jobCount = count;
+			nextIndex.store(0, std::memory_order_relaxed);
+			busy = workers.size();
+			generation++;
+		}
+		wake.notify_all();
+		runJob(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return busy == 0; });
+		job = nullptr;
+	}
+};
+
+#endif